@@ -1,75 +1,206 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <unistd.h>
-#include "config.h"
-
-enum config_params {
-    config_params_stage = 1,
-    config_params_num_routers
-};
-
-/* Parse the given config file 
- * I/P - Config file (config_file)
- * O/P - Stage number (stage) and Number of routers (num_routers) */
-bool parse_config_file(char *config_file, int *stage, int *num_routers)
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+#include "checksum.h"
+
+/* Fold a 64 bit one's complement sum down to 16 bits */
+static inline uint16_t checksum_fold(uint64_t sum)
 {
-    FILE *fp = NULL;
-    char *line = NULL;
-    char *param = NULL;
-    size_t len = 0;
-    bool skip = false;
-    int config_params_id = 0;
-
-    fp = fopen(config_file, "r");
-    if (!fp) {
-        printf("\n Unable to open config file %s - %s", config_file, strerror(errno));
-        return false;
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t) sum;
+}
+
+/* Sum the tail of a buffer (less than a word) the way RFC 1071 does: 16 bit
+ * words in memory order, an odd last byte padded with zero */
+static inline uint64_t checksum_tail(const uint8_t *data, size_t count)
+{
+    uint64_t sum = 0;
+    uint16_t word = 0;
+
+    while (count > 1) {
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += 2;
+        count -= 2;
     }
+    if (count) {
+        word = 0;
+        memcpy(&word, data, 1);
+        sum += word;
+    }
+    return sum;
+}
 
-    while (getline(&line, &len, fp) != -1) {
-        skip = false;
-        config_params_id = 0;
+/* Portable kernel: add 32 bit words into a 64 bit accumulator, so carries
+ * only have to be folded once at the end */
+uint16_t checksum_scalar(const void *addr, size_t count)
+{
+    const uint8_t *data = (const uint8_t *) addr;
+    uint64_t sum = 0;
+    uint32_t word = 0;
 
-        /* Get the first parameter after a series of spaces */
-        param = strtok (line, " ");
-        while (param) {
-            if (param[0] == '#') {
-                /* This line is a comment */
-                break;
-            }
+    while (count >= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += sizeof(word);
+        count -= sizeof(word);
+    }
+    sum += checksum_tail(data, count);
+    return (uint16_t) ~checksum_fold(sum);
+}
 
-            /* Check the parameter read previously and set the corresponding
-             * variable with the value read. */
-            switch (config_params_id)
-            {
-                case config_params_stage:
-                    *stage = atoi(param);
-                    skip = true;
-                    break;
-                case config_params_num_routers:
-                    *num_routers = atoi(param);
-                    skip = true;
-                    break;
-            }
-            if (skip) {
-                break;
-            }
+#ifdef CHECKSUM_X86
+
+/* Each 32 bit lane takes two 16 bit words per vector, so lanes are spilled
+ * into the 64 bit sum before they can overflow */
+#define CHECKSUM_SIMD_BLOCK 16384
+
+/* Add up the four 32 bit lanes of acc */
+__attribute__((target("sse2")))
+static inline uint64_t checksum_sse2_lanes(__m128i acc)
+{
+    uint32_t lanes[4];
+
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+/* SSE2 kernel: zero-extend the 16 bit words of each 16 byte vector into 32
+ * bit lanes and add them up */
+__attribute__((target("sse2")))
+uint16_t checksum_sse2(const void *addr, size_t count)
+{
+    const uint8_t *data = (const uint8_t *) addr;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    __m128i vec = zero;
+    uint64_t sum = 0;
+    size_t block = 0;
+
+    while (count >= sizeof(vec)) {
+        vec = _mm_loadu_si128((const __m128i *) data);
+        acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(vec, zero));
+        acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(vec, zero));
+        data += sizeof(vec);
+        count -= sizeof(vec);
+        if (++block == CHECKSUM_SIMD_BLOCK) {
+            sum += checksum_sse2_lanes(acc);
+            acc = zero;
+            block = 0;
+        }
+    }
+    sum += checksum_sse2_lanes(acc);
+    sum += checksum_tail(data, count);
+    return (uint16_t) ~checksum_fold(sum);
+}
 
-            /* Check if the given parameter is stage or num_routers */
-            if (strncmp(param, CONFIG_PARAM_STAGE, strlen(CONFIG_PARAM_STAGE)) == 0) {
-                config_params_id = config_params_stage;
-            } else if (strncmp(param, CONFIG_PARAM_NUM_ROUTERS, strlen(CONFIG_PARAM_NUM_ROUTERS)) == 0) {
-                config_params_id = config_params_num_routers;
+/* AVX2 kernel: same as SSE2 on 32 byte vectors */
+__attribute__((target("avx2")))
+uint16_t checksum_avx2(const void *addr, size_t count)
+{
+    const uint8_t *data = (const uint8_t *) addr;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    __m256i vec = zero;
+    uint32_t lanes[8];
+    uint64_t sum = 0;
+    size_t block = 0;
+    int i = 0;
+
+    while (count >= sizeof(vec)) {
+        vec = _mm256_loadu_si256((const __m256i *) data);
+        acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(vec, zero));
+        acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(vec, zero));
+        data += sizeof(vec);
+        count -= sizeof(vec);
+        if (++block == CHECKSUM_SIMD_BLOCK || count < sizeof(vec)) {
+            _mm256_storeu_si256((__m256i *) lanes, acc);
+            for (i = 0; i < 8; i++) {
+                sum += lanes[i];
             }
-            param = strtok (NULL, " ");
+            acc = zero;
+            block = 0;
         }
     }
-    if (line) {
-        free(line);
+    sum += checksum_tail(data, count);
+    return (uint16_t) ~checksum_fold(sum);
+}
+
+#else
+
+uint16_t checksum_sse2(const void *addr, size_t count)
+{
+    return checksum_scalar(addr, count);
+}
+
+uint16_t checksum_avx2(const void *addr, size_t count)
+{
+    return checksum_scalar(addr, count);
+}
+
+#endif
+
+/* Pick the fastest kernel the CPU supports. name (if given) is set to the
+ * kernel's name */
+checksum_fn checksum_kernel(const char **name)
+{
+    checksum_fn kernel = checksum_scalar;
+    const char *kernel_name = "scalar";
+
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = checksum_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = checksum_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+    if (name) {
+        *name = kernel_name;
+    }
+    return kernel;
+}
+
+/* Checksum count bytes at addr with the kernel picked on first use */
+uint16_t checksum(const void *addr, size_t count)
+{
+    static checksum_fn kernel = NULL;
+    checksum_fn fn = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+
+    if (!fn) {
+        fn = checksum_kernel(NULL);
+        __atomic_store_n(&kernel, fn, __ATOMIC_RELAXED);
     }
-    return true;
+    return fn(addr, count);
 }
 
+/* A header with it's checksum field filled in sums up to zero */
+bool checksum_valid(const void *addr, size_t count)
+{
+    return checksum(addr, count) == 0;
+}
+
+/* Update check after a 16 bit word of the covered data changed from
+ * old_word to new_word (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m')). Words are
+ * taken in memory order, like checksum() */
+uint16_t checksum_update16(uint16_t check, uint16_t old_word, uint16_t new_word)
+{
+    uint32_t sum = 0;
+
+    sum = (uint16_t) ~check;
+    sum += (uint16_t) ~old_word;
+    sum += new_word;
+    return (uint16_t) ~checksum_fold(sum);
+}
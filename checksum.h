@@ -1,6 +1,20 @@
 #ifndef CHECKSUM
 #define CHECKSUM
 
-unsigned short checksum(char *addr, short count);
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Internet checksum (RFC 1071) of count bytes at addr. The result is in
+ * the byte order of the data, so it can be memcpy'd into the header as is */
+typedef uint16_t (*checksum_fn)(const void *addr, size_t count);
+
+uint16_t checksum(const void *addr, size_t count);
+uint16_t checksum_scalar(const void *addr, size_t count);
+uint16_t checksum_sse2(const void *addr, size_t count);
+uint16_t checksum_avx2(const void *addr, size_t count);
+checksum_fn checksum_kernel(const char **name);
+bool checksum_valid(const void *addr, size_t count);
+uint16_t checksum_update16(uint16_t check, uint16_t old_word, uint16_t new_word);
 
 #endif
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "checksum.h"
+
+/* Bytes checksummed per kernel and payload size */
+#define BENCH_TOTAL_BYTES (256UL * 1024 * 1024)
+#define BENCH_MAX_SIZE 65536
+
+struct bench_kernel {
+    const char *name;
+    checksum_fn fn;
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Microbenchmark of the checksum kernels over a range of payload sizes.
+ * Prints the throughput of each kernel in GB/s and checks that all kernels
+ * agree with the scalar one */
+int main(void)
+{
+    static const size_t sizes[] = {20, 64, 84, 256, 576, 1024, 1500, 9000, BENCH_MAX_SIZE};
+    struct bench_kernel kernels[] = {
+        {"scalar", checksum_scalar},
+        {"sse2", checksum_sse2},
+        {"avx2", checksum_avx2},
+    };
+    int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+    const char *selected = NULL;
+    volatile uint16_t sink = 0;
+    uint8_t *buffer = NULL;
+    uint16_t expected = 0;
+    size_t iterations = 0;
+    size_t s = 0;
+    size_t n = 0;
+    double start = 0;
+    double elapsed = 0;
+    int k = 0;
+
+    buffer = (uint8_t *) malloc(BENCH_MAX_SIZE + 1);
+    if (!buffer) {
+        printf("\n Unable to allocate memory");
+        return 1;
+    }
+    srand(1);
+    for (n = 0; n <= BENCH_MAX_SIZE; n++) {
+        buffer[n] = rand();
+    }
+
+    checksum_kernel(&selected);
+    printf("Selected kernel: %s\n", selected);
+    printf("%8s", "bytes");
+    for (k = 0; k < num_kernels; k++) {
+        printf(" %10s", kernels[k].name);
+    }
+    printf("   (GB/s)\n");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        /* Unaligned start and odd length as well, to exercise the tails */
+        for (n = 0; n < 2; n++) {
+            expected = checksum_scalar(buffer + n, sizes[s] - n);
+            for (k = 1; k < num_kernels; k++) {
+                if (kernels[k].fn(buffer + n, sizes[s] - n) != expected) {
+                    printf("\n Kernel %s disagrees on %zu bytes\n", kernels[k].name, sizes[s] - n);
+                    free(buffer);
+                    return 1;
+                }
+            }
+        }
+
+        printf("%8zu", sizes[s]);
+        iterations = BENCH_TOTAL_BYTES / sizes[s];
+        for (k = 0; k < num_kernels; k++) {
+            start = now_seconds();
+            for (n = 0; n < iterations; n++) {
+                sink += kernels[k].fn(buffer, sizes[s]);
+            }
+            elapsed = now_seconds() - start;
+            printf(" %10.2f", (double) iterations * sizes[s] / elapsed / 1e9);
+        }
+        printf("\n");
+    }
+
+    free(buffer);
+    return 0;
+}
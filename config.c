@@ -4,17 +4,109 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include "config.h"
 
 enum config_params {
     config_params_stage = 1,
-    config_params_num_routers
+    config_params_num_routers,
+    config_params_batch_size,
+    config_params_pool_size,
+    config_params_hugepages,
+    config_params_tun_queues,
+    config_params_route,
+    config_params_control,
+    config_params_ipc,
+    config_params_ring_size,
+    config_params_io_uring,
+    config_params_metrics,
+    config_params_trace,
+    config_params_mtu,
+    config_params_vnet_hdr,
+    config_params_runtime,
+    config_params_police,
+    config_params_police_size,
+    config_params_queue,
+    config_params_queue_policy,
+    config_params_egress,
+    config_params_udp_window
 };
 
-/* Parse the given config file 
+const char *police_class_names[POLICE_CLASSES] = {"icmp", "udp", "tcp", "other"};
+
+/* Parse "<prefix>/<length>" and the router id following it and add the
+ * route to config */
+static bool config_add_route(struct router_config *config, char *prefix, char *router)
+{
+    struct config_route *routes = NULL;
+    struct in_addr addr = {0};
+    char *slash = NULL;
+    int len = 32;
+
+    if (!router) {
+        printf("\n Missing router for route %s", prefix);
+        return false;
+    }
+
+    slash = strchr(prefix, '/');
+    if (slash) {
+        *slash = '\0';
+        len = atoi(slash + 1);
+    }
+    if (inet_pton(AF_INET, prefix, &addr) != 1 || len < 0 || len > 32) {
+        printf("\n Invalid route prefix %s/%d", prefix, len);
+        return false;
+    }
+
+    routes = (struct config_route *) realloc (config->routes,
+            (config->num_routes + 1) * sizeof(*routes));
+    if (!routes) {
+        printf("\n Unable to allocate memory for route - %s", strerror(errno));
+        return false;
+    }
+    config->routes = routes;
+    routes[config->num_routes].prefix = ntohl(addr.s_addr);
+    routes[config->num_routes].len = len;
+    routes[config->num_routes].router_id = strncmp(router, "local", strlen("local")) == 0 ?
+        CONFIG_ROUTE_LOCAL : atoi(router);
+    config->num_routes++;
+    return true;
+}
+
+/* Parse "<class> <rate> <burst>", class being the token already read and
+ * rate and burst the next ones on the line, and set the class's policing */
+static bool config_set_police(struct router_config *config, char *class_name)
+{
+    char *rate = strtok (NULL, " ");
+    char *burst = strtok (NULL, " ");
+    int class = 0;
+
+    for (class = 0; class < POLICE_CLASSES; class++) {
+        if (strncmp(class_name, police_class_names[class],
+                    strlen(police_class_names[class])) == 0) {
+            break;
+        }
+    }
+    if (class == POLICE_CLASSES || !rate || !burst) {
+        printf("\n Invalid police %s, expecting <icmp|udp|tcp|other> <rate> <burst>", class_name);
+        return false;
+    }
+    config->police[class].rate = (uint32_t) strtoul(rate, NULL, 10);
+    config->police[class].burst = (uint32_t) strtoul(burst, NULL, 10);
+    if (config->police[class].burst == 0) {
+        config->police[class].burst = 1;
+    }
+    return true;
+}
+
+/* Parse the given config file
  * I/P - Config file (config_file)
- * O/P - Stage number (stage) and Number of routers (num_routers) */
-bool parse_config_file(char *config_file, int *stage, int *num_routers)
+ * O/P - Stage number, Number of routers, IPC batch size, packet pool
+ *       settings, number of TUN queues, routes, control socket path,
+ *       IPC transport, I/O backend, metrics socket path, trace
+ *       sample rate, MTU, vnet_hdr mode, runtime, policing and IPC queues
+ *       (config) */
+bool parse_config_file(char *config_file, struct router_config *config)
 {
     FILE *fp = NULL;
     char *line = NULL;
@@ -23,6 +115,31 @@ bool parse_config_file(char *config_file, int *stage, int *num_routers)
     bool skip = false;
     int config_params_id = 0;
 
+    config->stage = 0;
+    config->num_routers = 0;
+    config->batch_size = DEFAULT_BATCH_SIZE;
+    config->pool_size = DEFAULT_POOL_SIZE;
+    config->hugepages = false;
+    config->tun_queues = 1;
+    config->routes = NULL;
+    config->num_routes = 0;
+    config->control_socket[0] = '\0';
+    config->ipc = ipc_transport_shm;
+    config->ring_size = DEFAULT_RING_SIZE;
+    config->udp_window = DEFAULT_UDP_WINDOW;
+    config->io_uring = false;
+    config->metrics_socket[0] = '\0';
+    config->trace_sample = 0;
+    config->mtu = 0;
+    config->vnet_hdr = false;
+    config->runtime = router_runtime_process;
+    memset(config->police, 0, sizeof(config->police));
+    config->police_sources = DEFAULT_POLICE_SOURCES;
+    config->queue_high = DEFAULT_QUEUE_HIGH;
+    config->queue_low = DEFAULT_QUEUE_LOW;
+    config->queue_policy = ipc_queue_tail_drop;
+    config->egress_device[0] = '\0';
+
     fp = fopen(config_file, "r");
     if (!fp) {
         printf("\n Unable to open config file %s - %s", config_file, strerror(errno));
@@ -46,11 +163,116 @@ bool parse_config_file(char *config_file, int *stage, int *num_routers)
             switch (config_params_id)
             {
                 case config_params_stage:
-                    *stage = atoi(param);
+                    config->stage = atoi(param);
                     skip = true;
                     break;
                 case config_params_num_routers:
-                    *num_routers = atoi(param);
+                    config->num_routers = atoi(param);
+                    skip = true;
+                    break;
+                case config_params_batch_size:
+                    config->batch_size = atoi(param);
+                    skip = true;
+                    break;
+                case config_params_pool_size:
+                    config->pool_size = atoi(param);
+                    skip = true;
+                    break;
+                case config_params_hugepages:
+                    config->hugepages = (atoi(param) != 0);
+                    skip = true;
+                    break;
+                case config_params_tun_queues:
+                    config->tun_queues = atoi(param);
+                    skip = true;
+                    break;
+                case config_params_route:
+                    config_add_route(config, param, strtok (NULL, " "));
+                    skip = true;
+                    break;
+                case config_params_control:
+                    snprintf(config->control_socket, MAX_FILE_LEN, "%s", param);
+                    config->control_socket[strcspn(config->control_socket, "\r\n")] = '\0';
+                    skip = true;
+                    break;
+                case config_params_ipc:
+                    if (strncmp(param, "udp", strlen("udp")) == 0) {
+                        config->ipc = ipc_transport_udp;
+                    } else if (strncmp(param, "shm", strlen("shm")) == 0) {
+                        config->ipc = ipc_transport_shm;
+                    } else {
+                        printf("\n Unknown IPC transport %s", param);
+                    }
+                    skip = true;
+                    break;
+                case config_params_ring_size:
+                    config->ring_size = atoi(param);
+                    skip = true;
+                    break;
+                case config_params_udp_window:
+                    config->udp_window = atoi(param);
+                    skip = true;
+                    break;
+                case config_params_io_uring:
+                    config->io_uring = (atoi(param) != 0);
+                    skip = true;
+                    break;
+                case config_params_metrics:
+                    snprintf(config->metrics_socket, MAX_FILE_LEN, "%s", param);
+                    config->metrics_socket[strcspn(config->metrics_socket, "\r\n")] = '\0';
+                    skip = true;
+                    break;
+                case config_params_egress:
+                    snprintf(config->egress_device, MAX_DEVICE_LEN, "%s", param);
+                    config->egress_device[strcspn(config->egress_device, "\r\n")] = '\0';
+                    skip = true;
+                    break;
+                case config_params_trace:
+                    config->trace_sample = (uint32_t) strtoul(param, NULL, 10);
+                    skip = true;
+                    break;
+                case config_params_mtu:
+                    config->mtu = atoi(param);
+                    skip = true;
+                    break;
+                case config_params_vnet_hdr:
+                    config->vnet_hdr = (atoi(param) != 0);
+                    skip = true;
+                    break;
+                case config_params_runtime:
+                    if (strncmp(param, "thread", strlen("thread")) == 0) {
+                        config->runtime = router_runtime_thread;
+                    } else if (strncmp(param, "process", strlen("process")) == 0) {
+                        config->runtime = router_runtime_process;
+                    } else {
+                        printf("\n Unknown runtime %s", param);
+                    }
+                    skip = true;
+                    break;
+                case config_params_police:
+                    config_set_police(config, param);
+                    skip = true;
+                    break;
+                case config_params_police_size:
+                    config->police_sources = atoi(param);
+                    skip = true;
+                    break;
+                case config_params_queue:
+                    config->queue_high = atoi(param);
+                    param = strtok (NULL, " ");
+                    config->queue_low = param ? atoi(param) : config->queue_high / 4;
+                    skip = true;
+                    break;
+                case config_params_queue_policy:
+                    if (strncmp(param, "tail", strlen("tail")) == 0) {
+                        config->queue_policy = ipc_queue_tail_drop;
+                    } else if (strncmp(param, "head", strlen("head")) == 0) {
+                        config->queue_policy = ipc_queue_head_drop;
+                    } else if (strncmp(param, "spill", strlen("spill")) == 0) {
+                        config->queue_policy = ipc_queue_spill;
+                    } else {
+                        printf("\n Unknown IPC queue policy %s", param);
+                    }
                     skip = true;
                     break;
             }
@@ -58,11 +280,51 @@ bool parse_config_file(char *config_file, int *stage, int *num_routers)
                 break;
             }
 
-            /* Check if the given parameter is stage or num_routers */
+            /* Check which parameter is given */
             if (strncmp(param, CONFIG_PARAM_STAGE, strlen(CONFIG_PARAM_STAGE)) == 0) {
                 config_params_id = config_params_stage;
             } else if (strncmp(param, CONFIG_PARAM_NUM_ROUTERS, strlen(CONFIG_PARAM_NUM_ROUTERS)) == 0) {
                 config_params_id = config_params_num_routers;
+            } else if (strncmp(param, CONFIG_PARAM_BATCH_SIZE, strlen(CONFIG_PARAM_BATCH_SIZE)) == 0) {
+                config_params_id = config_params_batch_size;
+            } else if (strncmp(param, CONFIG_PARAM_POOL_SIZE, strlen(CONFIG_PARAM_POOL_SIZE)) == 0) {
+                config_params_id = config_params_pool_size;
+            } else if (strncmp(param, CONFIG_PARAM_HUGEPAGES, strlen(CONFIG_PARAM_HUGEPAGES)) == 0) {
+                config_params_id = config_params_hugepages;
+            } else if (strncmp(param, CONFIG_PARAM_TUN_QUEUES, strlen(CONFIG_PARAM_TUN_QUEUES)) == 0) {
+                config_params_id = config_params_tun_queues;
+            } else if (strncmp(param, CONFIG_PARAM_ROUTE, strlen(CONFIG_PARAM_ROUTE)) == 0) {
+                config_params_id = config_params_route;
+            } else if (strncmp(param, CONFIG_PARAM_CONTROL, strlen(CONFIG_PARAM_CONTROL)) == 0) {
+                config_params_id = config_params_control;
+            } else if (strncmp(param, CONFIG_PARAM_QUEUE_POLICY, strlen(CONFIG_PARAM_QUEUE_POLICY)) == 0) {
+                config_params_id = config_params_queue_policy;
+            } else if (strncmp(param, CONFIG_PARAM_QUEUE, strlen(CONFIG_PARAM_QUEUE)) == 0) {
+                config_params_id = config_params_queue;
+            } else if (strncmp(param, CONFIG_PARAM_RING_SIZE, strlen(CONFIG_PARAM_RING_SIZE)) == 0) {
+                config_params_id = config_params_ring_size;
+            } else if (strncmp(param, CONFIG_PARAM_UDP_WINDOW, strlen(CONFIG_PARAM_UDP_WINDOW)) == 0) {
+                config_params_id = config_params_udp_window;
+            } else if (strncmp(param, CONFIG_PARAM_IO_URING, strlen(CONFIG_PARAM_IO_URING)) == 0) {
+                config_params_id = config_params_io_uring;
+            } else if (strncmp(param, CONFIG_PARAM_EGRESS, strlen(CONFIG_PARAM_EGRESS)) == 0) {
+                config_params_id = config_params_egress;
+            } else if (strncmp(param, CONFIG_PARAM_METRICS, strlen(CONFIG_PARAM_METRICS)) == 0) {
+                config_params_id = config_params_metrics;
+            } else if (strncmp(param, CONFIG_PARAM_TRACE, strlen(CONFIG_PARAM_TRACE)) == 0) {
+                config_params_id = config_params_trace;
+            } else if (strncmp(param, CONFIG_PARAM_MTU, strlen(CONFIG_PARAM_MTU)) == 0) {
+                config_params_id = config_params_mtu;
+            } else if (strncmp(param, CONFIG_PARAM_VNET_HDR, strlen(CONFIG_PARAM_VNET_HDR)) == 0) {
+                config_params_id = config_params_vnet_hdr;
+            } else if (strncmp(param, CONFIG_PARAM_RUNTIME, strlen(CONFIG_PARAM_RUNTIME)) == 0) {
+                config_params_id = config_params_runtime;
+            } else if (strncmp(param, CONFIG_PARAM_IPC, strlen(CONFIG_PARAM_IPC)) == 0) {
+                config_params_id = config_params_ipc;
+            } else if (strncmp(param, CONFIG_PARAM_POLICE_SIZE, strlen(CONFIG_PARAM_POLICE_SIZE)) == 0) {
+                config_params_id = config_params_police_size;
+            } else if (strncmp(param, CONFIG_PARAM_POLICE, strlen(CONFIG_PARAM_POLICE)) == 0) {
+                config_params_id = config_params_police;
             }
             param = strtok (NULL, " ");
         }
@@ -70,5 +332,62 @@ bool parse_config_file(char *config_file, int *stage, int *num_routers)
     if (line) {
         free(line);
     }
+    fclose(fp);
+
+    if ((config->batch_size <= 0) || (config->batch_size > MAX_BATCH_SIZE)) {
+        printf("\n Invalid batch size %d, using %d", config->batch_size, DEFAULT_BATCH_SIZE);
+        config->batch_size = DEFAULT_BATCH_SIZE;
+    }
+
+    if ((config->tun_queues <= 0) || (config->tun_queues > MAX_TUN_QUEUES)) {
+        printf("\n Invalid number of TUN queues %d, using 1", config->tun_queues);
+        config->tun_queues = 1;
+    }
+
+    if ((config->ring_size < 2) || (config->ring_size > MAX_RING_SIZE) ||
+        (config->ring_size & (config->ring_size - 1))) {
+        printf("\n Invalid IPC ring size %d, using %d", config->ring_size, DEFAULT_RING_SIZE);
+        config->ring_size = DEFAULT_RING_SIZE;
+    }
+
+    if ((config->udp_window <= 0) || (config->udp_window > MAX_UDP_WINDOW)) {
+        printf("\n Invalid IPC UDP window %d, using %d", config->udp_window, DEFAULT_UDP_WINDOW);
+        config->udp_window = DEFAULT_UDP_WINDOW;
+    }
+
+    /* 68 is the least IPv4 allows */
+    if ((config->mtu != 0) && ((config->mtu < 68) || (config->mtu > MAX_MTU))) {
+        printf("\n Invalid MTU %d, keeping the tunnel's", config->mtu);
+        config->mtu = 0;
+    }
+
+    if ((config->police_sources <= 0) || (config->police_sources > MAX_POLICE_SOURCES)) {
+        printf("\n Invalid number of police sources %d, using %d", config->police_sources,
+                DEFAULT_POLICE_SOURCES);
+        config->police_sources = DEFAULT_POLICE_SOURCES;
+    }
+
+    if ((config->queue_high <= 0) || (config->queue_high > MAX_QUEUE_LEN) ||
+        (config->queue_low < 0) || (config->queue_low >= config->queue_high)) {
+        printf("\n Invalid IPC queue watermarks %d / %d, using %d / %d", config->queue_high,
+                config->queue_low, DEFAULT_QUEUE_HIGH, DEFAULT_QUEUE_LOW);
+        config->queue_high = DEFAULT_QUEUE_HIGH;
+        config->queue_low = DEFAULT_QUEUE_LOW;
+    }
+
+    /* Both IPC batches of a loop must be able to fill up at the same time */
+    if (config->pool_size < 2 * config->batch_size + 1) {
+        printf("\n Pool size %d too small for batch size %d, using %d",
+                config->pool_size, config->batch_size, 2 * config->batch_size + 1);
+        config->pool_size = 2 * config->batch_size + 1;
+    }
     return true;
 }
+
+/* Release what parse_config_file() allocated */
+void free_config(struct router_config *config)
+{
+    free(config->routes);
+    config->routes = NULL;
+    config->num_routes = 0;
+}
@@ -2,15 +2,184 @@
 #define CONFIG
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Configuration */
 #define MAX_FILE_LEN 255
 
 #define MAX_STAGE                2
-#define MAX_ROUTERS              2
+#define MAX_ROUTERS              1024
 #define CONFIG_PARAM_STAGE       "stage"
 #define CONFIG_PARAM_NUM_ROUTERS "num_routers"
+#define CONFIG_PARAM_BATCH_SIZE  "batch_size"
+#define CONFIG_PARAM_POOL_SIZE   "pool_size"
+#define CONFIG_PARAM_HUGEPAGES   "hugepages"
+#define CONFIG_PARAM_TUN_QUEUES  "tun_queues"
+#define CONFIG_PARAM_ROUTE       "route"
+#define CONFIG_PARAM_CONTROL     "control_socket"
+#define CONFIG_PARAM_IPC         "ipc"
+#define CONFIG_PARAM_RING_SIZE   "ipc_ring_size"
+#define CONFIG_PARAM_UDP_WINDOW  "ipc_udp_window"
+#define CONFIG_PARAM_IO_URING    "io_uring"
+#define CONFIG_PARAM_METRICS     "metrics_socket"
+#define CONFIG_PARAM_TRACE       "trace_sample"
+#define CONFIG_PARAM_MTU         "mtu"
+#define CONFIG_PARAM_VNET_HDR    "vnet_hdr"
+#define CONFIG_PARAM_RUNTIME     "runtime"
+#define CONFIG_PARAM_POLICE      "police"
+#define CONFIG_PARAM_POLICE_SIZE "police_sources"
+#define CONFIG_PARAM_QUEUE       "ipc_queue"
+#define CONFIG_PARAM_QUEUE_POLICY "ipc_queue_policy"
+#define CONFIG_PARAM_EGRESS      "egress_device"
 
-bool parse_config_file(char *config_file, int *stage, int *num_routers);
+/* Number of datagrams moved per recvmmsg / sendmmsg call */
+#define DEFAULT_BATCH_SIZE       32
+#define MAX_BATCH_SIZE           1024
+
+/* Number of packet buffers preallocated by every forwarding loop */
+#define DEFAULT_POOL_SIZE        4096
+
+/* Number of TUN queues, each served by it's own worker thread */
+#define MAX_TUN_QUEUES           64
+
+/* Packets per shared memory ring (a power of 2) */
+#define DEFAULT_RING_SIZE        1024
+#define MAX_RING_SIZE            65536
+
+/* ipc_udp_window <packets>
+ * Over UDP, the datagrams the primary workers together let be in flight
+ * towards a secondary: sent, but not yet received by it nor dropped by
+ * it's socket. Beyond it packets wait in the secondary's queue. Should fit
+ * the secondary's socket receive buffer */
+#define DEFAULT_UDP_WINDOW       1024
+#define MAX_UDP_WINDOW           65536
+
+/* MTU the tunnel is set to (0 keeps the kernel's), up to jumbo frames */
+#define MAX_MTU                  9216
+
+/* How packets move between the primary and the secondary routers:
+ * ipc shm - rings in shared memory (default)
+ * ipc udp - datagrams over loopback sockets */
+enum ipc_transport
+{
+    ipc_transport_shm,
+    ipc_transport_udp
+};
+
+/* How the routers run:
+ * runtime process - a process per secondary router, forked (default)
+ * runtime thread  - a thread per router in one process, each pinned to a
+ *                   CPU of it's own (stage 2) */
+enum router_runtime
+{
+    router_runtime_process,
+    router_runtime_thread
+};
+
+/* egress_device <ifname>
+ * Device the secondaries send forwarded packets (UDP, TCP and ICMP other
+ * than echo requests) out of. Their destinations are routed into the
+ * tunnel, which is how the packets got to us, so they can't leave by the
+ * routing table: the egress socket is bound to this device instead. It
+ * should be the uplink towards the real destinations, with a route or
+ * neighbour for them. Without it packets are not forwarded but dropped */
+#define MAX_DEVICE_LEN           16
+
+/* Watermarks of the queues towards the secondaries, in packets */
+#define DEFAULT_QUEUE_HIGH       256
+#define DEFAULT_QUEUE_LOW        64
+#define MAX_QUEUE_LEN            65536
+
+/* Buckets in the policing table of every primary worker */
+#define DEFAULT_POLICE_SOURCES   4096
+#define MAX_POLICE_SOURCES       (1 << 20)
+
+/* ipc_queue <high> <low>
+ * Packets a primary worker holds for a secondary that can't take them yet
+ * (it's request ring is full, or too many of it's UDP datagrams are in
+ * flight). At <high> packets the queue is congested and the policy applies
+ * to new packets, until the queue is back down to <low>. Both are lowered
+ * if a primary worker's pool can't hold every queue at <high>
+ * ipc_queue_policy tail|head|spill
+ * tail  - drop the new packet (default)
+ * head  - drop the oldest queued packet to make room for it
+ * spill - queue it for another secondary that isn't congested, or drop it
+ *         if there is none */
+enum ipc_queue_policy
+{
+    ipc_queue_tail_drop,
+    ipc_queue_head_drop,
+    ipc_queue_spill
+};
+
+/* police <class> <rate> <burst>
+ * Let every source address send at most <rate> packets a second of class,
+ * in bursts of up to <burst> packets. Classes not given are not policed.
+ * The tunnel spreads the flows of a source over it's tun_queues, each
+ * served by a worker policing on it's own: every worker admits <rate> /
+ * tun_queues and <burst> / tun_queues of it, so a source with a single
+ * flow gets only that share */
+enum police_class
+{
+    police_class_icmp,
+    police_class_udp,
+    police_class_tcp,
+    police_class_other,
+    POLICE_CLASSES
+};
+
+struct config_police
+{
+    uint32_t rate;
+    uint32_t burst;
+};
+
+/* route <prefix>/<length> <router>
+ * Send packets for destinations in prefix to secondary router <router>
+ * route <prefix>/<length> local
+ * Answer echo requests for destinations in prefix on the primary, without
+ * a trip to a secondary. Other packets for prefix go to the secondaries as
+ * if it had no route */
+#define CONFIG_ROUTE_LOCAL       (-1)
+
+struct config_route
+{
+    uint32_t prefix;
+    int len;
+    int router_id;
+};
+
+struct router_config
+{
+    int stage;
+    int num_routers;
+    int batch_size;
+    int pool_size;
+    bool hugepages;
+    int tun_queues;
+    struct config_route *routes;
+    int num_routes;
+    char control_socket[MAX_FILE_LEN];
+    enum ipc_transport ipc;
+    int ring_size;
+    int udp_window;
+    bool io_uring;
+    char metrics_socket[MAX_FILE_LEN];
+    uint32_t trace_sample;
+    int mtu;
+    bool vnet_hdr;
+    enum router_runtime runtime;
+    struct config_police police[POLICE_CLASSES];
+    int police_sources;
+    int queue_high;
+    int queue_low;
+    enum ipc_queue_policy queue_policy;
+    char egress_device[MAX_DEVICE_LEN];
+};
+
+extern const char *police_class_names[POLICE_CLASSES];
+
+bool parse_config_file(char *config_file, struct router_config *config);
+void free_config(struct router_config *config);
 
 #endif
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+/* Open the control socket at path. *active is the flow table the data path
+ * reads; it is replaced on every change. Rules may forward or mirror to
+ * routers 1 to num_routers */
+bool control_init(struct control *ctl, char *path, struct flow_table **active, 
+        int num_routers, control_sync_fn synchronize, void *sync_ctx)
+{
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->active = active;
+    ctl->num_routers = num_routers;
+    ctl->synchronize = synchronize;
+    ctl->sync_ctx = sync_ctx;
+
+    ctl->rules = (struct flow_rule *) calloc (CONTROL_MAX_RULES, sizeof(*ctl->rules));
+    if (!ctl->rules) {
+        printf("\n Unable to allocate memory for flow rules - %s", strerror(errno));
+        return false;
+    }
+
+    ctl->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ctl->fd < 0) {
+        printf("\n Unable to open control socket - %s", strerror(errno));
+        free(ctl->rules);
+        return false;
+    }
+
+    ctl->addr.sun_family = AF_UNIX;
+    strncpy(ctl->addr.sun_path, path, sizeof(ctl->addr.sun_path) - 1);
+    unlink(ctl->addr.sun_path);
+    if (bind(ctl->fd, (struct sockaddr *) &ctl->addr, sizeof(ctl->addr)) < 0) {
+        printf("\n Unable to bind control socket %s - %s", path, strerror(errno));
+        close(ctl->fd);
+        free(ctl->rules);
+        return false;
+    }
+    return true;
+}
+
+void control_close(struct control *ctl)
+{
+    close(ctl->fd);
+    unlink(ctl->addr.sun_path);
+    free(ctl->rules);
+}
+
+/* Build a table from the current rules and publish it */
+static bool control_publish(struct control *ctl)
+{
+    struct flow_table *table = NULL;
+
+    table = flow_table_build(ctl->rules, ctl->num_rules);
+    if (!table) {
+        return false;
+    }
+    table = flow_table_swap(ctl->active, table);
+    ctl->synchronize(ctl->sync_ctx);
+    flow_table_free(table);
+    return true;
+}
+
+static int control_find_rule(struct control *ctl, int id)
+{
+    int i = 0;
+
+    for (i = 0; i < ctl->num_rules; i++) {
+        if (ctl->rules[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void control_reply(struct control *ctl, struct sockaddr_un *peer, socklen_t peer_len, 
+        char *reply, size_t len)
+{
+    if (peer_len <= sizeof(sa_family_t)) {
+        /* Unnamed sender, nowhere to answer */
+        return;
+    }
+    if (sendto(ctl->fd, reply, len, MSG_DONTWAIT, (struct sockaddr *) peer, peer_len) < 0) {
+        printf("\n Unable to answer on control socket - %s", strerror(errno));
+    }
+}
+
+/* Run one command and write the answer into reply */
+static void control_command(struct control *ctl, char *command, char *reply, size_t reply_len,
+        struct sockaddr_un *peer, socklen_t peer_len)
+{
+    struct flow_rule rule;
+    char *saveptr = NULL;
+    char *verb = NULL;
+    char *id = NULL;
+    size_t used = 0;
+    int index = 0;
+    int i = 0;
+
+    verb = strtok_r(command, " \t\n", &saveptr);
+    if (!verb) {
+        snprintf(reply, reply_len, "error: empty command\n");
+        return;
+    }
+
+    if (strcmp(verb, "add") == 0) {
+        id = strtok_r(NULL, " \t\n", &saveptr);
+        if (!id || !flow_rule_parse(saveptr, &rule)) {
+            snprintf(reply, reply_len, "error: usage add <id> [priority=] [src=] [dst=] "
+                    "[proto=] [type=] action=<forward:N|reply|drop|mirror:N>\n");
+            return;
+        }
+        if ((rule.action == flow_action_forward || rule.action == flow_action_mirror) &&
+            (rule.router_id < 1 || rule.router_id > ctl->num_routers)) {
+            snprintf(reply, reply_len, "error: no router %d\n", rule.router_id);
+            return;
+        }
+        rule.id = atoi(id);
+        index = control_find_rule(ctl, rule.id);
+        if (index < 0) {
+            if (ctl->num_rules == CONTROL_MAX_RULES) {
+                snprintf(reply, reply_len, "error: flow table full\n");
+                return;
+            }
+            index = ctl->num_rules++;
+        }
+        ctl->rules[index] = rule;
+    } else if (strcmp(verb, "del") == 0) {
+        id = strtok_r(NULL, " \t\n", &saveptr);
+        index = id ? control_find_rule(ctl, atoi(id)) : -1;
+        if (index < 0) {
+            snprintf(reply, reply_len, "error: no such rule\n");
+            return;
+        }
+        ctl->rules[index] = ctl->rules[--ctl->num_rules];
+    } else if (strcmp(verb, "flush") == 0) {
+        ctl->num_rules = 0;
+    } else if (strcmp(verb, "list") == 0) {
+        /* One datagram per CONTROL_MSG_LEN worth of rules */
+        for (i = 0; i < ctl->num_rules; i++) {
+            if (used + FLOW_RULE_STR_LEN > reply_len) {
+                control_reply(ctl, peer, peer_len, reply, used);
+                used = 0;
+            }
+            /* As the add command that installs it */
+            used += snprintf(reply + used, reply_len - used, "%d ", ctl->rules[i].id);
+            used += flow_rule_format(&ctl->rules[i], reply + used, reply_len - used);
+        }
+        snprintf(reply + used, reply_len - used, "ok %d rules\n", ctl->num_rules);
+        return;
+    } else {
+        snprintf(reply, reply_len, "error: unknown command %s\n", verb);
+        return;
+    }
+
+    if (!control_publish(ctl)) {
+        snprintf(reply, reply_len, "error: unable to build flow table\n");
+        return;
+    }
+    snprintf(reply, reply_len, "ok\n");
+}
+
+/* Control socket is readable: run every queued command */
+void control_ready(int fd, void *ctx)
+{
+    struct control *ctl = (struct control *) ctx;
+    char command[CONTROL_MSG_LEN];
+    char reply[CONTROL_MSG_LEN];
+    struct sockaddr_un peer;
+    socklen_t peer_len = 0;
+    ssize_t len = 0;
+
+    while (1) {
+        peer_len = sizeof(peer);
+        len = recvfrom(fd, command, sizeof(command) - 1, 0, (struct sockaddr *) &peer, &peer_len);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("\n Error reading control socket - %s", strerror(errno));
+            }
+            return;
+        }
+        command[len] = '\0';
+
+        control_command(ctl, command, reply, sizeof(reply), &peer, peer_len);
+        control_reply(ctl, &peer, peer_len, reply, strlen(reply));
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef CONTROL
+#define CONTROL
+
+#include <stdbool.h>
+#include <sys/un.h>
+
+#include "flow_table.h"
+
+#define CONTROL_MAX_RULES 65536
+#define CONTROL_MSG_LEN   4096
+
+/* Called after a new flow table has been published; must return once no
+ * reader can still be using the previous table */
+typedef void (*control_sync_fn)(void *ctx);
+
+/* Local datagram socket accepting flow table commands:
+ *   add <id> <rule>   install (or replace) rule <id>, see flow_rule_parse()
+ *   del <id>          remove rule <id>
+ *   flush             remove every rule
+ *   list              dump the installed rules as "<id> <rule>"
+ * Every command is answered to the sender's address, if it has one */
+struct control
+{
+    int fd;
+    struct sockaddr_un addr;
+    struct flow_rule *rules;
+    int num_rules;
+    int num_routers;
+    struct flow_table **active;
+    control_sync_fn synchronize;
+    void *sync_ctx;
+};
+
+bool control_init(struct control *ctl, char *path, struct flow_table **active, 
+        int num_routers, control_sync_fn synchronize, void *sync_ctx);
+void control_ready(int fd, void *ctx);
+void control_close(struct control *ctl);
+
+#endif
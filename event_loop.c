@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event_loop.h"
+
+/* Put the given fd into non-blocking mode so that handlers can drain it */
+bool set_fd_nonblocking(int fd)
+{
+    int flags = 0;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        printf("\n Unable to get flags of fd (%d) - %s", fd, strerror(errno));
+        return false;
+    }
+
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        printf("\n Unable to set fd (%d) non-blocking - %s", fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void event_loop_timers_expired(int fd, void *ctx);
+
+/* Create the epoll instance backing the loop and the timerfd driving it's
+ * timer wheel */
+bool event_loop_init(struct event_loop *loop)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->timer_fd = -1;
+    loop->timer_deadline = UINT64_MAX;
+    timer_wheel_init(&loop->wheel, event_loop_now());
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        printf("\n Unable to create epoll instance - %s", strerror(errno));
+        return false;
+    }
+
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer_fd < 0) {
+        printf("\n Unable to create timer - %s", strerror(errno));
+        return false;
+    }
+    return event_loop_add(loop, loop->timer_fd, event_loop_timers_expired, loop);
+}
+
+/* Register fd with the loop. handler is called with ctx whenever fd
+ * turns readable (edge-triggered) */
+bool event_loop_add(struct event_loop *loop, int fd, event_handler handler, void *ctx)
+{
+    struct event_source *source = NULL;
+    struct epoll_event event = {0};
+
+    source = (struct event_source *) calloc (1, sizeof(*source));
+    if (!source) {
+        printf("\n Unable to allocate memory - %s", strerror(errno));
+        return false;
+    }
+    source->fd = fd;
+    source->handler = handler;
+    source->ctx = ctx;
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = source;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        printf("\n Unable to add fd (%d) to epoll - %s", fd, strerror(errno));
+        free(source);
+        return false;
+    }
+
+    source->next = loop->sources;
+    loop->sources = source;
+    return true;
+}
+
+/* Current tick of the timer wheels (CLOCK_MONOTONIC) */
+uint64_t event_loop_now(void)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec) / EVENT_LOOP_TICK_NS;
+}
+
+/* Arm the timerfd for tick <deadline>, or disarm it for UINT64_MAX */
+static void event_loop_set_deadline(struct event_loop *loop, uint64_t deadline)
+{
+    struct itimerspec spec = {0};
+
+    if (deadline != UINT64_MAX) {
+        spec.it_value.tv_sec = (deadline * EVENT_LOOP_TICK_NS) / 1000000000ULL;
+        spec.it_value.tv_nsec = (deadline * EVENT_LOOP_TICK_NS) % 1000000000ULL;
+    }
+    if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        printf("\n Unable to arm timer - %s", strerror(errno));
+        return;
+    }
+    loop->timer_deadline = deadline;
+}
+
+/* The timerfd fired: fire the timers due by now and arm it for whatever
+ * the wheel has next */
+static void event_loop_timers_expired(int fd, void *ctx)
+{
+    struct event_loop *loop = (struct event_loop *) ctx;
+    uint64_t expirations = 0;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        return;
+    }
+    /* Timers the handlers arm are picked up once they are done */
+    loop->timer_deadline = 0;
+    timer_wheel_advance(&loop->wheel, event_loop_now());
+    event_loop_set_deadline(loop, timer_wheel_next(&loop->wheel));
+}
+
+/* Arm (or move) timer to fire in <ms> milliseconds, on the loop's thread.
+ * The timerfd is only touched if the timer is due before it */
+void event_loop_arm_timer(struct event_loop *loop, struct timer *timer, uint64_t ms)
+{
+    uint64_t ticks = (ms * 1000000ULL + EVENT_LOOP_TICK_NS - 1) / EVENT_LOOP_TICK_NS;
+
+    /* The current tick is partly gone, so the timer never fires early */
+    timer_wheel_arm(&loop->wheel, timer, event_loop_now() + ticks + 1);
+    if (timer->expires < loop->timer_deadline) {
+        event_loop_set_deadline(loop, timer->expires);
+    }
+}
+
+/* Disarm timer. The timerfd may still fire for it, finding nothing due */
+void event_loop_cancel_timer(struct event_loop *loop, struct timer *timer)
+{
+    timer_wheel_cancel(&loop->wheel, timer);
+}
+
+/* Dispatch ready sources until a handler calls event_loop_stop(). Signals
+ * reach the loop as sources too (signalfd), an interrupted wait is simply
+ * resumed */
+void event_loop_run(struct event_loop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct event_source *source = NULL;
+    int num_events = 0;
+    int i = 0;
+
+    loop->running = true;
+    while (loop->running) {
+        atomic_fetch_add(&loop->epoch, 1);
+        num_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (num_events < 0) {
+            if (errno != EINTR) {
+                printf("\n Unable to perform epoll_wait operation - %s", strerror(errno));
+                exit(-1);
+            }
+            /* e.g. the process was stopped and continued: carry on */
+            num_events = 0;
+        }
+
+        atomic_fetch_add(&loop->epoch, 1);
+
+        for (i = 0; i < num_events && loop->running; i++) {
+            source = (struct event_source *) events[i].data.ptr;
+            source->handler(source->fd, source->ctx);
+        }
+    }
+
+    /* Leave the loop quiescent for good */
+    atomic_fetch_add(&loop->epoch, 1);
+}
+
+/* Wait until the loop (running in another thread) has finished the
+ * handlers it was running, if any. Once this has been done for every loop,
+ * data unpublished before the call is no longer referenced and can be freed */
+void event_loop_synchronize(struct event_loop *loop)
+{
+    unsigned long epoch = atomic_load(&loop->epoch);
+
+    if (epoch & 1) {
+        /* Waiting for events or stopped */
+        return;
+    }
+    while (atomic_load(&loop->epoch) == epoch) {
+        sched_yield();
+    }
+}
+
+void event_loop_stop(struct event_loop *loop)
+{
+    loop->running = false;
+}
+
+/* Release the epoll instance, the timerfd and all registrations.
+ * Registered fds are owned by the caller and stay open */
+void event_loop_close(struct event_loop *loop)
+{
+    struct event_source *source = NULL;
+
+    while (loop->sources) {
+        source = loop->sources;
+        loop->sources = source->next;
+        free(source);
+    }
+    if (loop->timer_fd >= 0) {
+        close(loop->timer_fd);
+        loop->timer_fd = -1;
+    }
+    close(loop->epoll_fd);
+}
@@ -0,0 +1,54 @@
+#ifndef EVENT_LOOP
+#define EVENT_LOOP
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "timer_wheel.h"
+
+#define MAX_EVENTS 64
+
+/* Length of a tick of the loop's timer wheel */
+#define EVENT_LOOP_TICK_NS 1000000ULL
+
+/* Called when fd becomes readable. Sources are edge-triggered, so the
+ * handler must keep reading until the fd returns EAGAIN */
+typedef void (*event_handler)(int fd, void *ctx);
+
+struct event_source
+{
+    int fd;
+    event_handler handler;
+    void *ctx;
+    struct event_source *next;
+};
+
+/* Every loop has a timer wheel, ticking in EVENT_LOOP_TICK_NS on
+ * CLOCK_MONOTONIC. The single timerfd is armed for the next tick the wheel
+ * has something to do on (timer_deadline) */
+struct event_loop
+{
+    int epoll_fd;
+    int timer_fd;
+    uint64_t timer_deadline;
+    struct timer_wheel wheel;
+    volatile bool running;
+    struct event_source *sources;
+    /* Odd while the loop waits in epoll (holding no references to shared
+     * data), even while it runs handlers. See event_loop_synchronize() */
+    _Atomic unsigned long epoch;
+};
+
+bool set_fd_nonblocking(int fd);
+bool event_loop_init(struct event_loop *loop);
+bool event_loop_add(struct event_loop *loop, int fd, event_handler handler, void *ctx);
+uint64_t event_loop_now(void);
+void event_loop_arm_timer(struct event_loop *loop, struct timer *timer, uint64_t ms);
+void event_loop_cancel_timer(struct event_loop *loop, struct timer *timer);
+void event_loop_run(struct event_loop *loop);
+void event_loop_stop(struct event_loop *loop);
+void event_loop_close(struct event_loop *loop);
+void event_loop_synchronize(struct event_loop *loop);
+
+#endif
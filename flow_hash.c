@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "flow_hash.h"
+
+/* A point on the hash ring and the router owning it */
+struct ring_point
+{
+    uint32_t hash;
+    uint16_t router_id;
+};
+
+static int ring_point_compare(const void *a, const void *b)
+{
+    const struct ring_point *pa = (const struct ring_point *) a;
+    const struct ring_point *pb = (const struct ring_point *) b;
+
+    if (pa->hash != pb->hash) {
+        return (pa->hash < pb->hash) ? -1 : 1;
+    }
+    return pa->router_id - pb->router_id;
+}
+
+/* Place the active routers on the ring and give every bucket to the first
+ * router point at or after the bucket's position. Buckets are updated one
+ * at a time, so lookups running meanwhile always see a valid owner */
+static void flow_hash_rebuild(struct flow_hash *fh)
+{
+    struct ring_point *ring = NULL;
+    int num_points = 0;
+    int point = 0;
+    uint32_t position = 0;
+    uint16_t owner = 0;
+    int router_id = 0;
+    int replica = 0;
+    int bucket = 0;
+
+    if (fh->num_active == 0) {
+        for (bucket = 0; bucket < FLOW_HASH_BUCKETS; bucket++) {
+            __atomic_store_n(&fh->buckets[bucket], 0, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    ring = (struct ring_point *) calloc (fh->num_active * FLOW_HASH_REPLICAS, sizeof(*ring));
+    if (!ring) {
+        printf("\n Unable to allocate memory for hash ring - %s", strerror(errno));
+        return;
+    }
+
+    for (router_id = 1; router_id <= fh->num_routers; router_id++) {
+        if (!fh->active[router_id]) {
+            continue;
+        }
+        for (replica = 0; replica < FLOW_HASH_REPLICAS; replica++) {
+            ring[num_points].hash = flow_hash_key(router_id, replica, 0);
+            ring[num_points].router_id = router_id;
+            num_points++;
+        }
+    }
+    qsort(ring, num_points, sizeof(*ring), ring_point_compare);
+
+    for (bucket = 0; bucket < FLOW_HASH_BUCKETS; bucket++) {
+        position = (uint32_t) bucket << (32 - FLOW_HASH_BITS);
+        while (point < num_points && ring[point].hash < position) {
+            point++;
+        }
+        /* Past the last point, wrap around to the first one */
+        owner = ring[(point < num_points) ? point : 0].router_id;
+        if (fh->buckets[bucket] != owner) {
+            __atomic_store_n(&fh->buckets[bucket], owner, __ATOMIC_RELAXED);
+        }
+    }
+    free(ring);
+}
+
+/* Spread the flows over secondary routers 1..num_routers */
+bool flow_hash_init(struct flow_hash *fh, int num_routers)
+{
+    int router_id = 0;
+
+    memset(fh, 0, sizeof(*fh));
+    fh->buckets = (uint16_t *) calloc (FLOW_HASH_BUCKETS, sizeof(*fh->buckets));
+    fh->active = (bool *) calloc (num_routers + 1, sizeof(*fh->active));
+    if (!fh->buckets || !fh->active) {
+        printf("\n Unable to allocate memory for flow hash - %s", strerror(errno));
+        flow_hash_destroy(fh);
+        return false;
+    }
+
+    fh->num_routers = num_routers;
+    for (router_id = 1; router_id <= num_routers; router_id++) {
+        fh->active[router_id] = true;
+    }
+    fh->num_active = num_routers;
+    flow_hash_rebuild(fh);
+    return true;
+}
+
+void flow_hash_destroy(struct flow_hash *fh)
+{
+    free(fh->buckets);
+    free(fh->active);
+    memset(fh, 0, sizeof(*fh));
+}
+
+/* Give router_id back it's share of the flows */
+void flow_hash_add_router(struct flow_hash *fh, int router_id)
+{
+    if (router_id < 1 || router_id > fh->num_routers || fh->active[router_id]) {
+        return;
+    }
+    fh->active[router_id] = true;
+    fh->num_active++;
+    flow_hash_rebuild(fh);
+}
+
+/* Move router_id's flows to the remaining routers. Flows of the other
+ * routers keep their router */
+void flow_hash_remove_router(struct flow_hash *fh, int router_id)
+{
+    if (router_id < 1 || router_id > fh->num_routers || !fh->active[router_id]) {
+        return;
+    }
+    fh->active[router_id] = false;
+    fh->num_active--;
+    flow_hash_rebuild(fh);
+}
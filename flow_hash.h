@@ -0,0 +1,52 @@
+#ifndef FLOW_HASH
+#define FLOW_HASH
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Flows are hashed into 2^FLOW_HASH_BITS buckets, each owned by one
+ * secondary router. Bucket owners come from a consistent hash ring with
+ * FLOW_HASH_REPLICAS points per router, so adding or removing a router
+ * only moves the buckets that router gains or loses */
+#define FLOW_HASH_BITS     16
+#define FLOW_HASH_BUCKETS  (1 << FLOW_HASH_BITS)
+#define FLOW_HASH_REPLICAS 160
+
+struct flow_hash
+{
+    uint16_t *buckets;
+    bool *active;
+    int num_routers;
+    int num_active;
+};
+
+bool flow_hash_init(struct flow_hash *fh, int num_routers);
+void flow_hash_destroy(struct flow_hash *fh);
+void flow_hash_add_router(struct flow_hash *fh, int router_id);
+void flow_hash_remove_router(struct flow_hash *fh, int router_id);
+
+/* Mix the fields identifying a flow into 32 bits */
+static inline uint32_t flow_hash_key(uint32_t src, uint32_t dst, uint16_t id)
+{
+    uint32_t h = src * 0x9e3779b1u;
+
+    h ^= dst + 0x7f4a7c15u + (h << 6) + (h >> 2);
+    h ^= id + 0x85ebca6bu + (h << 6) + (h >> 2);
+
+    /* murmur3 finalizer */
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Get the secondary router owning the flow with the given hash
+ * Returns 0 if no secondary router is active */
+static inline int flow_hash_lookup(struct flow_hash *fh, uint32_t hash)
+{
+    return __atomic_load_n(&fh->buckets[hash >> (32 - FLOW_HASH_BITS)], __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "flow_table.h"
+
+static uint32_t prefix_mask(int len)
+{
+    return len ? (0xffffffffu << (32 - len)) : 0;
+}
+
+static uint32_t flow_entry_hash(uint32_t src, uint32_t dst, int protocol, int icmp_type)
+{
+    uint32_t h = src * 0x9e3779b1u;
+
+    h ^= dst * 0x85ebca6bu;
+    h ^= ((uint32_t)(protocol & 0xffff) << 16 | (uint32_t)(icmp_type & 0xffff)) * 0xc2b2ae35u;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+/* Find the tuple for rule's match fields, -1 if there is none yet */
+static int flow_tuple_find(struct flow_tuple *tuples, int num_tuples, struct flow_rule *rule)
+{
+    int i = 0;
+
+    for (i = 0; i < num_tuples; i++) {
+        if ((tuples[i].src_len == rule->src_len) && (tuples[i].dst_len == rule->dst_len) &&
+            (tuples[i].match_protocol == (rule->protocol != FLOW_ANY)) &&
+            (tuples[i].match_icmp_type == (rule->icmp_type != FLOW_ANY))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int flow_tuple_compare(const void *a, const void *b)
+{
+    const struct flow_tuple *ta = (const struct flow_tuple *) a;
+    const struct flow_tuple *tb = (const struct flow_tuple *) b;
+
+    return tb->max_priority - ta->max_priority;
+}
+
+/* Insert rule into it's tuple, replacing a lower priority rule with the
+ * same key */
+static void flow_tuple_insert(struct flow_tuple *tuple, struct flow_rule *rule)
+{
+    uint32_t src = rule->src & prefix_mask(tuple->src_len);
+    uint32_t dst = rule->dst & prefix_mask(tuple->dst_len);
+    uint32_t slot = flow_entry_hash(src, dst, rule->protocol, rule->icmp_type) & tuple->mask;
+    struct flow_entry *entry = NULL;
+
+    while (1) {
+        entry = &tuple->entries[slot];
+        if (!entry->rule) {
+            entry->src = src;
+            entry->dst = dst;
+            entry->protocol = rule->protocol;
+            entry->icmp_type = rule->icmp_type;
+            entry->rule = rule;
+            return;
+        }
+        if (entry->src == src && entry->dst == dst && 
+            entry->protocol == rule->protocol && entry->icmp_type == rule->icmp_type) {
+            if (rule->priority > entry->rule->priority) {
+                entry->rule = rule;
+            }
+            return;
+        }
+        slot = (slot + 1) & tuple->mask;
+    }
+}
+
+/* Build a classifier for the given rules. The rules are copied */
+struct flow_table *flow_table_build(struct flow_rule *rules, int num_rules)
+{
+    struct flow_table *table = NULL;
+    struct flow_tuple *tuple = NULL;
+    int *counts = NULL;
+    uint32_t capacity = 0;
+    int index = 0;
+    int i = 0;
+
+    table = (struct flow_table *) calloc (1, sizeof(*table));
+    counts = (int *) calloc (num_rules + 1, sizeof(int));
+    if (!table || !counts) {
+        goto nomem;
+    }
+    table->rules = (struct flow_rule *) calloc (num_rules + 1, sizeof(*table->rules));
+    table->tuples = (struct flow_tuple *) calloc (num_rules + 1, sizeof(*table->tuples));
+    if (!table->rules || !table->tuples) {
+        goto nomem;
+    }
+    memcpy(table->rules, rules, num_rules * sizeof(*rules));
+    table->num_rules = num_rules;
+
+    /* Group the rules into tuples */
+    for (i = 0; i < num_rules; i++) {
+        index = flow_tuple_find(table->tuples, table->num_tuples, &table->rules[i]);
+        if (index < 0) {
+            index = table->num_tuples++;
+            tuple = &table->tuples[index];
+            tuple->src_len = table->rules[i].src_len;
+            tuple->dst_len = table->rules[i].dst_len;
+            tuple->match_protocol = (table->rules[i].protocol != FLOW_ANY);
+            tuple->match_icmp_type = (table->rules[i].icmp_type != FLOW_ANY);
+            tuple->max_priority = table->rules[i].priority;
+        }
+        tuple = &table->tuples[index];
+        if (table->rules[i].priority > tuple->max_priority) {
+            tuple->max_priority = table->rules[i].priority;
+        }
+        counts[index]++;
+    }
+
+    /* Size every tuple's hash table to at most half full */
+    for (i = 0; i < table->num_tuples; i++) {
+        capacity = 4;
+        while (capacity < (uint32_t)counts[i] * 2) {
+            capacity <<= 1;
+        }
+        table->tuples[i].entries = (struct flow_entry *) calloc (capacity, sizeof(struct flow_entry));
+        if (!table->tuples[i].entries) {
+            goto nomem;
+        }
+        table->tuples[i].mask = capacity - 1;
+    }
+
+    for (i = 0; i < num_rules; i++) {
+        index = flow_tuple_find(table->tuples, table->num_tuples, &table->rules[i]);
+        flow_tuple_insert(&table->tuples[index], &table->rules[i]);
+    }
+
+    /* Search the tuples holding the highest priorities first */
+    qsort(table->tuples, table->num_tuples, sizeof(*table->tuples), flow_tuple_compare);
+    free(counts);
+    return table;
+
+nomem:
+    printf("\n Unable to allocate memory for flow table - %s", strerror(errno));
+    free(counts);
+    flow_table_free(table);
+    return NULL;
+}
+
+void flow_table_free(struct flow_table *table)
+{
+    int i = 0;
+
+    if (!table) {
+        return;
+    }
+    for (i = 0; table->tuples && i < table->num_tuples; i++) {
+        free(table->tuples[i].entries);
+    }
+    free(table->tuples);
+    free(table->rules);
+    free(table);
+}
+
+/* Atomically make table the active one and return the previous table
+ * The returned table can only be freed once every reader is quiescent */
+struct flow_table *flow_table_swap(struct flow_table **active, struct flow_table *table)
+{
+    return __atomic_exchange_n(active, table, __ATOMIC_ACQ_REL);
+}
+
+/* Get the highest priority rule matching the packet fields, NULL if none
+ * does. Tuples are visited in decreasing order of their best priority, so
+ * the search stops as soon as no remaining tuple can beat the match */
+struct flow_rule *flow_table_lookup(struct flow_table *table, uint32_t src, uint32_t dst, 
+        int protocol, int icmp_type)
+{
+    struct flow_rule *best = NULL;
+    struct flow_tuple *tuple = NULL;
+    struct flow_entry *entry = NULL;
+    uint32_t key_src = 0;
+    uint32_t key_dst = 0;
+    int key_protocol = 0;
+    int key_icmp_type = 0;
+    uint32_t slot = 0;
+    int i = 0;
+
+    for (i = 0; i < table->num_tuples; i++) {
+        tuple = &table->tuples[i];
+        if (best && tuple->max_priority <= best->priority) {
+            break;
+        }
+
+        key_src = src & prefix_mask(tuple->src_len);
+        key_dst = dst & prefix_mask(tuple->dst_len);
+        key_protocol = tuple->match_protocol ? protocol : FLOW_ANY;
+        key_icmp_type = tuple->match_icmp_type ? icmp_type : FLOW_ANY;
+
+        slot = flow_entry_hash(key_src, key_dst, key_protocol, key_icmp_type) & tuple->mask;
+        for (entry = &tuple->entries[slot]; entry->rule; 
+                slot = (slot + 1) & tuple->mask, entry = &tuple->entries[slot]) {
+            if (entry->src == key_src && entry->dst == key_dst &&
+                entry->protocol == key_protocol && entry->icmp_type == key_icmp_type) {
+                if (!best || entry->rule->priority > best->priority) {
+                    best = entry->rule;
+                }
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/* Parse "<a.b.c.d>[/<len>]" */
+static bool parse_prefix(char *text, uint32_t *prefix, int *len)
+{
+    struct in_addr addr = {0};
+    char *slash = strchr(text, '/');
+
+    *len = 32;
+    if (slash) {
+        *slash = '\0';
+        *len = atoi(slash + 1);
+    }
+    if (inet_pton(AF_INET, text, &addr) != 1 || *len < 0 || *len > 32) {
+        return false;
+    }
+    *prefix = ntohl(addr.s_addr) & prefix_mask(*len);
+    return true;
+}
+
+/* Parse a rule given as space separated key=value fields:
+ *   priority=<n> src=<prefix> dst=<prefix> proto=<icmp|tcp|udp|n>
+ *   type=<icmp type> action=<forward:<router>|reply|drop|mirror:<router>>
+ * Every field but action is optional and defaults to a wildcard */
+bool flow_rule_parse(char *text, struct flow_rule *rule)
+{
+    char *saveptr = NULL;
+    char *field = NULL;
+    char *value = NULL;
+
+    memset(rule, 0, sizeof(*rule));
+    rule->protocol = FLOW_ANY;
+    rule->icmp_type = FLOW_ANY;
+
+    for (field = strtok_r(text, " \t\n", &saveptr); field; 
+            field = strtok_r(NULL, " \t\n", &saveptr)) {
+        value = strchr(field, '=');
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        if (strcmp(field, "priority") == 0) {
+            rule->priority = atoi(value);
+        } else if (strcmp(field, "src") == 0) {
+            if (!parse_prefix(value, &rule->src, &rule->src_len)) {
+                return false;
+            }
+        } else if (strcmp(field, "dst") == 0) {
+            if (!parse_prefix(value, &rule->dst, &rule->dst_len)) {
+                return false;
+            }
+        } else if (strcmp(field, "proto") == 0) {
+            if (strcmp(value, "icmp") == 0) {
+                rule->protocol = IPPROTO_ICMP;
+            } else if (strcmp(value, "tcp") == 0) {
+                rule->protocol = IPPROTO_TCP;
+            } else if (strcmp(value, "udp") == 0) {
+                rule->protocol = IPPROTO_UDP;
+            } else {
+                rule->protocol = atoi(value) & 0xff;
+            }
+        } else if (strcmp(field, "type") == 0) {
+            rule->icmp_type = atoi(value) & 0xff;
+        } else if (strcmp(field, "action") == 0) {
+            if (strncmp(value, "forward:", 8) == 0) {
+                rule->action = flow_action_forward;
+                rule->router_id = atoi(value + 8);
+            } else if (strncmp(value, "mirror:", 7) == 0) {
+                rule->action = flow_action_mirror;
+                rule->router_id = atoi(value + 7);
+            } else if (strcmp(value, "reply") == 0) {
+                rule->action = flow_action_reply;
+            } else if (strcmp(value, "drop") == 0) {
+                rule->action = flow_action_drop;
+            } else {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return rule->action != 0;
+}
+
+/* Format rule (without it's id) in the syntax accepted by
+ * flow_rule_parse(). Wildcard fields are left out
+ * Returns the length written */
+int flow_rule_format(struct flow_rule *rule, char *buf, size_t len)
+{
+    struct in_addr src = { htonl(rule->src) };
+    struct in_addr dst = { htonl(rule->dst) };
+    char src_ip[INET_ADDRSTRLEN];
+    char dst_ip[INET_ADDRSTRLEN];
+    char action[24];
+    int used = 0;
+
+    inet_ntop(AF_INET, &src, src_ip, sizeof(src_ip));
+    inet_ntop(AF_INET, &dst, dst_ip, sizeof(dst_ip));
+    switch (rule->action) {
+        case flow_action_forward:
+            snprintf(action, sizeof(action), "forward:%d", rule->router_id);
+            break;
+        case flow_action_mirror:
+            snprintf(action, sizeof(action), "mirror:%d", rule->router_id);
+            break;
+        case flow_action_reply:
+            snprintf(action, sizeof(action), "reply");
+            break;
+        default:
+            snprintf(action, sizeof(action), "drop");
+    }
+
+    used = snprintf(buf, len, "priority=%d", rule->priority);
+    if (rule->src_len > 0 && (size_t) used < len) {
+        used += snprintf(buf + used, len - used, " src=%s/%d", src_ip, rule->src_len);
+    }
+    if (rule->dst_len > 0 && (size_t) used < len) {
+        used += snprintf(buf + used, len - used, " dst=%s/%d", dst_ip, rule->dst_len);
+    }
+    if (rule->protocol != FLOW_ANY && (size_t) used < len) {
+        used += snprintf(buf + used, len - used, " proto=%d", rule->protocol);
+    }
+    if (rule->icmp_type != FLOW_ANY && (size_t) used < len) {
+        used += snprintf(buf + used, len - used, " type=%d", rule->icmp_type);
+    }
+    if ((size_t) used < len) {
+        used += snprintf(buf + used, len - used, " action=%s\n", action);
+    }
+    return ((size_t) used < len) ? used : (int) len - 1;
+}
@@ -0,0 +1,78 @@
+#ifndef FLOW_TABLE
+#define FLOW_TABLE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Wildcard for protocol / icmp_type */
+#define FLOW_ANY -1
+
+#define FLOW_RULE_STR_LEN 160
+
+enum flow_action
+{
+    flow_action_forward = 1,
+    flow_action_reply,
+    flow_action_drop,
+    flow_action_mirror
+};
+
+/* A prioritized match/action rule. Unset prefixes have length 0 */
+struct flow_rule
+{
+    int id;
+    int priority;
+    uint32_t src;
+    int src_len;
+    uint32_t dst;
+    int dst_len;
+    int protocol;
+    int icmp_type;
+    enum flow_action action;
+    int router_id;
+};
+
+/* Rules that match on the same fields with the same prefix lengths share a
+ * tuple. Inside a tuple a rule is found by hashing the masked packet
+ * fields, so a lookup costs one probe per tuple instead of one compare per
+ * rule (tuple space search). Only the highest priority rule is kept for a
+ * given key, as it shadows every other rule with the same key */
+struct flow_entry
+{
+    uint32_t src;
+    uint32_t dst;
+    int16_t protocol;
+    int16_t icmp_type;
+    struct flow_rule *rule;
+};
+
+struct flow_tuple
+{
+    int src_len;
+    int dst_len;
+    bool match_protocol;
+    bool match_icmp_type;
+    int max_priority;
+    struct flow_entry *entries;
+    uint32_t mask;
+};
+
+/* Built once and never modified. Updates build a new table and swap it in */
+struct flow_table
+{
+    struct flow_tuple *tuples;
+    int num_tuples;
+    struct flow_rule *rules;
+    int num_rules;
+};
+
+struct flow_table *flow_table_build(struct flow_rule *rules, int num_rules);
+void flow_table_free(struct flow_table *table);
+struct flow_table *flow_table_swap(struct flow_table **active, struct flow_table *table);
+struct flow_rule *flow_table_lookup(struct flow_table *table, uint32_t src, uint32_t dst, 
+        int protocol, int icmp_type);
+bool flow_rule_parse(char *text, struct flow_rule *rule);
+int flow_rule_format(struct flow_rule *rule, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "graph.h"
+
+bool graph_init(struct graph *graph, struct packet_pool *pool)
+{
+    memset(graph, 0, sizeof(*graph));
+    graph->pool = pool;
+    graph->nodes = (struct graph_node *) calloc (GRAPH_MAX_NODES, sizeof(*graph->nodes));
+    if (!graph->nodes) {
+        printf("\n Unable to allocate memory for graph - %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Free the graph, handing packets still queued back to the pool */
+void graph_destroy(struct graph *graph)
+{
+    struct graph_vector *vec = NULL;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; graph->nodes && i < graph->num_nodes; i++) {
+        vec = &graph->nodes[i].vector;
+        for (j = 0; j < vec->count; j++) {
+            packet_free(graph->pool, vec->pkts[j]);
+        }
+    }
+    free(graph->nodes);
+    graph->nodes = NULL;
+    graph->num_nodes = 0;
+}
+
+/* Add a node calling process (with ctx in node->ctx) on it's vector
+ * Returns the node's id, -1 if the graph is full */
+int graph_add_node(struct graph *graph, const char *name, graph_node_fn process, void *ctx)
+{
+    struct graph_node *node = NULL;
+
+    if (graph->num_nodes == GRAPH_MAX_NODES) {
+        printf("\n Unable to add node %s, graph is full", name);
+        return -1;
+    }
+    node = &graph->nodes[graph->num_nodes];
+    node->name = name;
+    node->process = process;
+    node->ctx = ctx;
+    return graph->num_nodes++;
+}
+
+/* Add an edge from node <from> to node <to>. Edges are numbered in the
+ * order they are added, the node passes packets on by that number
+ * Returns the edge's number, -1 if from has no room for it */
+int graph_connect(struct graph *graph, int from, int to)
+{
+    struct graph_node *node = &graph->nodes[from];
+
+    if (node->num_next == GRAPH_MAX_NEXT) {
+        printf("\n Unable to connect node %s to %s", node->name, graph->nodes[to].name);
+        return -1;
+    }
+    node->next[node->num_next] = to;
+    return node->num_next++;
+}
+
+/* Have node process the packets queued on it. A source node (such as an
+ * input) is called even with nothing queued */
+void graph_dispatch(struct graph *graph, int node)
+{
+    struct graph_node *n = &graph->nodes[node];
+    struct graph_vector *vec = &n->vector;
+
+    graph_count(&n->calls, 1);
+    graph_count(&n->packets, vec->count);
+    n->process(graph, n, vec);
+    vec->count = 0;
+}
+
+/* Dispatch node, then every node with packets queued, in the order they
+ * were added, until none has any left */
+void graph_run(struct graph *graph, int node)
+{
+    bool busy = true;
+    int i = 0;
+
+    graph_dispatch(graph, node);
+    while (busy) {
+        busy = false;
+        for (i = 0; i < graph->num_nodes; i++) {
+            if (graph->nodes[i].vector.count > 0) {
+                graph_dispatch(graph, i);
+                busy = true;
+            }
+        }
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef GRAPH
+#define GRAPH
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "packet_pool.h"
+
+/* Packets a node processes per call, nodes per graph and edges per node */
+#define GRAPH_VECTOR_SIZE 256
+#define GRAPH_MAX_NODES   16
+#define GRAPH_MAX_NEXT    4
+
+/* How far ahead of the packet being processed nodes prefetch */
+#define GRAPH_PREFETCH    4
+
+/* Packet processing graph. Every node works on a vector of packets at a
+ * time and passes each packet on along one of it's edges, to the vector
+ * of the next node, or drops it. Edges must not form a cycle, so a node
+ * never gets packets queued while it is processing it's vector. A graph is
+ * owned by a single forwarding loop, like it's pool */
+
+struct graph;
+struct graph_node;
+
+struct graph_vector
+{
+    int count;
+    struct packet *pkts[GRAPH_VECTOR_SIZE];
+};
+
+/* Process the packets of vec. Every packet must be passed on with
+ * graph_next(), dropped with graph_drop() or otherwise taken over */
+typedef void (*graph_node_fn)(struct graph *graph, struct graph_node *node,
+        struct graph_vector *vec);
+
+struct graph_node
+{
+    const char *name;
+    graph_node_fn process;
+    void *ctx;
+    int next[GRAPH_MAX_NEXT];
+    int num_next;
+    struct graph_vector vector;
+
+    /* Written by the owning loop only, with relaxed stores, so the metrics
+     * snapshot can read them from another thread */
+    uint64_t calls;
+    uint64_t packets;
+    uint64_t drops;
+};
+
+struct graph
+{
+    struct graph_node *nodes;
+    int num_nodes;
+    struct packet_pool *pool;
+};
+
+bool graph_init(struct graph *graph, struct packet_pool *pool);
+void graph_destroy(struct graph *graph);
+int graph_add_node(struct graph *graph, const char *name, graph_node_fn process, void *ctx);
+int graph_connect(struct graph *graph, int from, int to);
+void graph_dispatch(struct graph *graph, int node);
+void graph_run(struct graph *graph, int node);
+
+/* Add n to a counter of a node of the calling loop's graph */
+static inline void graph_count(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* Queue pkt on the vector of node. A full vector is processed first */
+static inline void graph_enqueue(struct graph *graph, int node, struct packet *pkt)
+{
+    struct graph_vector *vec = &graph->nodes[node].vector;
+
+    if (vec->count == GRAPH_VECTOR_SIZE) {
+        graph_dispatch(graph, node);
+    }
+    vec->pkts[vec->count++] = pkt;
+}
+
+/* Pass pkt on along edge <next> of node (see graph_connect()) */
+static inline void graph_next(struct graph *graph, struct graph_node *node, int next,
+        struct packet *pkt)
+{
+    graph_enqueue(graph, node->next[next], pkt);
+}
+
+/* Drop pkt, handing it back to the pool */
+static inline void graph_drop(struct graph *graph, struct graph_node *node, struct packet *pkt)
+{
+    graph_count(&node->drops, 1);
+    packet_free(graph->pool, pkt);
+}
+
+/* Prefetch the descriptor and headers of the packet GRAPH_PREFETCH ahead
+ * of packet i of vec */
+static inline void graph_prefetch(struct graph_vector *vec, int i)
+{
+    if (i + GRAPH_PREFETCH < vec->count) {
+        __builtin_prefetch(vec->pkts[i + GRAPH_PREFETCH]);
+        __builtin_prefetch(vec->pkts[i + GRAPH_PREFETCH]->data);
+    }
+}
+
+#endif
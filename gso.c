@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "checksum.h"
+#include "gso.h"
+
+/* Offsets into the IPv4, TCP and UDP headers */
+enum gso_header_format {
+    gso_ip_len = 2,
+    gso_ip_id = 4,
+    gso_ip_checksum = 10,
+    gso_ip_src = 12,
+    gso_tcp_seq = 4,
+    gso_tcp_doff = 12,
+    gso_tcp_flags = 13,
+    gso_tcp_checksum = 16,
+    gso_udp_len = 4,
+    gso_udp_checksum = 6
+};
+
+#define GSO_TCP_FIN 0x01
+#define GSO_TCP_PSH 0x08
+#define GSO_TCP_CWR 0x80
+
+static uint16_t gso_read16(const char *p)
+{
+    uint16_t v = 0;
+
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+static void gso_write16(char *p, uint16_t v)
+{
+    v = htons(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+/* Checksum of the <len> byte TCP / UDP message at l4, including the
+ * pseudo header of the IPv4 packet ip */
+static uint16_t gso_l4_checksum(const char *ip, uint8_t protocol, const char *l4, int len)
+{
+    char pseudo[12];
+    uint32_t sum = 0;
+
+    memcpy(pseudo, ip + gso_ip_src, 8);
+    pseudo[8] = 0;
+    pseudo[9] = protocol;
+    gso_write16(pseudo + 10, (uint16_t) len);
+
+    /* Sums of even length pieces add up like the sum of the whole */
+    sum = (uint16_t) ~checksum(pseudo, sizeof(pseudo));
+    sum += (uint16_t) ~checksum(l4, len);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t) ~sum;
+}
+
+/* A packet the kernel left for us to segment */
+bool gso_is_super_packet(const struct virtio_net_hdr *hdr)
+{
+    return (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_NONE;
+}
+
+/* Fill in the checksum the kernel left partial: it holds the pseudo header
+ * sum, the rest is summed from csum_start to the end of the packet
+ * Returns false if the header points outside the packet */
+bool gso_complete_csum(const struct virtio_net_hdr *hdr, char *packet, int len)
+{
+    uint16_t check = 0;
+
+    if (!(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        return true;
+    }
+    if (hdr->csum_start + hdr->csum_offset + sizeof(check) > (size_t) len) {
+        return false;
+    }
+    check = checksum(packet + hdr->csum_start, len - hdr->csum_start);
+    memcpy(packet + hdr->csum_start + hdr->csum_offset, &check, sizeof(check));
+    return true;
+}
+
+/* Cut the <len> byte IPv4 TCP (TSO) or UDP (USO) super-packet into
+ * segments of at most gso_size bytes of payload, each a complete packet
+ * with it's own headers and checksums, taken from pool
+ * Returns the number of segments put in segs, -1 if the packet can't be
+ * segmented (segments taken so far are handed back to the pool) */
+int gso_segment(const struct virtio_net_hdr *hdr, const char *packet, int len,
+        struct packet_pool *pool, struct packet **segs, int max_segs)
+{
+    uint8_t gso_type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    uint8_t protocol = 0;
+    uint16_t ip_id = 0;
+    uint16_t check = 0;
+    uint32_t seq = 0;
+    uint8_t flags = 0;
+    int ip_hlen = 0;
+    int hdr_len = 0;
+    int payload = 0;
+    int offset = 0;
+    int count = 0;
+    int mss = hdr->gso_size;
+    struct packet *seg = NULL;
+    char *l4 = NULL;
+
+    if (len < 20 || ((uint8_t) packet[0] >> 4) != 4 || mss == 0) {
+        return -1;
+    }
+    ip_hlen = (packet[0] & 0x0f) * 4;
+    protocol = (uint8_t) packet[9];
+    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 && protocol == IPPROTO_TCP && len >= ip_hlen + 20) {
+        hdr_len = ip_hlen + (((uint8_t) packet[ip_hlen + gso_tcp_doff] >> 4) * 4);
+        memcpy(&seq, packet + ip_hlen + gso_tcp_seq, sizeof(seq));
+        seq = ntohl(seq);
+        flags = (uint8_t) packet[ip_hlen + gso_tcp_flags];
+    } else if (gso_type == VIRTIO_NET_HDR_GSO_UDP_L4 && protocol == IPPROTO_UDP) {
+        hdr_len = ip_hlen + 8;
+    } else {
+        return -1;
+    }
+    if (hdr_len > len || hdr_len + mss > pool->buf_size) {
+        return -1;
+    }
+    ip_id = gso_read16(packet + gso_ip_id);
+
+    for (offset = hdr_len; offset < len; offset += payload) {
+        payload = (len - offset < mss) ? len - offset : mss;
+        seg = (count < max_segs) ? packet_alloc(pool) : NULL;
+        if (!seg) {
+            while (count > 0) {
+                packet_free(pool, segs[--count]);
+            }
+            return -1;
+        }
+        memcpy(seg->data, packet, hdr_len);
+        memcpy(seg->data + hdr_len, packet + offset, payload);
+        seg->len = hdr_len + payload;
+
+        /* IP header: length, id, checksum */
+        gso_write16(seg->data + gso_ip_len, (uint16_t) seg->len);
+        gso_write16(seg->data + gso_ip_id, (uint16_t) (ip_id + count));
+        memset(seg->data + gso_ip_checksum, 0, sizeof(check));
+        check = checksum(seg->data, ip_hlen);
+        memcpy(seg->data + gso_ip_checksum, &check, sizeof(check));
+
+        /* TCP / UDP header and checksum */
+        l4 = seg->data + ip_hlen;
+        if (protocol == IPPROTO_TCP) {
+            uint32_t seg_seq = htonl(seq + (offset - hdr_len));
+
+            memcpy(l4 + gso_tcp_seq, &seg_seq, sizeof(seg_seq));
+            l4[gso_tcp_flags] = flags;
+            if (offset + payload < len) {
+                /* FIN and PSH only go with the last segment */
+                l4[gso_tcp_flags] &= ~(GSO_TCP_FIN | GSO_TCP_PSH);
+            }
+            if (offset > hdr_len) {
+                /* CWR only with the first */
+                l4[gso_tcp_flags] &= ~GSO_TCP_CWR;
+            }
+            memset(l4 + gso_tcp_checksum, 0, sizeof(check));
+            check = gso_l4_checksum(seg->data, protocol, l4, seg->len - ip_hlen);
+            memcpy(l4 + gso_tcp_checksum, &check, sizeof(check));
+        } else {
+            gso_write16(l4 + gso_udp_len, (uint16_t) (seg->len - ip_hlen));
+            memset(l4 + gso_udp_checksum, 0, sizeof(check));
+            check = gso_l4_checksum(seg->data, protocol, l4, seg->len - ip_hlen);
+            if (check == 0) {
+                /* 0 means no checksum for UDP */
+                check = 0xffff;
+            }
+            memcpy(l4 + gso_udp_checksum, &check, sizeof(check));
+        }
+        segs[count++] = seg;
+    }
+    return count;
+}
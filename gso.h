@@ -0,0 +1,25 @@
+#ifndef GSO
+#define GSO
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/virtio_net.h>
+
+#include "packet_pool.h"
+
+/* UDP segmentation offload (Linux 4.18); missing from older headers */
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4 5
+#endif
+
+/* Software segmentation of the GSO super-packets a tunnel with
+ * IFF_VNET_HDR hands over, and completion of the partial checksums it
+ * leaves to us (VIRTIO_NET_HDR_F_NEEDS_CSUM). Fields of the virtio_net_hdr
+ * are in host byte order, as the tunnel is not set to little endian */
+
+bool gso_is_super_packet(const struct virtio_net_hdr *hdr);
+bool gso_complete_csum(const struct virtio_net_hdr *hdr, char *packet, int len);
+int gso_segment(const struct virtio_net_hdr *hdr, const char *packet, int len,
+        struct packet_pool *pool, struct packet **segs, int max_segs);
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "heartbeat.h"
+
+/* Track peers 1..num_peers, all alive as of tick now */
+bool heartbeat_init(struct heartbeat_monitor *monitor, int num_peers, uint64_t now)
+{
+    int i = 0;
+
+    memset(monitor, 0, sizeof(*monitor));
+    monitor->peers = (struct heartbeat_peer *) calloc (num_peers + 1, sizeof(*monitor->peers));
+    if (!monitor->peers) {
+        printf("\n Unable to allocate memory for heartbeats - %s", strerror(errno));
+        return false;
+    }
+    monitor->num_peers = num_peers;
+    for (i = 1; i <= num_peers; i++) {
+        monitor->peers[i].alive = true;
+        monitor->peers[i].last_reply = now;
+    }
+    return true;
+}
+
+void heartbeat_destroy(struct heartbeat_monitor *monitor)
+{
+    free(monitor->peers);
+    memset(monitor, 0, sizeof(*monitor));
+}
+
+/* Write the next heartbeat for peer_id into buffer, noting that <packets>
+ * packets were sent to it so far
+ * Returns the heartbeat's length */
+int heartbeat_format(struct heartbeat_monitor *monitor, int peer_id, uint64_t packets,
+        char *buffer)
+{
+    struct heartbeat_peer *peer = &monitor->peers[peer_id];
+    struct heartbeat_msg msg;
+
+    peer->seq++;
+    peer->packets[peer->seq & (HEARTBEAT_HISTORY - 1)] = packets;
+    msg.magic = htonl(HEARTBEAT_MAGIC);
+    msg.router_id = htonl(peer_id);
+    msg.seq = htonl(peer->seq);
+    memcpy(buffer, &msg, sizeof(msg));
+    return sizeof(msg);
+}
+
+/* peer_id answered the heartbeat at message at tick now
+ * Returns true if the peer was dead until now */
+bool heartbeat_reply(struct heartbeat_monitor *monitor, int peer_id, const char *message,
+        int len, uint64_t now)
+{
+    struct heartbeat_peer *peer = &monitor->peers[peer_id];
+    struct heartbeat_msg msg;
+    uint32_t seq = 0;
+    bool back = false;
+
+    if (!heartbeat_is_message(message, len)) {
+        return false;
+    }
+    memcpy(&msg, message, sizeof(msg));
+    seq = ntohl(msg.seq);
+    if (peer->seq - seq >= HEARTBEAT_HISTORY) {
+        /* Unknown, or too old to tell anything */
+        return false;
+    }
+    back = !peer->alive;
+    peer->alive = true;
+    peer->last_reply = now;
+    peer->acked_packets = peer->packets[seq & (HEARTBEAT_HISTORY - 1)];
+    return back;
+}
@@ -0,0 +1,84 @@
+#ifndef HEARTBEAT
+#define HEARTBEAT
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* Liveness of the secondary routers. The primary sends every secondary a
+ * heartbeat on the router sockets every HEARTBEAT_INTERVAL_MS, which the
+ * secondary's loop sends straight back. A secondary that has not answered
+ * for HEARTBEAT_TIMEOUT_MS is dead (or stalled); one answering again is
+ * back. Heartbeats start with a 0 byte, so they are never taken for an
+ * IPv4 packet */
+#define HEARTBEAT_MAGIC       0x00484254u
+#define HEARTBEAT_INTERVAL_MS 100
+#define HEARTBEAT_TIMEOUT_MS  300
+
+/* Heartbeats whose packet counts are remembered (a power of 2) */
+#define HEARTBEAT_HISTORY     8
+
+struct heartbeat_msg
+{
+    uint32_t magic;
+    uint32_t router_id;
+    uint32_t seq;
+};
+
+/* What the primary knows of one secondary. Times are in ms (event loop
+ * ticks). packets[] holds the number of packets sent to the router when
+ * each of the last heartbeats went out, so an answer tells how many of
+ * them the router got to before it */
+struct heartbeat_peer
+{
+    bool alive;
+    uint32_t seq;
+    uint64_t last_reply;
+    uint64_t packets[HEARTBEAT_HISTORY];
+    uint64_t acked_packets;
+};
+
+struct heartbeat_monitor
+{
+    struct heartbeat_peer *peers;
+    int num_peers;
+};
+
+bool heartbeat_init(struct heartbeat_monitor *monitor, int num_peers, uint64_t now);
+void heartbeat_destroy(struct heartbeat_monitor *monitor);
+int heartbeat_format(struct heartbeat_monitor *monitor, int peer_id, uint64_t packets,
+        char *buffer);
+bool heartbeat_reply(struct heartbeat_monitor *monitor, int peer_id, const char *message,
+        int len, uint64_t now);
+
+/* Whether the len bytes at message are a heartbeat (rather than a packet) */
+static inline bool heartbeat_is_message(const char *message, int len)
+{
+    uint32_t magic = 0;
+
+    if (len != (int) sizeof(struct heartbeat_msg)) {
+        return false;
+    }
+    memcpy(&magic, message, sizeof(magic));
+    return ntohl(magic) == HEARTBEAT_MAGIC;
+}
+
+/* Router the heartbeat at message was sent to */
+static inline int heartbeat_router(const char *message)
+{
+    struct heartbeat_msg msg;
+
+    memcpy(&msg, message, sizeof(msg));
+    return ntohl(msg.router_id);
+}
+
+/* Whether peer_id, alive so far, missed it's heartbeats for too long */
+static inline bool heartbeat_expired(struct heartbeat_monitor *monitor, int peer_id, uint64_t now)
+{
+    struct heartbeat_peer *peer = &monitor->peers[peer_id];
+
+    return peer->alive && now - peer->last_reply > HEARTBEAT_TIMEOUT_MS;
+}
+
+#endif
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "ipc.h"
+
+/* Room for the SCM_TIMESTAMPING message of one datagram */
+#define IPC_CONTROL_LEN CMSG_SPACE(sizeof(struct scm_timestamping))
+
+/* Allocate a batch of <size> datagram slots. Packets are taken from and
+ * returned to pool */
+bool ipc_batch_init(struct ipc_batch *batch, int size, struct packet_pool *pool)
+{
+    memset(batch, 0, sizeof(*batch));
+
+    batch->pkts = (struct packet **) calloc (size, sizeof(*batch->pkts));
+    batch->msgs = (struct mmsghdr *) calloc (size, sizeof(*batch->msgs));
+    batch->iovs = (struct iovec *) calloc (size, sizeof(*batch->iovs));
+    batch->addrs = (struct sockaddr_in *) calloc (size, sizeof(*batch->addrs));
+    if (!batch->pkts || !batch->msgs || !batch->iovs || !batch->addrs) {
+        printf("\n Unable to allocate memory for IPC batch - %s", strerror(errno));
+        ipc_batch_free(batch);
+        return false;
+    }
+    batch->size = size;
+    batch->pool = pool;
+    return true;
+}
+
+/* Return the packets still held by the batch and free the slots */
+void ipc_batch_free(struct ipc_batch *batch)
+{
+    int i = 0;
+
+    for (i = 0; batch->pkts && i < batch->size; i++) {
+        if (batch->pkts[i]) {
+            packet_free(batch->pool, batch->pkts[i]);
+        }
+    }
+    free(batch->pkts);
+    free(batch->msgs);
+    free(batch->iovs);
+    free(batch->addrs);
+    free(batch->controls);
+    free(batch->rx_times);
+    memset(batch, 0, sizeof(*batch));
+}
+
+/* Point slot <index> at the buffer of it's packet */
+static void ipc_batch_reset_slot(struct ipc_batch *batch, int index, int len)
+{
+    struct msghdr *hdr = &batch->msgs[index].msg_hdr;
+
+    batch->iovs[index].iov_base = batch->pkts[index]->data;
+    batch->iovs[index].iov_len = len;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_iov = &batch->iovs[index];
+    hdr->msg_iovlen = 1;
+    hdr->msg_name = &batch->addrs[index];
+    hdr->msg_namelen = sizeof(batch->addrs[index]);
+}
+
+/* Keep the kernel's receive time of every message received from now on.
+ * The socket needs SO_TIMESTAMPING, see ipc_socket_rx_timestamps() */
+bool ipc_batch_enable_rx_times(struct ipc_batch *batch)
+{
+    batch->controls = (char *) calloc (batch->size, IPC_CONTROL_LEN);
+    batch->rx_times = (struct timespec *) calloc (batch->size, sizeof(*batch->rx_times));
+    if (!batch->controls || !batch->rx_times) {
+        printf("\n Unable to allocate memory for IPC batch - %s", strerror(errno));
+        free(batch->controls);
+        free(batch->rx_times);
+        batch->controls = NULL;
+        batch->rx_times = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* Kernel receive time (CLOCK_REALTIME) of received message <index>, NULL
+ * if there is none */
+struct timespec *ipc_batch_rx_time(struct ipc_batch *batch, int index)
+{
+    if (!batch->rx_times || batch->rx_times[index].tv_sec == 0) {
+        return NULL;
+    }
+    return &batch->rx_times[index];
+}
+
+/* Have the kernel timestamp every datagram socket_fd receives, in software
+ * as it comes in */
+bool ipc_socket_rx_timestamps(int socket_fd)
+{
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        printf("\n Unable to enable timestamps on socket (%d) - %s", socket_fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Pull the receive time of message <index> out of it's control data. The
+ * control buffer is detached again, so the slot can be sent back as is */
+static void ipc_batch_read_rx_time(struct ipc_batch *batch, int index)
+{
+    struct msghdr *hdr = &batch->msgs[index].msg_hdr;
+    struct cmsghdr *cmsg = NULL;
+    struct scm_timestamping *stamps = NULL;
+
+    memset(&batch->rx_times[index], 0, sizeof(batch->rx_times[index]));
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            stamps = (struct scm_timestamping *) CMSG_DATA(cmsg);
+            batch->rx_times[index] = stamps->ts[0];
+        }
+    }
+    hdr->msg_control = NULL;
+    hdr->msg_controllen = 0;
+}
+
+/* Get the packet held in slot <index>. The batch keeps ownership */
+struct packet *ipc_batch_packet(struct ipc_batch *batch, int index)
+{
+    return batch->pkts[index];
+}
+
+/* Take the packet out of slot <index>, the caller owns it from now on.
+ * The slot is refilled from the pool on the next receive */
+struct packet *ipc_batch_take(struct ipc_batch *batch, int index)
+{
+    struct packet *pkt = batch->pkts[index];
+
+    batch->pkts[index] = NULL;
+    return pkt;
+}
+
+/* Get the source (after a receive) or destination address of slot <index> */
+struct sockaddr_in *ipc_batch_addr(struct ipc_batch *batch, int index)
+{
+    return &batch->addrs[index];
+}
+
+/* Change the destination of slot <index> (e.g. to send a received message back) */
+void ipc_batch_set_dst(struct ipc_batch *batch, int index, struct sockaddr_in dst)
+{
+    batch->addrs[index] = dst;
+    batch->msgs[index].msg_hdr.msg_namelen = sizeof(dst);
+}
+
+/* Close the gaps left by packets taken out of a received batch, so what
+ * is left can be sent on as is. Messages keep their order and address */
+void ipc_batch_compact(struct ipc_batch *batch)
+{
+    int kept = 0;
+    int i = 0;
+
+    for (i = 0; i < batch->count; i++) {
+        if (!batch->pkts[i]) {
+            continue;
+        }
+        if (kept != i) {
+            batch->pkts[kept] = batch->pkts[i];
+            batch->pkts[i] = NULL;
+            batch->addrs[kept] = batch->addrs[i];
+            ipc_batch_reset_slot(batch, kept, batch->pkts[kept]->len);
+        }
+        kept++;
+    }
+    batch->count = kept;
+}
+
+/* Queue the packet in the next free slot. The batch takes ownership of pkt
+ * and returns it to the pool once it has been sent
+ * Returns false if the batch is full and has to be sent first */
+bool ipc_batch_add(struct ipc_batch *batch, struct packet *pkt, struct sockaddr_in dst)
+{
+    if (batch->count == batch->size) {
+        return false;
+    }
+
+    if (batch->pkts[batch->count]) {
+        packet_free(batch->pool, batch->pkts[batch->count]);
+    }
+    batch->pkts[batch->count] = pkt;
+    ipc_batch_reset_slot(batch, batch->count, pkt->len);
+    ipc_batch_set_dst(batch, batch->count, dst);
+    batch->count++;
+    return true;
+}
+
+/* Receive up to batch->size messages from socket_fd with one syscall
+ * Empty slots are refilled from the pool first
+ * Returns the number of messages received, 0 once the socket is drained */
+int router_ipc_receive_batch(int socket_fd, struct ipc_batch *batch)
+{
+    int recv_msgs = 0;
+    int slots = 0;
+    int i = 0;
+
+    batch->count = 0;
+    for (slots = 0; slots < batch->size; slots++) {
+        if (!batch->pkts[slots]) {
+            batch->pkts[slots] = packet_alloc(batch->pool);
+            if (!batch->pkts[slots]) {
+                /* Pool exhausted, receive into what we have */
+                break;
+            }
+        }
+        ipc_batch_reset_slot(batch, slots, batch->pool->buf_size);
+        if (batch->controls) {
+            batch->msgs[slots].msg_hdr.msg_control = batch->controls + slots * IPC_CONTROL_LEN;
+            batch->msgs[slots].msg_hdr.msg_controllen = IPC_CONTROL_LEN;
+        }
+    }
+    if (slots == 0) {
+        return 0;
+    }
+
+    recv_msgs = recvmmsg(socket_fd, batch->msgs, slots, MSG_DONTWAIT, NULL);
+    if (recv_msgs < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            printf("\n Error receiving from socket (%d) - %s", socket_fd, strerror(errno));
+        }
+        return 0;
+    }
+
+    for (i = 0; i < recv_msgs; i++) {
+        batch->pkts[i]->len = batch->msgs[i].msg_len;
+        batch->iovs[i].iov_len = batch->msgs[i].msg_len;
+        if (batch->controls) {
+            ipc_batch_read_rx_time(batch, i);
+        }
+    }
+    batch->count = recv_msgs;
+    return recv_msgs;
+}
+
+/* Send every message queued in the batch, hand the packets back to the
+ * pool and empty the batch
+ * Returns the number of messages the kernel accepted */
+int router_ipc_send_batch(int socket_fd, struct ipc_batch *batch)
+{
+    int sent_msgs = 0;
+    int ret = 0;
+    int i = 0;
+
+    while (sent_msgs < batch->count) {
+        ret = sendmmsg(socket_fd, batch->msgs + sent_msgs, batch->count - sent_msgs, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("\n Error in sending %d messages on socket (%d) - %s", 
+                    batch->count - sent_msgs, socket_fd, strerror(errno));
+            break;
+        }
+        sent_msgs += ret;
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        packet_free(batch->pool, batch->pkts[i]);
+        batch->pkts[i] = NULL;
+    }
+    batch->count = 0;
+    return sent_msgs;
+}
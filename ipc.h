@@ -0,0 +1,45 @@
+#ifndef IPC
+#define IPC
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "packet_pool.h"
+
+/* A batch of datagrams moved with a single recvmmsg / sendmmsg call.
+ * Every slot holds a packet from the pool; the kernel reads into and
+ * writes from the packet buffers directly, so a received batch can be
+ * rewritten in place and sent straight back out */
+struct ipc_batch
+{
+    int size;
+    int count;
+    struct packet_pool *pool;
+    struct packet **pkts;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_in *addrs;
+
+    /* Kernel receive time of every message, when enabled with
+     * ipc_batch_enable_rx_times() on a socket with SO_TIMESTAMPING */
+    char *controls;
+    struct timespec *rx_times;
+};
+
+bool ipc_batch_init(struct ipc_batch *batch, int size, struct packet_pool *pool);
+void ipc_batch_free(struct ipc_batch *batch);
+struct packet *ipc_batch_packet(struct ipc_batch *batch, int index);
+struct packet *ipc_batch_take(struct ipc_batch *batch, int index);
+struct sockaddr_in *ipc_batch_addr(struct ipc_batch *batch, int index);
+void ipc_batch_set_dst(struct ipc_batch *batch, int index, struct sockaddr_in dst);
+void ipc_batch_compact(struct ipc_batch *batch);
+bool ipc_batch_add(struct ipc_batch *batch, struct packet *pkt, struct sockaddr_in dst);
+bool ipc_batch_enable_rx_times(struct ipc_batch *batch);
+struct timespec *ipc_batch_rx_time(struct ipc_batch *batch, int index);
+bool ipc_socket_rx_timestamps(int socket_fd);
+int router_ipc_receive_batch(int socket_fd, struct ipc_batch *batch);
+int router_ipc_send_batch(int socket_fd, struct ipc_batch *batch);
+
+#endif
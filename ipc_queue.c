@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "ipc_queue.h"
+
+/* Set up an empty queue of up to high packets, congested from high down to
+ * low */
+bool ipc_queue_init(struct ipc_queue *queue, int high, int low)
+{
+    uint32_t size = 1;
+
+    memset(queue, 0, sizeof(*queue));
+    while (size < (uint32_t) high) {
+        size <<= 1;
+    }
+    queue->pkts = (struct packet **) calloc (size, sizeof(*queue->pkts));
+    queue->times = (uint64_t *) calloc (size, sizeof(*queue->times));
+    if (!queue->pkts || !queue->times) {
+        printf("\n Unable to allocate memory for IPC queue - %s", strerror(errno));
+        free(queue->pkts);
+        free(queue->times);
+        memset(queue, 0, sizeof(*queue));
+        return false;
+    }
+    queue->mask = size - 1;
+    queue->high = high;
+    queue->low = low;
+    return true;
+}
+
+/* Free the queue, handing the packets still on it back to pool */
+void ipc_queue_destroy(struct ipc_queue *queue, struct packet_pool *pool)
+{
+    uint64_t queued = 0;
+    struct packet *pkt = NULL;
+
+    while ((pkt = ipc_queue_pop(queue, &queued))) {
+        packet_free(pool, pkt);
+    }
+    free(queue->pkts);
+    free(queue->times);
+    memset(queue, 0, sizeof(*queue));
+}
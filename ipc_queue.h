@@ -0,0 +1,75 @@
+#ifndef IPC_QUEUE
+#define IPC_QUEUE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "packet_pool.h"
+
+/* Bounded FIFO of packets a primary worker holds for one secondary until
+ * the secondary can take them, with the time each was queued at. The
+ * queue is congested once it holds <high> packets and stays so until it is
+ * back down to <low>; what happens to packets meanwhile is up to the
+ * caller's drop policy. It never holds more than <high> packets. A queue
+ * belongs to a single thread */
+struct ipc_queue
+{
+    struct packet **pkts;
+    uint64_t *times;
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t high;
+    uint32_t low;
+    bool congested;
+};
+
+bool ipc_queue_init(struct ipc_queue *queue, int high, int low);
+void ipc_queue_destroy(struct ipc_queue *queue, struct packet_pool *pool);
+
+static inline uint32_t ipc_queue_depth(struct ipc_queue *queue)
+{
+    return queue->tail - queue->head;
+}
+
+static inline bool ipc_queue_congested(struct ipc_queue *queue)
+{
+    return queue->congested;
+}
+
+/* Append pkt, queued at now (ns)
+ * Returns false if the queue is full */
+static inline bool ipc_queue_push(struct ipc_queue *queue, struct packet *pkt, uint64_t now)
+{
+    if (ipc_queue_depth(queue) >= queue->high) {
+        return false;
+    }
+    queue->pkts[queue->tail & queue->mask] = pkt;
+    queue->times[queue->tail & queue->mask] = now;
+    queue->tail++;
+    if (ipc_queue_depth(queue) >= queue->high) {
+        queue->congested = true;
+    }
+    return true;
+}
+
+/* Take the oldest packet off the queue, and the time it was queued at
+ * into queued
+ * Returns NULL if the queue is empty */
+static inline struct packet *ipc_queue_pop(struct ipc_queue *queue, uint64_t *queued)
+{
+    struct packet *pkt = NULL;
+
+    if (queue->head == queue->tail) {
+        return NULL;
+    }
+    pkt = queue->pkts[queue->head & queue->mask];
+    *queued = queue->times[queue->head & queue->mask];
+    queue->head++;
+    if (ipc_queue_depth(queue) <= queue->low) {
+        queue->congested = false;
+    }
+    return pkt;
+}
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+
+#include "lpm.h"
+
+#define TBL24_LEN (LPM_TBL24_ENTRIES * sizeof(uint16_t))
+
+/* Get a new tbl8 group with every entry set to next_hop
+ * Returns the group index, -1 if no group is left */
+static int lpm_group_alloc(struct lpm_table *table, uint16_t next_hop)
+{
+    uint16_t *tbl8 = NULL;
+    int max_groups = 0;
+    int group = 0;
+    int i = 0;
+
+    if (table->num_groups == table->max_groups) {
+        if (table->max_groups == LPM_MAX_GROUPS) {
+            return -1;
+        }
+        max_groups = table->max_groups ? table->max_groups * 2 : 64;
+        if (max_groups > LPM_MAX_GROUPS) {
+            max_groups = LPM_MAX_GROUPS;
+        }
+        tbl8 = (uint16_t *) realloc (table->tbl8, 
+                (size_t)max_groups * LPM_GROUP_ENTRIES * sizeof(uint16_t));
+        if (!tbl8) {
+            return -1;
+        }
+        table->tbl8 = tbl8;
+        table->max_groups = max_groups;
+    }
+
+    group = table->num_groups++;
+    for (i = 0; i < LPM_GROUP_ENTRIES; i++) {
+        table->tbl8[group * LPM_GROUP_ENTRIES + i] = next_hop;
+    }
+    return group;
+}
+
+/* Add one route. Routes must be added from the shortest prefix to the
+ * longest, so that a longer prefix always overwrites a shorter one */
+static bool lpm_add(struct lpm_table *table, struct lpm_route *route)
+{
+    uint32_t prefix = 0;
+    uint32_t first = 0;
+    uint32_t count = 0;
+    uint32_t i = 0;
+    uint16_t entry = 0;
+    int group = 0;
+
+    prefix = route->len ? (route->prefix & (0xffffffffu << (32 - route->len))) : 0;
+
+    if (route->len <= 24) {
+        first = prefix >> 8;
+        count = 1u << (24 - route->len);
+        for (i = first; i < first + count; i++) {
+            table->tbl24[i] = route->next_hop;
+        }
+        return true;
+    }
+
+    entry = table->tbl24[prefix >> 8];
+    if (entry & LPM_GROUP_FLAG) {
+        group = entry & ~LPM_GROUP_FLAG;
+    } else {
+        /* Split the /24 into a tbl8 group inheriting it's current next hop */
+        group = lpm_group_alloc(table, entry);
+        if (group < 0) {
+            printf("\n Out of tbl8 groups for route with prefix length %d", route->len);
+            return false;
+        }
+        table->tbl24[prefix >> 8] = LPM_GROUP_FLAG | group;
+    }
+
+    first = prefix & 0xff;
+    count = 1u << (32 - route->len);
+    for (i = first; i < first + count; i++) {
+        table->tbl8[group * LPM_GROUP_ENTRIES + i] = route->next_hop;
+    }
+    return true;
+}
+
+/* Build a table holding the given routes. When the same prefix is given
+ * more than once, the last one wins */
+struct lpm_table *lpm_build(struct lpm_route *routes, int num_routes)
+{
+    struct lpm_table *table = NULL;
+    struct lpm_route *sorted = NULL;
+    int start[34] = {0};
+    void *addr = NULL;
+    int len = 0;
+    int i = 0;
+
+    table = (struct lpm_table *) calloc (1, sizeof(*table));
+    sorted = (struct lpm_route *) calloc (num_routes ? num_routes : 1, sizeof(*sorted));
+    if (!table || !sorted) {
+        printf("\n Unable to allocate memory for route table - %s", strerror(errno));
+        free(table);
+        free(sorted);
+        return NULL;
+    }
+
+    /* tbl24 is mostly untouched for small tables, let the kernel hand out
+     * zero pages lazily */
+    addr = mmap(NULL, TBL24_LEN, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        printf("\n Unable to allocate memory for route table - %s", strerror(errno));
+        free(table);
+        free(sorted);
+        return NULL;
+    }
+    table->tbl24 = (uint16_t *) addr;
+
+    /* Counting sort by prefix length keeps the config order for equal
+     * lengths, so the last duplicate is added last */
+    for (i = 0; i < num_routes; i++) {
+        start[routes[i].len + 1]++;
+    }
+    for (len = 1; len <= 33; len++) {
+        start[len] += start[len - 1];
+    }
+    for (i = 0; i < num_routes; i++) {
+        sorted[start[routes[i].len]++] = routes[i];
+    }
+
+    for (i = 0; i < num_routes; i++) {
+        if (!lpm_add(table, &sorted[i])) {
+            free(sorted);
+            lpm_free(table);
+            return NULL;
+        }
+    }
+    table->num_routes = num_routes;
+    free(sorted);
+    return table;
+}
+
+void lpm_free(struct lpm_table *table)
+{
+    if (!table) {
+        return;
+    }
+    munmap(table->tbl24, TBL24_LEN);
+    free(table->tbl8);
+    free(table);
+}
+
+/* Atomically make table the active one and return the previous table
+ * Readers may still be using the returned table; it can only be freed
+ * once every reader has passed a quiescent state */
+struct lpm_table *lpm_swap(struct lpm_table **active, struct lpm_table *table)
+{
+    return __atomic_exchange_n(active, table, __ATOMIC_ACQ_REL);
+}
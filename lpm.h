@@ -0,0 +1,52 @@
+#ifndef LPM
+#define LPM
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* DIR-24-8 longest prefix match table
+ * tbl24 is indexed by the top 24 bits of the address. An entry holds either
+ * the next hop directly or, with LPM_GROUP_FLAG set, the index of a 256
+ * entry tbl8 group indexed by the last 8 bits. A lookup is one memory
+ * access, two for prefixes longer than /24. Next hop 0 means no route */
+#define LPM_TBL24_ENTRIES   (1 << 24)
+#define LPM_GROUP_ENTRIES   256
+#define LPM_GROUP_FLAG      0x8000
+#define LPM_MAX_NEXT_HOP    0x7fff
+#define LPM_MAX_GROUPS      0x8000
+
+struct lpm_route
+{
+    uint32_t prefix;
+    int len;
+    uint16_t next_hop;
+};
+
+/* A table is built once and never modified afterwards. Updates build a
+ * new table and swap it in (see lpm_swap) */
+struct lpm_table
+{
+    uint16_t *tbl24;
+    uint16_t *tbl8;
+    int num_groups;
+    int max_groups;
+    int num_routes;
+};
+
+struct lpm_table *lpm_build(struct lpm_route *routes, int num_routes);
+void lpm_free(struct lpm_table *table);
+struct lpm_table *lpm_swap(struct lpm_table **active, struct lpm_table *table);
+
+/* Get the next hop of the longest prefix matching addr (host byte order)
+ * Returns 0 if no prefix matches */
+static inline uint16_t lpm_lookup(struct lpm_table *table, uint32_t addr)
+{
+    uint16_t entry = table->tbl24[addr >> 8];
+
+    if (entry & LPM_GROUP_FLAG) {
+        entry = table->tbl8[(entry & ~LPM_GROUP_FLAG) * LPM_GROUP_ENTRIES + (addr & 0xff)];
+    }
+    return entry;
+}
+
+#endif
@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+/* Map zeroed counters for <num_workers> primary workers and <num_routers>
+ * secondary routers. Must be called before forking the secondaries */
+bool metrics_region_init(struct metrics_region *region, int num_workers, int num_routers)
+{
+    memset(region, 0, sizeof(*region));
+    region->len = sizeof(struct metrics) * (num_workers + num_routers);
+    region->slots = (struct metrics *) mmap(NULL, region->len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region->slots == MAP_FAILED) {
+        printf("\n Unable to map metrics of %d routers - %s", num_routers, strerror(errno));
+        region->slots = NULL;
+        return false;
+    }
+    region->num_workers = num_workers;
+    region->num_routers = num_routers;
+
+    /* Only ever looked at by the primary, no need to share them */
+    region->queues = (struct metrics_queue *) calloc ((size_t) num_workers * (num_routers + 1),
+            sizeof(*region->queues));
+    region->graphs = (struct graph **) calloc (num_workers, sizeof(*region->graphs));
+    if (!region->queues || !region->graphs) {
+        printf("\n Unable to allocate memory for queue metrics - %s", strerror(errno));
+        metrics_region_destroy(region);
+        return false;
+    }
+    return true;
+}
+
+void metrics_region_destroy(struct metrics_region *region)
+{
+    if (region->slots) {
+        munmap(region->slots, region->len);
+    }
+    free(region->queues);
+    free(region->graphs);
+    memset(region, 0, sizeof(*region));
+}
+
+struct metrics *metrics_worker(struct metrics_region *region, int worker)
+{
+    return &region->slots[worker];
+}
+
+/* Router ids of the secondaries start at 1 */
+struct metrics *metrics_router(struct metrics_region *region, int router_id)
+{
+    return &region->slots[region->num_workers + router_id - 1];
+}
+
+/* Queue of primary worker <worker> towards secondary router_id */
+struct metrics_queue *metrics_queue(struct metrics_region *region, int worker, int router_id)
+{
+    return &region->queues[(size_t) worker * (region->num_routers + 1) + router_id];
+}
+
+/* Report the node counters of primary worker <worker> from graph */
+void metrics_attach_graph(struct metrics_region *region, int worker, struct graph *graph)
+{
+    region->graphs[worker] = graph;
+}
+
+static int metrics_bucket(uint64_t ns)
+{
+    int exp = 0;
+
+    if (ns < METRICS_HIST_SUB_BUCKETS) {
+        return (int) ns;
+    }
+    exp = 63 - __builtin_clzll(ns);
+    if (exp >= METRICS_HIST_MAX_BITS) {
+        return METRICS_HIST_BUCKETS - 1;
+    }
+    return (exp - METRICS_HIST_SUB_BITS + 1) * METRICS_HIST_SUB_BUCKETS +
+        (int) ((ns >> (exp - METRICS_HIST_SUB_BITS)) & (METRICS_HIST_SUB_BUCKETS - 1));
+}
+
+/* Highest value counted in bucket <index> */
+static uint64_t metrics_bucket_value(int index)
+{
+    int exp = 0;
+    uint64_t sub = 0;
+
+    if (index < METRICS_HIST_SUB_BUCKETS) {
+        return index;
+    }
+    exp = index / METRICS_HIST_SUB_BUCKETS + METRICS_HIST_SUB_BITS - 1;
+    sub = index % METRICS_HIST_SUB_BUCKETS;
+    return ((METRICS_HIST_SUB_BUCKETS + sub + 1) << (exp - METRICS_HIST_SUB_BITS)) - 1;
+}
+
+static void metrics_record(struct metrics_histogram *hist, uint64_t ns)
+{
+    metrics_add(&hist->buckets[metrics_bucket(ns)], 1);
+    metrics_add(&hist->count, 1);
+    metrics_add(&hist->sum, ns);
+    if (ns > hist->max) {
+        __atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_record_latency(struct metrics *m, uint64_t ns)
+{
+    metrics_record(&m->latency, ns);
+}
+
+void metrics_record_queue_wait(struct metrics *m, uint64_t ns)
+{
+    metrics_record(&m->queue_wait, ns);
+}
+
+/* Value below which <percentile> % of the recorded values lie, to the
+ * precision of the buckets. hist should be a private copy */
+uint64_t metrics_percentile(struct metrics_histogram *hist, double percentile)
+{
+    uint64_t total = 0;
+    uint64_t target = 0;
+    uint64_t seen = 0;
+    uint64_t value = 0;
+    double rank = 0;
+    int i = 0;
+
+    for (i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        total += hist->buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    /* Rank of the value, rounded up */
+    rank = total * percentile / 100.0;
+    target = (uint64_t) rank;
+    if (target < rank || target == 0) {
+        target++;
+    }
+    for (i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    value = metrics_bucket_value(i);
+    return (value > hist->max) ? hist->max : value;
+}
+
+struct metrics_inflight *metrics_inflight_alloc(void)
+{
+    struct metrics_inflight *inflight = NULL;
+
+    inflight = (struct metrics_inflight *) calloc (METRICS_INFLIGHT, sizeof(*inflight));
+    if (!inflight) {
+        printf("\n Unable to allocate memory - %s", strerror(errno));
+    }
+    return inflight;
+}
+
+/* Key of an echo request from src to dst. Never 0, which marks a free entry */
+static uint64_t metrics_echo_key(uint32_t src, uint32_t dst, uint16_t id, uint16_t seq)
+{
+    uint64_t key = (((uint64_t) src << 32) | dst) * 0x9e3779b97f4a7c15ULL;
+
+    key ^= ((uint64_t) id << 16) | seq;
+    key ^= key >> 29;
+    return key ? key : 1;
+}
+
+/* Remember when the echo request in view came in from the tunnel. An
+ * older request hashing to the same entry is forgotten */
+void metrics_track_request(struct metrics_inflight *inflight, struct packet_view *view, uint64_t now)
+{
+    uint64_t key = metrics_echo_key(view->src, view->dst, view->echo_id, view->echo_seq);
+    struct metrics_inflight *entry = &inflight[key & (METRICS_INFLIGHT - 1)];
+
+    entry->key = key;
+    entry->start_ns = now;
+}
+
+/* The reply in view is going out to the tunnel: record how long ago it's
+ * request came in, if it is still remembered */
+void metrics_track_reply(struct metrics *m, struct metrics_inflight *inflight,
+        struct packet_view *view, uint64_t now)
+{
+    uint64_t key = metrics_echo_key(view->dst, view->src, view->echo_id, view->echo_seq);
+    struct metrics_inflight *entry = &inflight[key & (METRICS_INFLIGHT - 1)];
+
+    if (entry->key != key) {
+        return;
+    }
+    entry->key = 0;
+    metrics_record_latency(m, now - entry->start_ns);
+}
+
+bool metrics_server_init(struct metrics_server *server, char *path, struct metrics_region *region)
+{
+    memset(server, 0, sizeof(*server));
+    server->region = region;
+
+    server->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->fd < 0) {
+        printf("\n Unable to open metrics socket - %s", strerror(errno));
+        return false;
+    }
+
+    server->addr.sun_family = AF_UNIX;
+    strncpy(server->addr.sun_path, path, sizeof(server->addr.sun_path) - 1);
+    unlink(server->addr.sun_path);
+    if (bind(server->fd, (struct sockaddr *) &server->addr, sizeof(server->addr)) < 0) {
+        printf("\n Unable to bind metrics socket %s - %s", path, strerror(errno));
+        close(server->fd);
+        return false;
+    }
+    return true;
+}
+
+void metrics_server_close(struct metrics_server *server)
+{
+    close(server->fd);
+    unlink(server->addr.sun_path);
+}
+
+/* Copy the counters of m with relaxed loads, as their owner keeps writing */
+static void metrics_read(struct metrics *m, struct metrics *copy)
+{
+    uint64_t *from = (uint64_t *) m;
+    uint64_t *to = (uint64_t *) copy;
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(*m) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Copy the counters of a queue with relaxed loads, like metrics_read() */
+static void metrics_read_queue(struct metrics_queue *q, struct metrics_queue *copy)
+{
+    uint64_t *from = (uint64_t *) q;
+    uint64_t *to = (uint64_t *) copy;
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(*q) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Format the percentiles of hist (a private copy) as a line of it's own,
+ * if anything was recorded
+ * Returns the length written */
+static int metrics_format_histogram(struct metrics_histogram *hist, char *name, char *label,
+        char *buf, size_t len)
+{
+    if (hist->count == 0 || len == 0) {
+        return 0;
+    }
+    return snprintf(buf, len, "%s %s count %lu mean %lu p50 %lu "
+            "p90 %lu p99 %lu p999 %lu max %lu\n", name, label, (unsigned long) hist->count,
+            (unsigned long) (hist->sum / hist->count),
+            (unsigned long) metrics_percentile(hist, 50.0),
+            (unsigned long) metrics_percentile(hist, 90.0),
+            (unsigned long) metrics_percentile(hist, 99.0),
+            (unsigned long) metrics_percentile(hist, 99.9),
+            (unsigned long) hist->max);
+}
+
+/* Format one thread's metrics as a counters line, a policing line if it
+ * policed anything and, if it saw any replies or queued any packets, the
+ * latency and queue wait lines
+ * Returns the length written */
+static size_t metrics_format(struct metrics *m, char *name, char *buf, size_t len)
+{
+    struct metrics copy;
+    bool policed = false;
+    int class = 0;
+    int used = 0;
+
+    metrics_read(m, &copy);
+    used = snprintf(buf, len, "%s rx_packets %lu rx_bytes %lu tx_packets %lu tx_bytes %lu "
+            "filtered_drops %lu alloc_failures %lu send_errors %lu local_replies %lu\n", name,
+            (unsigned long) copy.rx_packets, (unsigned long) copy.rx_bytes,
+            (unsigned long) copy.tx_packets, (unsigned long) copy.tx_bytes,
+            (unsigned long) copy.filtered_drops, (unsigned long) copy.alloc_failures,
+            (unsigned long) copy.send_errors, (unsigned long) copy.local_replies);
+    for (class = 0; class < POLICE_CLASSES; class++) {
+        policed |= (copy.police_drops[class] > 0);
+    }
+    if ((policed || copy.police_evictions > 0) && (size_t) used < len) {
+        used += snprintf(buf + used, len - used, "%s police_drops %s %lu %s %lu %s %lu %s %lu "
+                "evictions %lu\n", name,
+                police_class_names[police_class_icmp],
+                (unsigned long) copy.police_drops[police_class_icmp],
+                police_class_names[police_class_udp],
+                (unsigned long) copy.police_drops[police_class_udp],
+                police_class_names[police_class_tcp],
+                (unsigned long) copy.police_drops[police_class_tcp],
+                police_class_names[police_class_other],
+                (unsigned long) copy.police_drops[police_class_other],
+                (unsigned long) copy.police_evictions);
+    }
+    if ((size_t) used < len) {
+        used += metrics_format_histogram(&copy.latency, name, "latency_ns", buf + used,
+                len - used);
+    }
+    if ((size_t) used < len) {
+        used += metrics_format_histogram(&copy.queue_wait, name, "queue_wait_ns", buf + used,
+                len - used);
+    }
+    return ((size_t) used < len) ? (size_t) used : len - 1;
+}
+
+/* Format the counters of every node of graph that ran, a line each
+ * Returns the length written */
+static size_t metrics_format_graph(struct graph *graph, char *name, char *buf, size_t len)
+{
+    struct graph_node *node = NULL;
+    uint64_t calls = 0;
+    int used = 0;
+    int i = 0;
+
+    for (i = 0; i < graph->num_nodes && (size_t) used < len; i++) {
+        node = &graph->nodes[i];
+        calls = __atomic_load_n(&node->calls, __ATOMIC_RELAXED);
+        if (calls == 0) {
+            continue;
+        }
+        used += snprintf(buf + used, len - used, "%s node %s calls %lu packets %lu drops %lu\n",
+                name, node->name, (unsigned long) calls,
+                (unsigned long) __atomic_load_n(&node->packets, __ATOMIC_RELAXED),
+                (unsigned long) __atomic_load_n(&node->drops, __ATOMIC_RELAXED));
+    }
+    return ((size_t) used < len) ? (size_t) used : len - 1;
+}
+
+/* Format the queues of all primary workers towards secondary router_id as
+ * one line, if they ever held anything
+ * Returns the length written */
+static size_t metrics_format_queue(struct metrics_region *region, int router_id, char *name,
+        char *buf, size_t len)
+{
+    struct metrics_queue total = {0};
+    struct metrics_queue copy;
+    int used = 0;
+    int i = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    for (i = 0; i < region->num_workers; i++) {
+        metrics_read_queue(metrics_queue(region, i, router_id), &copy);
+        total.depth += copy.depth;
+        total.max_depth = (copy.max_depth > total.max_depth) ? copy.max_depth : total.max_depth;
+        total.sent += copy.sent;
+        total.wait_ns += copy.wait_ns;
+        total.tail_drops += copy.tail_drops;
+        total.head_drops += copy.head_drops;
+        total.spilled += copy.spilled;
+        total.socket_drops += copy.socket_drops;
+        total.mirrored += copy.mirrored;
+    }
+    if (total.sent == 0 && total.tail_drops == 0 && total.head_drops == 0 &&
+        total.spilled == 0 && total.socket_drops == 0 && total.mirrored == 0) {
+        return 0;
+    }
+    used = snprintf(buf, len, "%s queue depth %lu max_depth %lu sent %lu wait_mean_ns %lu "
+            "tail_drops %lu head_drops %lu spilled %lu socket_drops %lu mirrored %lu\n", name,
+            (unsigned long) total.depth, (unsigned long) total.max_depth,
+            (unsigned long) total.sent,
+            (unsigned long) (total.sent ? total.wait_ns / total.sent : 0),
+            (unsigned long) total.tail_drops, (unsigned long) total.head_drops,
+            (unsigned long) total.spilled, (unsigned long) total.socket_drops,
+            (unsigned long) total.mirrored);
+    return ((size_t) used < len) ? (size_t) used : len - 1;
+}
+
+static void metrics_reply(struct metrics_server *server, struct sockaddr_un *peer,
+        socklen_t peer_len, char *reply, size_t len)
+{
+    if (sendto(server->fd, reply, len, MSG_DONTWAIT, (struct sockaddr *) peer, peer_len) < 0) {
+        printf("\n Unable to answer on metrics socket - %s", strerror(errno));
+    }
+}
+
+/* Metrics socket is readable: answer every request with a snapshot, one
+ * datagram per METRICS_MSG_LEN worth of lines. The snapshot only reads the
+ * counters, the forwarding threads never wait for it */
+void metrics_server_ready(int fd, void *ctx)
+{
+    struct metrics_server *server = (struct metrics_server *) ctx;
+    struct metrics_region *region = server->region;
+    char request[METRICS_MSG_LEN];
+    char reply[METRICS_MSG_LEN];
+    char line[2048];
+    char name[32];
+    struct sockaddr_un peer;
+    socklen_t peer_len = 0;
+    size_t used = 0;
+    size_t len = 0;
+    int i = 0;
+
+    while (1) {
+        peer_len = sizeof(peer);
+        if (recvfrom(fd, request, sizeof(request), 0, (struct sockaddr *) &peer, &peer_len) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("\n Error reading metrics socket - %s", strerror(errno));
+            }
+            return;
+        }
+        if (peer_len <= sizeof(sa_family_t)) {
+            /* Unnamed sender, nowhere to answer */
+            continue;
+        }
+
+        used = 0;
+        for (i = 0; i < region->num_workers + region->num_routers; i++) {
+            if (i < region->num_workers) {
+                snprintf(name, sizeof(name), "router 0 worker %d", i);
+            } else {
+                snprintf(name, sizeof(name), "router %d", i - region->num_workers + 1);
+            }
+            len = metrics_format(&region->slots[i], name, line, sizeof(line));
+            if (i < region->num_workers && region->graphs[i]) {
+                len += metrics_format_graph(region->graphs[i], name, line + len,
+                        sizeof(line) - len);
+            }
+            if (i >= region->num_workers) {
+                len += metrics_format_queue(region, i - region->num_workers + 1, name,
+                        line + len, sizeof(line) - len);
+            }
+            if (used + len > sizeof(reply)) {
+                metrics_reply(server, &peer, peer_len, reply, used);
+                used = 0;
+            }
+            memcpy(reply + used, line, len);
+            used += len;
+        }
+        if (used + strlen("end\n") > sizeof(reply)) {
+            metrics_reply(server, &peer, peer_len, reply, used);
+            used = 0;
+        }
+        memcpy(reply + used, "end\n", strlen("end\n"));
+        used += strlen("end\n");
+        metrics_reply(server, &peer, peer_len, reply, used);
+    }
+}
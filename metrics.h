@@ -0,0 +1,147 @@
+#ifndef METRICS
+#define METRICS
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/un.h>
+
+#include "packet_pool.h"
+#include "config.h"
+#include "graph.h"
+
+/* Latency histogram with HDR-style log-linear buckets: values below
+ * 2^METRICS_HIST_SUB_BITS get a bucket each, every power of 2 above is
+ * split into 2^METRICS_HIST_SUB_BITS buckets (about 3% wide). Values of
+ * 2^METRICS_HIST_MAX_BITS ns (~18 min) and more land in the last bucket */
+#define METRICS_HIST_SUB_BITS    5
+#define METRICS_HIST_SUB_BUCKETS (1 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_MAX_BITS    40
+#define METRICS_HIST_BUCKETS     ((METRICS_HIST_MAX_BITS - METRICS_HIST_SUB_BITS + 1) * \
+                                  METRICS_HIST_SUB_BUCKETS)
+
+/* Echo requests a primary worker remembers the arrival time of, until the
+ * reply goes out (a power of 2) */
+#define METRICS_INFLIGHT 4096
+
+#define METRICS_MSG_LEN  4096
+
+struct metrics_histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[METRICS_HIST_BUCKETS];
+};
+
+/* Counters of one forwarding thread. rx is what the thread takes in (the
+ * tunnel for a primary worker, requests for a secondary) and tx what it
+ * sends back out (replies). Only the owning thread writes them, with plain
+ * relaxed stores, so they cost no more than local counters; the snapshot
+ * reads them with relaxed loads */
+struct metrics
+{
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t filtered_drops;
+    uint64_t alloc_failures;
+    uint64_t send_errors;
+
+    /* Echo requests answered by a primary worker itself (route ... local) */
+    uint64_t local_replies;
+
+    /* Packets dropped over their source's rate, by class, and buckets
+     * taken over by new sources. Primary workers only */
+    uint64_t police_drops[POLICE_CLASSES];
+    uint64_t police_evictions;
+
+    /* Tunnel in to tunnel out, primary workers only */
+    struct metrics_histogram latency;
+
+    /* Time packets spent queued for their secondary, primary workers only */
+    struct metrics_histogram queue_wait;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* A primary worker's queue towards one secondary (see ipc_queue.h), written
+ * by the worker. depth is the current depth. socket_drops is only kept by
+ * worker 0: datagrams the secondary's socket dropped, as found from the
+ * heartbeats */
+struct metrics_queue
+{
+    uint64_t depth;
+    uint64_t max_depth;
+    uint64_t sent;
+    uint64_t wait_ns;
+    uint64_t tail_drops;
+    uint64_t head_drops;
+    uint64_t spilled;
+    uint64_t socket_drops;
+    uint64_t mirrored;
+};
+
+/* The counters of every thread of every router, in memory shared with the
+ * secondaries (mapped before they are forked), so the primary can report
+ * them all. Primary worker w has slot w, secondary router r slot
+ * num_workers + r - 1. The node counters of primary worker w are those of
+ * it's graph, graphs[w] */
+struct metrics_region
+{
+    struct metrics *slots;
+    struct metrics_queue *queues;
+    struct graph **graphs;
+    size_t len;
+    int num_workers;
+    int num_routers;
+};
+
+/* Arrival time of an echo request, keyed by it's addresses and echo id/seq */
+struct metrics_inflight
+{
+    uint64_t key;
+    uint64_t start_ns;
+};
+
+/* Local datagram socket answering every datagram with a snapshot of the
+ * region, in as many datagrams as it takes */
+struct metrics_server
+{
+    int fd;
+    struct sockaddr_un addr;
+    struct metrics_region *region;
+};
+
+bool metrics_region_init(struct metrics_region *region, int num_workers, int num_routers);
+void metrics_region_destroy(struct metrics_region *region);
+struct metrics *metrics_worker(struct metrics_region *region, int worker);
+struct metrics *metrics_router(struct metrics_region *region, int router_id);
+struct metrics_queue *metrics_queue(struct metrics_region *region, int worker, int router_id);
+void metrics_attach_graph(struct metrics_region *region, int worker, struct graph *graph);
+void metrics_record_latency(struct metrics *m, uint64_t ns);
+void metrics_record_queue_wait(struct metrics *m, uint64_t ns);
+uint64_t metrics_percentile(struct metrics_histogram *hist, double percentile);
+struct metrics_inflight *metrics_inflight_alloc(void);
+void metrics_track_request(struct metrics_inflight *inflight, struct packet_view *view, uint64_t now);
+void metrics_track_reply(struct metrics *m, struct metrics_inflight *inflight,
+        struct packet_view *view, uint64_t now);
+bool metrics_server_init(struct metrics_server *server, char *path, struct metrics_region *region);
+void metrics_server_ready(int fd, void *ctx);
+void metrics_server_close(struct metrics_server *server);
+
+/* Add n to a counter of the calling thread's own metrics */
+static inline void metrics_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif
@@ -18,16 +18,35 @@
 #include "packet_parser.h"
 #include "checksum.h"
 
-#define IPV4_STR_LEN 16
 #define NUM_OCTETS 4
 #define CHECKSUM_LENGTH 2
+#define IP_HEADER_MIN_LEN 20
+#define ICMP_HEADER_LEN 8
+#define L4_PORTS_LEN 4
+
+/* Offsets of the IPv4 header fields */
+enum ip_header_format {
+    ip_version_ihl = 0,
+    ip_ttl = 8,
+    ip_protocol = 9,
+    ip_header_checksum = 10,
+    ip_src_start = 12,
+    ip_dst_start = 16
+};
+
+/* Offsets of the ICMP header fields, from the end of the IP header */
+enum icmp_header_format {
+    icmp_msg_type = 0,
+    icmp_msg_code = 1,
+    icmp_checksum = 2,
+    icmp_echo_id = 4,
+    icmp_echo_seq = 6
+};
 
-enum icmp_packet_format {
-    icmp_protocol = 9,
-    icmp_src_start = 12,
-    icmp_dst_start = 16,
-    icmp_msg_type = 20,
-    icmp_checksum = 22,
+/* Offsets of the ports, the same in the TCP and UDP headers */
+enum l4_header_format {
+    l4_src_port = 0,
+    l4_dst_port = 2
 };
 
 /* Debug utility to print the message contents */
@@ -44,97 +63,166 @@ void packet_dump(char *message, int msg_size)
 
 }
 
-/* Check if the packet given corresponds to ICMP or not */
-bool is_protocol_icmp(char *buffer)
+static inline uint16_t read_u16(char *buffer, size_t offset)
+{
+    uint16_t value = 0;
+
+    memcpy(&value, buffer + offset, sizeof(value));
+    return ntohs(value);
+}
+
+static inline uint32_t read_u32(char *buffer, size_t offset)
+{
+    uint32_t value = 0;
+
+    memcpy(&value, buffer + offset, sizeof(value));
+    return ntohl(value);
+}
+
+/* Parse the IPv4 packet in message into view. The L4 header is found
+ * through the IHL, so IP options are skipped
+ * Returns false if message is not a well formed IPv4 packet */
+bool packet_view_parse(struct packet_view *view, char *message, size_t msg_size)
 {
-    if (!buffer) {
-        printf("\n Empty buffer passed");
+    uint8_t version_ihl = 0;
+    size_t header_len = 0;
+
+    if (!message || msg_size < IP_HEADER_MIN_LEN) {
         return false;
     }
 
-    if ((uint8_t)buffer[icmp_protocol] == IPPROTO_ICMP) {
-        return true;
+    version_ihl = (uint8_t)message[ip_version_ihl];
+    header_len = (version_ihl & 0x0f) * 4;
+    if ((version_ihl >> 4) != 4 || header_len < IP_HEADER_MIN_LEN || header_len > msg_size) {
+        return false;
+    }
+
+    memset(view, 0, sizeof(*view));
+    view->src = read_u32(message, ip_src_start);
+    view->dst = read_u32(message, ip_dst_start);
+    view->len = msg_size;
+    view->l4_offset = header_len;
+    view->protocol = (uint8_t)message[ip_protocol];
+
+    if (view->protocol == IPPROTO_ICMP) {
+        if (msg_size < header_len + ICMP_HEADER_LEN) {
+            return false;
+        }
+        message += header_len;
+        view->icmp_type = (uint8_t)message[icmp_msg_type];
+        view->icmp_code = (uint8_t)message[icmp_msg_code];
+        view->echo_id = read_u16(message, icmp_echo_id);
+        view->echo_seq = read_u16(message, icmp_echo_seq);
+    } else if (view->protocol == IPPROTO_TCP || view->protocol == IPPROTO_UDP) {
+        if (msg_size < header_len + L4_PORTS_LEN) {
+            return false;
+        }
+        message += header_len;
+        view->src_port = read_u16(message, l4_src_port);
+        view->dst_port = read_u16(message, l4_dst_port);
     }
-    return false;
+    return true;
 }
 
-/* Check if the packet given corresponds to echo or response */
-bool is_icmp_echo(char buffer[])
+/* Check if the packet given corresponds to ICMP or not */
+bool packet_view_is_icmp(struct packet_view *view)
 {
-    if ((uint8_t)buffer[icmp_msg_type] == ICMP_ECHO) {
-        return true;
-    }
-    return false;
+    return view->protocol == IPPROTO_ICMP;
 }
 
-/* Form an ICMP echo reply */
-void form_echo_reply(char *message, size_t msg_size)
+/* Check if the packet given is an ICMP echo request */
+bool packet_view_is_echo(struct packet_view *view)
+{
+    return packet_view_is_icmp(view) && view->icmp_type == ICMP_ECHO;
+}
+
+/* Turn the ICMP echo request in message (parsed into view) into it's reply,
+ * in place. view is updated to match */
+void form_echo_reply(struct packet_view *view, char *message)
 {
     int temp = 0;
     int i = 0;
+    uint32_t addr = 0;
     uint16_t checksum_val = 0;
-
-    if (!message) {
-        printf("\n Empty message received");
-        return;
-    }
+    uint16_t old_word = 0;
+    uint16_t new_word = 0;
+    char *icmp = message + view->l4_offset;
 
     /* Swap the source and destination in the ICMP packet */
     while (i < NUM_OCTETS) {
-        temp = message[icmp_src_start + i];
-        message[icmp_src_start + i] = message[icmp_dst_start + i];
-        message[icmp_dst_start + i] = temp;
+        temp = message[ip_src_start + i];
+        message[ip_src_start + i] = message[ip_dst_start + i];
+        message[ip_dst_start + i] = temp;
         i++;
     }
-
-    /* Set type as ICMP */
-    message[icmp_msg_type] = ICMP_ECHOREPLY;
-
-    memset(message + icmp_checksum, 0, CHECKSUM_LENGTH);
-    /* API Copyright (c) 2019 by Guillermo Baltra */
-    checksum_val = checksum(message + icmp_msg_type, msg_size-icmp_msg_type);
-    memcpy(message + icmp_checksum , &checksum_val, sizeof(checksum_val));
+    addr = view->src;
+    view->src = view->dst;
+    view->dst = addr;
+
+    /* Set type as ICMP. Only the type/code word changes, so patch the
+     * checksum (RFC 1624) instead of summing the whole message again. The
+     * IP header checksum stays valid, swapping the addresses keeps the sum */
+    memcpy(&old_word, icmp + icmp_msg_type, sizeof(old_word));
+    icmp[icmp_msg_type] = ICMP_ECHOREPLY;
+    view->icmp_type = ICMP_ECHOREPLY;
+    memcpy(&new_word, icmp + icmp_msg_type, sizeof(new_word));
+
+    memcpy(&checksum_val, icmp + icmp_checksum, CHECKSUM_LENGTH);
+    checksum_val = checksum_update16(checksum_val, old_word, new_word);
+    memcpy(icmp + icmp_checksum , &checksum_val, sizeof(checksum_val));
 }
 
-/* Given a buffer, return the address corresponding to start_index 
- * start_index can either be source or destination address's starting byte */
-char* parse_ip_addr(char buffer[], int start_index)
+/* Check the IP header checksum and, for ICMP, the checksum of the ICMP
+ * message of the given packet */
+bool packet_checksums_valid(struct packet_view *view, char *message)
 {
-    char *ip = NULL;
-    
-    ip = (char *) calloc (1, IPV4_STR_LEN);
-    if (ip == NULL) {
-        printf("\n Unable to allocate memory for storing IP address");
-        exit(1);
-    } 
-  
-   snprintf(ip, IPV4_STR_LEN, "%u.%u.%u.%u", (uint8_t)buffer[start_index], (uint8_t)buffer[start_index+1], (uint8_t)buffer[start_index+2], (uint8_t)buffer[start_index+3]);
-
-    return ip;
+    if (!checksum_valid(message, view->l4_offset)) {
+        return false;
+    }
+    if (packet_view_is_icmp(view) && 
+        !checksum_valid(message + view->l4_offset, view->len - view->l4_offset)) {
+        return false;
+    }
+    return true;
 }
 
-/* Get the ICMP message type (Echo / Reply) of the given message */    
-int get_icmp_type(char *message)
+/* 16 bits telling apart the flows between the same two addresses: the
+ * echo id for ICMP, the ports for TCP and UDP */
+uint16_t packet_view_flow_id(struct packet_view *view)
 {
-    if (!message) {
-        printf("\n Empty message received ptr passed");
-        exit(-1);
+    if (packet_view_is_icmp(view)) {
+        return view->echo_id;
     }
-    return (int) message[icmp_msg_type];
+    return view->src_port ^ view->dst_port;
 }
 
-/* Get the source address field from the given message */
-char *get_src_addr(char buffer[])
+/* Decrement the TTL of the IPv4 packet in message, patching the header
+ * checksum (RFC 1624)
+ * Returns false if the TTL ran out and the packet must not be forwarded */
+bool packet_decrement_ttl(char *message)
 {
-    char *src_ip = NULL;
-    src_ip = parse_ip_addr(buffer, icmp_src_start);
-    return src_ip;
+    uint16_t checksum_val = 0;
+    uint16_t old_word = 0;
+    uint16_t new_word = 0;
+
+    if ((uint8_t)message[ip_ttl] <= 1) {
+        return false;
+    }
+    memcpy(&old_word, message + ip_ttl, sizeof(old_word));
+    message[ip_ttl]--;
+    memcpy(&new_word, message + ip_ttl, sizeof(new_word));
+
+    memcpy(&checksum_val, message + ip_header_checksum, CHECKSUM_LENGTH);
+    checksum_val = checksum_update16(checksum_val, old_word, new_word);
+    memcpy(message + ip_header_checksum, &checksum_val, sizeof(checksum_val));
+    return true;
 }
 
-/* Get the destination address field from the given message */
-char *get_dst_addr(char buffer[])
+/* Format a host order address into ip (IPV4_STR_LEN bytes) and return it.
+ * Only used when a line is actually written out */
+char *format_ip_addr(uint32_t ip, char *buf)
 {
-    char *dst_ip = NULL;
-    dst_ip = parse_ip_addr(buffer, icmp_dst_start);
-    return dst_ip;
+    snprintf(buf, IPV4_STR_LEN, "%u.%u.%u.%u", (ip >> 24) & 0xff, (ip >> 16) & 0xff, 
+            (ip >> 8) & 0xff, ip & 0xff);
+    return buf;
 }
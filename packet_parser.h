@@ -0,0 +1,39 @@
+#ifndef PACKET_PARSER
+#define PACKET_PARSER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IPV4_STR_LEN 16
+
+/* Fields of an IPv4 packet, parsed once when the packet comes in. Values
+ * are in host byte order; len is the length of the packet and l4_offset is
+ * where the IP header (options included) ends. ICMP fields (type, code and
+ * echo id/seq) are only set for ICMP packets, ports only for TCP and UDP */
+struct packet_view
+{
+    uint32_t src;
+    uint32_t dst;
+    uint16_t len;
+    uint16_t l4_offset;
+    uint8_t protocol;
+    uint8_t icmp_type;
+    uint8_t icmp_code;
+    uint16_t echo_id;
+    uint16_t echo_seq;
+    uint16_t src_port;
+    uint16_t dst_port;
+};
+
+void packet_dump(char *message, int msg_size);
+bool packet_view_parse(struct packet_view *view, char *message, size_t msg_size);
+bool packet_view_is_icmp(struct packet_view *view);
+bool packet_view_is_echo(struct packet_view *view);
+void form_echo_reply(struct packet_view *view, char *message);
+bool packet_checksums_valid(struct packet_view *view, char *message);
+uint16_t packet_view_flow_id(struct packet_view *view);
+bool packet_decrement_ttl(char *message);
+char *format_ip_addr(uint32_t ip, char *buf);
+
+#endif
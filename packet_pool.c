@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "packet_pool.h"
+
+/* Round value up to the next multiple of align (power of 2) */
+static size_t align_up(size_t value, size_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+/* Allocate the buffer area, from hugepages if asked for and available.
+ * Memory is touched up front so no page faults happen while forwarding */
+static bool packet_pool_alloc_buffers(struct packet_pool *pool, size_t len, bool use_hugepages)
+{
+    void *addr = NULL;
+
+    if (use_hugepages) {
+        pool->buffers_len = align_up(len, HUGE_PAGE_SIZE);
+        addr = mmap(NULL, pool->buffers_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (addr != MAP_FAILED) {
+            pool->buffers = (char *) addr;
+            pool->hugepages = true;
+            return true;
+        }
+        printf("\n Unable to allocate hugepages for packet pool - %s. Using regular pages", 
+                strerror(errno));
+    }
+
+    pool->buffers_len = align_up(len, CACHE_LINE_SIZE);
+    pool->buffers = (char *) aligned_alloc(CACHE_LINE_SIZE, pool->buffers_len);
+    if (!pool->buffers) {
+        printf("\n Unable to allocate memory for packet pool - %s", strerror(errno));
+        return false;
+    }
+    memset(pool->buffers, 0, pool->buffers_len);
+    pool->hugepages = false;
+    return true;
+}
+
+/* Create a pool of <count> buffers of <buf_size> bytes each
+ * Every buffer starts on a cache line boundary */
+bool packet_pool_init(struct packet_pool *pool, int count, int buf_size, bool use_hugepages)
+{
+    int i = 0;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->buf_size = align_up(buf_size, CACHE_LINE_SIZE);
+
+    pool->packets = (struct packet *) aligned_alloc(CACHE_LINE_SIZE, 
+            align_up(sizeof(struct packet) * count, CACHE_LINE_SIZE));
+    if (!pool->packets) {
+        printf("\n Unable to allocate memory for packet descriptors - %s", strerror(errno));
+        return false;
+    }
+
+    if (!packet_pool_alloc_buffers(pool, (size_t)count * pool->buf_size, use_hugepages)) {
+        free(pool->packets);
+        pool->packets = NULL;
+        return false;
+    }
+
+    /* Chain the buffers in reverse so that they are handed out in address order */
+    for (i = count - 1; i >= 0; i--) {
+        pool->packets[i].data = pool->buffers + (size_t)i * pool->buf_size;
+        pool->packets[i].len = 0;
+        packet_free(pool, &pool->packets[i]);
+    }
+    pool->size = count;
+    return true;
+}
+
+void packet_pool_destroy(struct packet_pool *pool)
+{
+    if (pool->hugepages) {
+        munmap(pool->buffers, pool->buffers_len);
+    } else {
+        free(pool->buffers);
+    }
+    free(pool->packets);
+    memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,74 @@
+#ifndef PACKET_POOL
+#define PACKET_POOL
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "packet_parser.h"
+
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+/* Packet descriptor. data points into the pool's buffer area and stays
+ * fixed for the lifetime of the pool, so the kernel can read into it
+ * directly and the descriptor can be handed from stage to stage. view holds
+ * the parsed headers, filled in by whoever receives the packet. port is
+ * the port of the router it came from (0 for the tunnel) and router_id the
+ * secondary it goes to. With tracing, trace_time is when it came in, a
+ * kernel timestamp if trace_kernel is set */
+struct packet
+{
+    struct packet *next;
+    char *data;
+    int len;
+    struct packet_view view;
+    uint16_t port;
+    uint16_t router_id;
+#ifdef PACKET_TRACE
+    bool trace_kernel;
+    uint64_t trace_time;
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Fixed number of fixed size buffers, allocated once at startup.
+ * A pool is owned by a single forwarding loop and is not thread safe */
+struct packet_pool
+{
+    struct packet *packets;
+    char *buffers;
+    size_t buffers_len;
+    bool hugepages;
+    struct packet *free_list;
+    int free_count;
+    int size;
+    int buf_size;
+};
+
+bool packet_pool_init(struct packet_pool *pool, int count, int buf_size, bool use_hugepages);
+void packet_pool_destroy(struct packet_pool *pool);
+
+/* Take a buffer from the pool, NULL when it is exhausted */
+static inline struct packet *packet_alloc(struct packet_pool *pool)
+{
+    struct packet *pkt = pool->free_list;
+
+    if (pkt) {
+        pool->free_list = pkt->next;
+        pool->free_count--;
+        pkt->next = NULL;
+        pkt->len = 0;
+        pkt->port = 0;
+    }
+    return pkt;
+}
+
+/* Return a buffer to the pool. The most recently freed buffer is handed
+ * out first, so it is likely still in cache */
+static inline void packet_free(struct packet_pool *pool, struct packet *pkt)
+{
+    pkt->next = pool->free_list;
+    pool->free_list = pkt;
+    pool->free_count++;
+}
+
+#endif
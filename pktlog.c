@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "pktlog.h"
+
+/* Records written to the file per write() */
+#define PKTLOG_WRITE_BATCH 256
+
+/* Write all of len bytes, the file is not expected to return short writes
+ * but a signal may interrupt us */
+static bool pktlog_write(int fd, const void *buf, size_t len)
+{
+    const char *data = (const char *) buf;
+    ssize_t written = 0;
+
+    while (len > 0) {
+        written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("\n Unable to write packet log - %s", strerror(errno));
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+/* Move every record queued on the rings into the file
+ * Returns the number of records written */
+static size_t pktlog_drain(struct pktlog *log)
+{
+    struct pktlog_record batch[PKTLOG_WRITE_BATCH];
+    struct pktlog_ring *ring = NULL;
+    size_t written = 0;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t count = 0;
+    int i = 0;
+
+    for (i = 0; i < log->num_rings; i++) {
+        ring = &log->rings[i];
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            count = 0;
+            while (tail != head && count < PKTLOG_WRITE_BATCH) {
+                batch[count++] = ring->records[tail & (PKTLOG_RING_SIZE - 1)];
+                tail++;
+            }
+            /* The slots are copied out, hand them back to the producer */
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            pktlog_write(log->fd, batch, count * sizeof(batch[0]));
+            written += count;
+        }
+    }
+    return written;
+}
+
+/* Writer thread: keep draining the rings, nap whenever they are empty */
+static void *pktlog_writer(void *arg)
+{
+    struct pktlog *log = (struct pktlog *) arg;
+
+    while (log->running) {
+        if (pktlog_drain(log) == 0) {
+            usleep(PKTLOG_FLUSH_US);
+        }
+    }
+    pktlog_drain(log);
+    return NULL;
+}
+
+/* Create the log file at path for router_id with <num_rings> rings (one
+ * per forwarding thread) and start it's writer thread */
+bool pktlog_open(struct pktlog *log, const char *path, int router_id, int num_rings)
+{
+    struct pktlog_header header = {0};
+    size_t len = sizeof(struct pktlog_ring) * num_rings;
+    int ret = 0;
+
+    memset(log, 0, sizeof(*log));
+    log->router_id = router_id;
+    log->num_rings = num_rings;
+
+    log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd < 0) {
+        printf("\n Unable to open packet log %s - %s", path, strerror(errno));
+        return false;
+    }
+
+    memcpy(header.magic, PKTLOG_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(struct pktlog_record);
+    header.router_id = router_id;
+    if (!pktlog_write(log->fd, &header, sizeof(header))) {
+        close(log->fd);
+        return false;
+    }
+
+    log->rings = (struct pktlog_ring *) aligned_alloc(CACHE_LINE_SIZE, len);
+    if (!log->rings) {
+        printf("\n Unable to allocate memory - %s", strerror(errno));
+        close(log->fd);
+        return false;
+    }
+    memset(log->rings, 0, len);
+
+    log->running = true;
+    ret = pthread_create(&log->writer, NULL, pktlog_writer, log);
+    if (ret != 0) {
+        printf("\n Unable to start packet log writer - %s", strerror(ret));
+        free(log->rings);
+        close(log->fd);
+        return false;
+    }
+    return true;
+}
+
+/* Stop the writer once it has written every queued record and close the file
+ * Returns the number of records dropped because a ring was full */
+uint64_t pktlog_close(struct pktlog *log)
+{
+    uint64_t dropped = 0;
+    int i = 0;
+
+    log->running = false;
+    pthread_join(log->writer, NULL);
+
+    for (i = 0; i < log->num_rings; i++) {
+        dropped += atomic_load(&log->rings[i].dropped);
+    }
+    free(log->rings);
+    close(log->fd);
+    return dropped;
+}
@@ -0,0 +1,99 @@
+#ifndef PKTLOG
+#define PKTLOG
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet_pool.h"
+
+#define PKTLOG_MAGIC     "PKTLOG1"
+#define PKTLOG_RING_SIZE 4096      /* Records per ring, power of 2 */
+#define PKTLOG_FLUSH_US  1000      /* Writer's nap when every ring is empty */
+
+enum pktlog_kind {
+    pktlog_from_tunnel = 1,        /* Packet from tunnel */
+    pktlog_from_port               /* Packet from another router's port */
+};
+
+/* One logged packet. Addresses are in host order. protocol is 0 in logs
+ * written before other protocols than ICMP were forwarded */
+struct pktlog_record
+{
+    uint64_t time_ns;
+    uint32_t src;
+    uint32_t dst;
+    uint16_t port;
+    uint8_t kind;
+    uint8_t icmp_type;
+    uint8_t protocol;
+    uint8_t reserved[3];
+};
+
+/* Start of a log file, followed by pktlog_records */
+struct pktlog_header
+{
+    char magic[8];
+    uint32_t record_size;
+    int32_t router_id;
+};
+
+/* Single producer (a forwarding thread), single consumer (the writer)
+ * ring. Producer and consumer indexes live on their own cache lines */
+struct pktlog_ring
+{
+    _Atomic size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint64_t dropped;
+    _Atomic size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct pktlog_record records[PKTLOG_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/* Binary log of one router: a ring per forwarding thread, drained into an
+ * append-only file by a background writer thread */
+struct pktlog
+{
+    int fd;
+    int router_id;
+    int num_rings;
+    struct pktlog_ring *rings;
+    pthread_t writer;
+    volatile bool running;
+};
+
+bool pktlog_open(struct pktlog *log, const char *path, int router_id, int num_rings);
+uint64_t pktlog_close(struct pktlog *log);
+
+/* Queue a record on ring. Never blocks: when the writer falls behind the
+ * record is counted as dropped instead */
+static inline void pktlog_add(struct pktlog_ring *ring, enum pktlog_kind kind,
+        struct packet_view *view, uint16_t port)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct pktlog_record *record = NULL;
+    struct timespec now;
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= PKTLOG_RING_SIZE) {
+        atomic_store_explicit(&ring->dropped,
+                atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                memory_order_relaxed);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    record = &ring->records[head & (PKTLOG_RING_SIZE - 1)];
+    record->time_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->src = view->src;
+    record->dst = view->dst;
+    record->port = port;
+    record->kind = kind;
+    record->icmp_type = view->icmp_type;
+    record->protocol = view->protocol;
+    memset(record->reserved, 0, sizeof(record->reserved));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <netinet/in.h>
+
+#include "pktlog.h"
+
+/* Format a host order address as a dotted quad */
+static char *format_ip(uint32_t ip, char *buf, size_t len)
+{
+    snprintf(buf, len, "%u.%u.%u.%u", (ip >> 24) & 0xff, (ip >> 16) & 0xff,
+            (ip >> 8) & 0xff, ip & 0xff);
+    return buf;
+}
+
+/* Name of an IP protocol as printed in the log. Older logs only hold ICMP
+ * and leave the protocol 0 */
+static const char *protocol_name(uint8_t protocol)
+{
+    switch (protocol) {
+        case 0:
+        case IPPROTO_ICMP:
+            return "ICMP";
+        case IPPROTO_UDP:
+            return "UDP";
+        case IPPROTO_TCP:
+            return "TCP";
+        default:
+            return "IP";
+    }
+}
+
+/* Usage - ./pktlog_decode <log-file>
+ * Print the records of a binary packet log in the router's text format */
+int main(int argc, char *argv[])
+{
+    struct pktlog_header header;
+    struct pktlog_record record;
+    char src_ip[16];
+    char dst_ip[16];
+    const char *protocol = NULL;
+    FILE *fp = NULL;
+
+    if (argc <= 1) {
+        printf("\n Usage \n ./pktlog_decode <log-file> \n");
+        return 1;
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (!fp) {
+        printf("\n Unable to open %s - %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, PKTLOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(record)) {
+        printf("\n %s is not a packet log\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        format_ip(record.src, src_ip, sizeof(src_ip));
+        format_ip(record.dst, dst_ip, sizeof(dst_ip));
+        protocol = protocol_name(record.protocol);
+        switch (record.kind) {
+            case pktlog_from_tunnel:
+                printf("%s from tunnel, src: %s, dst: %s, type: %d\n",
+                        protocol, src_ip, dst_ip, record.icmp_type);
+                break;
+            case pktlog_from_port:
+                printf("%s from port: %d, src: %s, dst: %s, type: %d\n",
+                        protocol, record.port, src_ip, dst_ip, record.icmp_type);
+                break;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
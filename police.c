@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "police.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+static inline uint32_t police_hash(uint32_t src, int class)
+{
+    uint32_t h = src * 0x9e3779b1u;
+
+    h ^= (uint32_t) class * 0x85ebca6bu;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+/* Whether any class is policed */
+bool police_enabled(struct config_police *classes)
+{
+    int class = 0;
+
+    for (class = 0; class < POLICE_CLASSES; class++) {
+        if (classes[class].rate > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Set up a table of size buckets, policing the classes with a rate. The
+ * table gets 1 / shares of every rate and burst, the rest going to the
+ * tables of the other shares */
+bool police_init(struct police *police, struct config_police *classes, int size, int shares)
+{
+    uint32_t num_heads = 1;
+    int class = 0;
+    uint32_t i = 0;
+
+    memset(police, 0, sizeof(*police));
+    for (class = 0; class < POLICE_CLASSES; class++) {
+        if (classes[class].rate == 0) {
+            continue;
+        }
+        police->rates[class].cost = NSEC_PER_SEC * shares / classes[class].rate;
+        if (police->rates[class].cost == 0) {
+            police->rates[class].cost = 1;
+        }
+        /* Burst / shares packets, at least one */
+        police->rates[class].depth = NSEC_PER_SEC * classes[class].burst / classes[class].rate;
+        if (police->rates[class].depth < police->rates[class].cost) {
+            police->rates[class].depth = police->rates[class].cost;
+        }
+    }
+
+    while (num_heads < (uint32_t) size) {
+        num_heads <<= 1;
+    }
+    police->buckets = (struct police_bucket *) calloc (size, sizeof(*police->buckets));
+    police->heads = (int32_t *) malloc (num_heads * sizeof(*police->heads));
+    if (!police->buckets || !police->heads) {
+        printf("\n Unable to allocate memory for policing - %s", strerror(errno));
+        police_destroy(police);
+        return false;
+    }
+    for (i = 0; i < num_heads; i++) {
+        police->heads[i] = -1;
+    }
+    police->mask = num_heads - 1;
+    police->size = size;
+    police->lru_head = -1;
+    police->lru_tail = -1;
+    return true;
+}
+
+void police_destroy(struct police *police)
+{
+    free(police->buckets);
+    free(police->heads);
+    memset(police, 0, sizeof(*police));
+}
+
+static void police_lru_unlink(struct police *police, int32_t index)
+{
+    struct police_bucket *bucket = &police->buckets[index];
+
+    if (bucket->lru_prev >= 0) {
+        police->buckets[bucket->lru_prev].lru_next = bucket->lru_next;
+    } else {
+        police->lru_head = bucket->lru_next;
+    }
+    if (bucket->lru_next >= 0) {
+        police->buckets[bucket->lru_next].lru_prev = bucket->lru_prev;
+    } else {
+        police->lru_tail = bucket->lru_prev;
+    }
+}
+
+/* Make bucket index the most recently used */
+static void police_lru_push(struct police *police, int32_t index)
+{
+    struct police_bucket *bucket = &police->buckets[index];
+
+    bucket->lru_prev = -1;
+    bucket->lru_next = police->lru_head;
+    if (police->lru_head >= 0) {
+        police->buckets[police->lru_head].lru_prev = index;
+    } else {
+        police->lru_tail = index;
+    }
+    police->lru_head = index;
+}
+
+/* Take the least recently used bucket off it's hash chain for a new source
+ * Returns it's index */
+static int32_t police_evict(struct police *police)
+{
+    int32_t index = police->lru_tail;
+    struct police_bucket *bucket = &police->buckets[index];
+    int32_t *link = &police->heads[police_hash(bucket->src, bucket->class) & police->mask];
+
+    while (*link != index) {
+        link = &police->buckets[*link].hash_next;
+    }
+    *link = bucket->hash_next;
+    police_lru_unlink(police, index);
+    police->evictions++;
+    return index;
+}
+
+/* Charge a packet of class from src, seen at now (ns), to it's bucket
+ * Returns false if the bucket has no credit left: drop the packet */
+bool police_admit(struct police *police, uint32_t src, int class, uint64_t now)
+{
+    struct police_rate *rate = &police->rates[class];
+    struct police_bucket *bucket = NULL;
+    uint32_t head = police_hash(src, class) & police->mask;
+    int32_t index = police->heads[head];
+
+    while (index >= 0) {
+        bucket = &police->buckets[index];
+        if (bucket->src == src && bucket->class == class) {
+            break;
+        }
+        index = bucket->hash_next;
+    }
+
+    if (index < 0) {
+        /* New source, with a full bucket */
+        index = (police->used < police->size) ? police->used++ : police_evict(police);
+        bucket = &police->buckets[index];
+        bucket->src = src;
+        bucket->class = class;
+        bucket->credit = rate->depth;
+        bucket->last = now;
+        bucket->hash_next = police->heads[head];
+        police->heads[head] = index;
+        police_lru_push(police, index);
+    } else if (index != police->lru_head) {
+        police_lru_unlink(police, index);
+        police_lru_push(police, index);
+    }
+
+    if (now > bucket->last) {
+        bucket->credit += now - bucket->last;
+        if (bucket->credit > rate->depth) {
+            bucket->credit = rate->depth;
+        }
+        bucket->last = now;
+    }
+    if (bucket->credit < rate->cost) {
+        return false;
+    }
+    bucket->credit -= rate->cost;
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef POLICE
+#define POLICE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "config.h"
+
+/* Per source token bucket policing. Every (source address, class) pair
+ * gets a bucket, refilled at the class's rate up to it's burst; a packet
+ * finding it's bucket empty is dropped. The buckets live in a table of
+ * fixed size, allocated once: a bucket is found through a chained hash,
+ * and once the table is full the least recently used bucket is taken over
+ * by the next new source. A table belongs to a single thread, so with
+ * several primary workers each polices it's share of the rates.
+ *
+ * Tokens are kept as time: a packet costs 1s / rate of credit, and a
+ * bucket holds at most burst packets worth of it. Credit grows by the time
+ * since the bucket was last seen, so refilling needs no timer and no
+ * division */
+
+#define POLICE_NONE (-1)
+
+struct police_bucket
+{
+    uint32_t src;
+    int32_t class;
+    int32_t hash_next;
+    int32_t lru_prev;
+    int32_t lru_next;
+    uint64_t credit;
+    uint64_t last;
+};
+
+struct police_rate
+{
+    uint64_t cost;
+    uint64_t depth;
+};
+
+struct police
+{
+    struct police_rate rates[POLICE_CLASSES];
+    struct police_bucket *buckets;
+    int32_t *heads;
+    uint32_t mask;
+    int size;
+    int used;
+    int32_t lru_head;
+    int32_t lru_tail;
+    uint64_t evictions;
+};
+
+bool police_enabled(struct config_police *classes);
+bool police_init(struct police *police, struct config_police *classes, int size, int shares);
+void police_destroy(struct police *police);
+bool police_admit(struct police *police, uint32_t src, int class, uint64_t now);
+
+/* Class of the IPv4 packet in the len bytes at data, and it's source
+ * address (host byte order) in src
+ * Returns POLICE_NONE for anything else or a class not policed */
+static inline int police_classify(struct police *police, const char *data, int len,
+        uint32_t *src)
+{
+    const uint8_t *ip = (const uint8_t *) data;
+    int class = police_class_other;
+
+    if (len < 20 || (ip[0] >> 4) != 4) {
+        return POLICE_NONE;
+    }
+    switch (ip[9]) {
+        case IPPROTO_ICMP:
+            class = police_class_icmp;
+            break;
+        case IPPROTO_TCP:
+            class = police_class_tcp;
+            break;
+        case IPPROTO_UDP:
+            class = police_class_udp;
+            break;
+    }
+    if (police->rates[class].cost == 0) {
+        return POLICE_NONE;
+    }
+    *src = (uint32_t) ip[12] << 24 | (uint32_t) ip[13] << 16 | (uint32_t) ip[14] << 8 | ip[15];
+    return class;
+}
+
+#endif
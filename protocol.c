@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+
+#define UDP_HEADER_LEN     8
+#define TCP_HEADER_MIN_LEN 20
+
+/* Offsets into the UDP and TCP headers */
+enum protocol_header_format {
+    udp_length = 4,
+    tcp_data_offset = 12
+};
+
+const struct protocol_handler *protocol_table[PROTOCOL_MAX];
+
+/* Forward the packet on: it leaves through the egress socket unless it's
+ * TTL ran out */
+static enum protocol_verdict protocol_forward(char *message)
+{
+    return packet_decrement_ttl(message) ? protocol_egress : protocol_drop;
+}
+
+/* Any ICMP message with valid checksums */
+static bool icmp_accept(struct packet_view *view, char *message)
+{
+    return packet_checksums_valid(view, message);
+}
+
+/* Echo requests are answered by the router, other ICMP messages are
+ * forwarded */
+static enum protocol_verdict icmp_handle(struct packet_view *view, char *message)
+{
+    if (packet_view_is_echo(view)) {
+        form_echo_reply(view, message);
+        return protocol_reply;
+    }
+    return protocol_forward(message);
+}
+
+/* UDP datagram whose length fits the packet. Checksums of TCP and UDP are
+ * left to the end hosts, only the IP header's is checked */
+static bool udp_accept(struct packet_view *view, char *message)
+{
+    uint16_t len = 0;
+
+    if (view->len < view->l4_offset + UDP_HEADER_LEN) {
+        return false;
+    }
+    memcpy(&len, message + view->l4_offset + udp_length, sizeof(len));
+    len = ntohs(len);
+    return len >= UDP_HEADER_LEN && len <= view->len - view->l4_offset &&
+        packet_checksums_valid(view, message);
+}
+
+/* TCP segment whose header fits the packet */
+static bool tcp_accept(struct packet_view *view, char *message)
+{
+    int header_len = 0;
+
+    if (view->len < view->l4_offset + TCP_HEADER_MIN_LEN) {
+        return false;
+    }
+    header_len = ((uint8_t) message[view->l4_offset + tcp_data_offset] >> 4) * 4;
+    return header_len >= TCP_HEADER_MIN_LEN && header_len <= view->len - view->l4_offset &&
+        packet_checksums_valid(view, message);
+}
+
+static enum protocol_verdict l4_handle(struct packet_view *view, char *message)
+{
+    (void) view;
+    return protocol_forward(message);
+}
+
+static const struct protocol_handler icmp_handler = {"icmp", icmp_accept, icmp_handle};
+static const struct protocol_handler udp_handler = {"udp", udp_accept, l4_handle};
+static const struct protocol_handler tcp_handler = {"tcp", tcp_accept, l4_handle};
+
+/* Have packets of the given IP protocol handled by handler (NULL drops
+ * them). Only to be called at startup */
+void protocol_register(uint8_t protocol, const struct protocol_handler *handler)
+{
+    protocol_table[protocol] = handler;
+}
+
+/* Register the handlers of the protocols the routers forward */
+void protocol_init(void)
+{
+    protocol_register(IPPROTO_ICMP, &icmp_handler);
+    protocol_register(IPPROTO_UDP, &udp_handler);
+    protocol_register(IPPROTO_TCP, &tcp_handler);
+}
@@ -0,0 +1,44 @@
+#ifndef PROTOCOL
+#define PROTOCOL
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "packet_parser.h"
+
+/* Number of IP protocol numbers, the size of the dispatch table */
+#define PROTOCOL_MAX 256
+
+/* What a secondary router did with a packet */
+enum protocol_verdict {
+    protocol_drop,                 /* Dropped */
+    protocol_reply,                /* Rewritten in place into a reply, goes back
+                                    * to the primary and out of the tunnel */
+    protocol_egress                /* Forwarded, leaves through the egress socket */
+};
+
+/* Handling of one IP protocol. accept() runs on the primary for every
+ * packet read from the tunnel and tells whether it is fit to be forwarded;
+ * handle() runs on the secondary and may rewrite the packet in place.
+ * Both get the packet parsed into view */
+struct protocol_handler
+{
+    const char *name;
+    bool (*accept)(struct packet_view *view, char *message);
+    enum protocol_verdict (*handle)(struct packet_view *view, char *message);
+};
+
+/* Handlers by IP protocol number, NULL for protocols that are dropped.
+ * Filled in once at startup, before any router runs */
+extern const struct protocol_handler *protocol_table[PROTOCOL_MAX];
+
+void protocol_register(uint8_t protocol, const struct protocol_handler *handler);
+void protocol_init(void);
+
+/* Handler of the packet in view, looked up once per packet */
+static inline const struct protocol_handler *protocol_lookup(struct packet_view *view)
+{
+    return protocol_table[view->protocol];
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 /* Socket Libraries */
 #include <sys/types.h>
@@ -15,33 +16,131 @@
 #include <arpa/inet.h>
 #include <linux/if_tun.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 /* Local Libraries */
 #include "config.h"
 #include "tunif.h"
 #include "packet_parser.h"
+#include "event_loop.h"
+#include "ipc.h"
+#include "flow_hash.h"
+#include "lpm.h"
+#include "flow_table.h"
+#include "control.h"
+#include "pktlog.h"
+#include "shm_ipc.h"
+#include "metrics.h"
+#include "trace.h"
+#include "protocol.h"
+#include "graph.h"
+#include "heartbeat.h"
+#include "police.h"
+#include "ipc_queue.h"
 
 struct in_addr interface_addr = {0};
 
 /* Networking */
 #define PORT_ANY 0
 #define INTERFACE_NAME "lo"
-#define IDLE_TIMEOUT 15 
+#define IDLE_TIMEOUT 15
 #define TUN_NAME "tun1"
 
+/* Next hop of the routes answered by the primary (route ... local) */
+#define ROUTE_LOCAL LPM_MAX_NEXT_HOP
+
+/* How long the primary waits for the secondaries to come up */
+#define STARTUP_TIMEOUT_MS 5000
+
 enum router_order {
     router_order_primary,
     router_order_2
 };
 
-/* Global structure to hold router's FD, port, log file pointer and pid */
+/* Per router state: router's FD, port, log file pointer, pid, and the
+ * binary packet log and sampled trace of the packets it forwards
+ * One entry per router, each on it's own cache line(s) */
 struct router_info
 {
     int router_fd;
     int port;
     FILE *fp;
     pid_t pid;
-} router_info[MAX_ROUTERS + 1];
+    struct pktlog log;
+    struct trace trace;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* router_info[0] is the primary, router_info[1..num_routers] the secondaries */
+struct router_info *router_info = NULL;
+int num_routers = 0;
+
+/* Router handled by this process */
+int current_router_id = router_order_primary;
+
+/* Spreads the primary's flows over the secondary routers */
+struct flow_hash flow_hash;
+
+/* Secondary routers answering their heartbeats, indexed by router id.
+ * Written by primary worker 0 only, read by every worker */
+bool *router_alive = NULL;
+
+/* Destination based routes from the config file. Replaced as a whole on
+ * SIGUSR1; destinations without a route fall back to the flow hash */
+struct lpm_table *route_table = NULL;
+char *config_file_name = NULL;
+
+/* Match/action rules installed through the control socket. They are
+ * checked before the routes */
+struct flow_table *flow_table = NULL;
+
+/* Rings between the primary's workers and the secondaries, used instead of
+ * the UDP sockets unless the config asks for UDP */
+struct shm_ipc shm_ipc;
+bool use_shm_ipc = false;
+
+/* Counters of every forwarding thread, shared with the secondaries */
+struct metrics_region metrics_region;
+
+/* Size of every packet buffer, derived from the tunnel's MTU at startup */
+int packet_buf_size = MAX_BUFFER_SIZE;
+
+/* A secondary router run as a thread of this process (runtime thread) */
+struct router_thread
+{
+    int router_id;
+    int cpu;
+    struct router_config *config;
+    pthread_t thread;
+};
+
+/* Whether the secondaries are processes or threads. Router threads are
+ * told to stop through shutdown_efd rather than by SIGHUP */
+enum router_runtime router_runtime = router_runtime_process;
+struct router_thread *router_threads = NULL;
+int shutdown_efd = -1;
+
+/* Secondaries report ready on this pipe, read by the primary */
+int ready_pipe[2] = {-1, -1};
+
+/* Allocate the state of the primary and <count> secondary routers */
+void router_info_init(int count)
+{
+    size_t len = sizeof(struct router_info) * (count + 1);
+
+    router_info = (struct router_info *) aligned_alloc(CACHE_LINE_SIZE, len);
+    if (!router_info) {
+        printf("\n Unable to allocate memory for %d routers - %s", count, strerror(errno));
+        exit(-1);
+    }
+    memset(router_info, 0, len);
+    num_routers = count;
+}
 
 /* Open a log file of format stage<stage-number>.r<router-number>.out */
 void logger_init(int stage, int router_num)
@@ -55,10 +154,69 @@ void logger_init(int stage, int router_num)
         printf("\n Unable to open config file %s - %s", log_file, strerror(errno));
         exit(1);
     }
-    router_info[router_num].fp = fp; 
+    router_info[router_num].fp = fp;
+}
+
+/* Open the packet log stage<stage-number>.r<router-number>.log of a router
+ * with a ring per forwarding thread. pktlog_decode turns it into the text
+ * format of the .out files */
+void packet_log_init(int stage, int router_num, int num_rings)
+{
+    char log_file[MAX_FILE_LEN] = {0};
+
+    snprintf(log_file, MAX_FILE_LEN, "stage%d.r%d.log", stage, router_num);
+    if (!pktlog_open(&router_info[router_num].log, log_file, router_num, num_rings)) {
+        exit(1);
+    }
+}
+
+/* Write out the rest of the packet log and report any records it dropped */
+void packet_log_close(int router_num)
+{
+    uint64_t dropped = pktlog_close(&router_info[router_num].log);
+
+    if (dropped) {
+        printf("\n Packet log of router %d dropped %lu records", router_num,
+                (unsigned long) dropped);
+    }
+}
+
+/* Set up the trace of a router with a buffer per forwarding thread, if
+ * the config asks for one */
+void packet_trace_init(struct router_config *config, int router_num, int num_buffers)
+{
+    uint32_t sample = config->trace_sample;
+
+#ifndef PACKET_TRACE
+    if (sample) {
+        printf("\n Tracing is not compiled in, build with make TRACE=1");
+        sample = 0;
+    }
+#endif
+    if (!trace_open(&router_info[router_num].trace, router_num, num_buffers, sample)) {
+        exit(-1);
+    }
+}
+
+/* Trace buffer of forwarding thread <index> of a router, NULL when not
+ * tracing */
+struct trace_buffer *packet_trace_buffer(int router_num, int index)
+{
+    struct trace *trace = &router_info[router_num].trace;
+
+    return trace->buffers ? &trace->buffers[index] : NULL;
+}
+
+/* Write the trace out to stage<stage-number>.r<router-number>.trace.json */
+void packet_trace_close(int stage, int router_num)
+{
+    char trace_file[MAX_FILE_LEN] = {0};
+
+    snprintf(trace_file, MAX_FILE_LEN, "stage%d.r%d.trace.json", stage, router_num);
+    trace_close(&router_info[router_num].trace, trace_file);
 }
 
-/* Get the IP for the given interface 
+/* Get the IP for the given interface
  * I/P - Interface name
  * O/P - IP corresponding to the given interface_name */
 struct in_addr get_interface_addr(char * interface_name)
@@ -73,20 +231,18 @@ struct in_addr get_interface_addr(char * interface_name)
     }
 
     interface.ifr_addr.sa_family = AF_INET;
-    strncpy(interface.ifr_name, INTERFACE_NAME, IFNAMSIZ-1);
+    strncpy(interface.ifr_name, interface_name, IFNAMSIZ-1);
     if (ioctl(interface_fd, SIOCGIFADDR, &interface) < 0) {
         printf("\n Error in ioctl - %s", strerror(errno));
     }
+    close(interface_fd);
 
     return ((struct sockaddr_in *)&interface.ifr_addr)->sin_addr;
 }
 
-/* Initialize a router with given router_id 
- * - Open a UDP socket
- * - Assign a dynamic port
- * - Get the port number assigned 
- * - Log info */
-void router_init(int router_id)
+/* Open a UDP socket on interface_addr with a dynamic port
+ * O/P - Socket fd, port number assigned (port) */
+int open_router_socket(int *port)
 {
     int socket_fd = 0;
     struct sockaddr_in server_addr = {0};
@@ -98,8 +254,6 @@ void router_init(int router_id)
         exit(-1);
     }
 
-    interface_addr = get_interface_addr(INTERFACE_NAME); 
-
     server_addr.sin_family = AF_INET;
     memcpy(&server_addr.sin_addr.s_addr, &interface_addr, sizeof(interface_addr));
     server_addr.sin_port = PORT_ANY;
@@ -114,22 +268,114 @@ void router_init(int router_id)
     if (getsockname(socket_fd, (struct sockaddr *)&server_addr, &len) < 0) {
         printf("\n Unable to get socket (%d) information - %s", socket_fd, strerror(errno));
         exit(1);
-    } 
+    }
+
+    *port = ntohs(server_addr.sin_port);
+    return socket_fd;
+}
 
-    router_info[router_id].router_fd = socket_fd;
-    router_info[router_id].port = ntohs(server_addr.sin_port);
+/* Initialize a router with given router_id
+ * - Open a UDP socket on interface_addr (looked up once, by main())
+ * - Assign a dynamic port
+ * - Get the port number assigned
+ * - Log info (secondaries are logged by router_log_pid() once up) */
+void router_init(int router_id)
+{
+    router_info[router_id].router_fd = open_router_socket(&router_info[router_id].port);
 
     if (router_id == router_order_primary) {
         fprintf(router_info[router_id].fp, "primary port: %d\n", router_info[router_id].port);
-    } else {
-        fprintf(router_info[router_order_primary].fp, 
-                "router: %d, pid: %d, port: %d\n", router_id, getpid(), router_info[router_id].port); 
-        fprintf(router_info[router_id].fp, 
-                "router: %d, pid: %d, port: %d\n", router_id, getpid(), router_info[router_id].port);
-        fflush(router_info[router_order_primary].fp);
+        fflush(router_info[router_id].fp);
     }
+}
+
+/* Log the pid and port of secondary router <router_id> into <fp> */
+void router_log_pid(FILE *fp, int router_id)
+{
+    fprintf(fp, "router: %d, pid: %d, port: %d\n",
+            router_id, router_info[router_id].pid, router_info[router_id].port);
+    fflush(fp);
+}
+
+/* Close router's log file and socket */
+void cleanup(int router_id)
+{
+    printf("\n Cleaning up router %d", router_id);
+    fprintf(router_info[router_id].fp, "router %d closed", router_id);
     fflush(router_info[router_id].fp);
-} 
+    fclose(router_info[router_id].fp);
+    close(router_info[router_id].router_fd);
+}
+
+/* Readiness report of a secondary router, written to the readiness pipe
+ * once it's socket is up. Small enough for the write to be atomic, so the
+ * reports of routers coming up at the same time never interleave */
+struct router_ready
+{
+    int32_t router_id;
+    int32_t port;
+    int32_t pid;
+};
+
+/* Bring up secondary router <router_id> in it's own process or thread,
+ * in parallel with the others: open it's log and socket and report it's
+ * port to the primary */
+void router_bring_up(int stage, int router_id)
+{
+    struct router_ready ready = {0};
+
+    logger_init(stage, router_id);
+    router_init(router_id);
+    router_log_pid(router_info[router_id].fp, router_id);
+
+    ready.router_id = router_id;
+    ready.port = router_info[router_id].port;
+    ready.pid = router_info[router_id].pid;
+    if (write(ready_pipe[1], &ready, sizeof(ready)) != sizeof(ready)) {
+        printf("\n Router %d unable to report ready - %s", router_id, strerror(errno));
+        exit(-1);
+    }
+}
+
+/* Wait for every secondary router to report ready, all at once on the
+ * readiness pipe, and take down their ports
+ * Returns false if they are not all up within STARTUP_TIMEOUT_MS */
+bool wait_for_routers(void)
+{
+    struct router_ready ready[64];
+    struct pollfd pfd = {0};
+    uint64_t start = event_loop_now();
+    uint64_t waited = 0;
+    int routers_up = 0;
+    ssize_t len = 0;
+    int i = 0;
+
+    pfd.fd = ready_pipe[0];
+    pfd.events = POLLIN;
+    while (routers_up < num_routers) {
+        waited = event_loop_now() - start;
+        if (waited >= STARTUP_TIMEOUT_MS ||
+            poll(&pfd, 1, STARTUP_TIMEOUT_MS - waited) <= 0) {
+            printf("\n Only %d of %d routers came up", routers_up, num_routers);
+            return false;
+        }
+        len = read(ready_pipe[0], ready, sizeof(ready));
+        if (len <= 0) {
+            /* Every router left without reporting */
+            printf("\n Only %d of %d routers came up", routers_up, num_routers);
+            return false;
+        }
+        for (i = 0; i < (int) (len / sizeof(ready[0])); i++) {
+            if ((ready[i].router_id < router_order_2) || (ready[i].router_id > num_routers)) {
+                continue;
+            }
+            router_info[ready[i].router_id].port = ready[i].port;
+            router_info[ready[i].router_id].pid = ready[i].pid;
+            routers_up++;
+        }
+    }
+    return true;
+}
 
 /* Send the buffer argument passed to socket socket_fd */
 void router_ipc_send(int socket_fd, char * buffer, int msg_size, struct sockaddr_in dst)
@@ -141,38 +387,32 @@ void router_ipc_send(int socket_fd, char * buffer, int msg_size, struct sockaddr
         return;
     }
 
-    sent_bytes = sendto(socket_fd, buffer, msg_size, 0, (const struct sockaddr *) &dst, sizeof(dst)); 
+    sent_bytes = sendto(socket_fd, buffer, msg_size, 0, (const struct sockaddr *) &dst, sizeof(dst));
     if (sent_bytes < 0) {
         printf("\n Error in sending message on socket (%d) - %s", socket_fd, strerror(errno));
     }
 }
 
-/* Receive message from socket fd of router <router_id>
- * I/P - Router ID
- * O/P - Message received and it's size
- * Caller should take care of free'ing the memory allocated */
-char* router_ipc_receive(int router_id, int *msg_size)
+/* Receive a message from socket fd of router <router_id> into the caller's
+ * buffer of size bytes, NUL terminated
+ * Returns it's length, or -1 once the socket has nothing more to read */
+int router_ipc_receive(int router_id, char *buffer, int size)
 {
     socklen_t len = 0;
     int recv_bytes = 0;
-    char buffer[MAX_BUFFER_SIZE] = {0};
     struct sockaddr_storage  client_addr = {0};
-    char *message = NULL;
 
-    recv_bytes = recvfrom(router_info[router_id].router_fd, &buffer, 
-            MAX_BUFFER_SIZE, 0, (struct sockaddr *)&client_addr, &len);
-    buffer[recv_bytes] = '\0';
-
-    message = (char *) malloc (recv_bytes + 1);
-    if (!message) {
-        printf("\n Unable to allocate memory - %s", strerror(errno));
-        exit(-1);
+    recv_bytes = recvfrom(router_info[router_id].router_fd, buffer,
+            size - 1, 0, (struct sockaddr *)&client_addr, &len);
+    if (recv_bytes < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            printf("\n Error receiving from socket (%d) - %s",
+                    router_info[router_id].router_fd, strerror(errno));
+        }
+        return -1;
     }
-    memset(message, 0, recv_bytes + 1);
-    memcpy(message, &buffer, recv_bytes);
-
-    *msg_size = recv_bytes + 1;
-    return message;
+    buffer[recv_bytes] = '\0';
+    return recv_bytes;
 }
 
 void set_sockaddr_details(struct sockaddr_in *sockaddr, int port)
@@ -182,314 +422,2215 @@ void set_sockaddr_details(struct sockaddr_in *sockaddr, int port)
     sockaddr->sin_port = htons(port);
 }
 
-void handle_other_routers(int router_id)
+/* Time of the last packet seen by any primary worker (CLOCK_MONOTONIC seconds) */
+_Atomic time_t primary_last_activity;
+
+time_t monotonic_seconds()
 {
-    fd_set router_fd_set;
-    fd_set working_fd_set;
-    int i = 0;
-    int max_fd = 0;
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/* Pin the calling thread to cpu
+ * Returns false if it could not be pinned */
+bool pin_thread(int cpu)
+{
+    cpu_set_t cpus;
     int ret = 0;
-    struct sockaddr_in dst_sockaddr = {0};
-    char *message = NULL;
-    int msg_size = 0;
-    char *src_ip = NULL;
-    char *dst_ip = NULL;
-
-    FD_ZERO(&router_fd_set);
-    FD_SET(router_info[router_id].router_fd, &router_fd_set);
-    max_fd = router_info[router_id].router_fd;
-
-    while (1) {
-        memcpy(&working_fd_set, &router_fd_set, sizeof(router_fd_set));
-        ret = select(max_fd+1, &working_fd_set, NULL, NULL, NULL);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                printf("\n Received a Signal, gracefully shutdown");
-                return;
-            }
-            printf("\n Unable to perform select operation - %s", strerror(errno));
-            exit(-1);
-        } else if (ret == 0) {
-            printf("\n Socket (%d) has been idle for %d seconds", 
-                    router_info[router_id].router_fd, IDLE_TIMEOUT);
-            return;
-        }
 
-        for (i = 0; i <= max_fd; i++) {
-            if (FD_ISSET(i, &working_fd_set)) {
-                if (i == router_info[router_id].router_fd) {
-
-                    message = router_ipc_receive(router_id, &msg_size);
-
-                    src_ip = get_src_addr(message);
-                    dst_ip = get_dst_addr(message);
-                    fprintf(router_info[router_id].fp, "ICMP from port: %d, src:"
-                        " %s, dst: %s, type: %d\n", router_info[router_order_primary].port, 
-                        src_ip, dst_ip, get_icmp_type(message));
- 
-                    form_echo_reply(message, msg_size);                   
-                    set_sockaddr_details(&dst_sockaddr, router_info[router_order_primary].port);
-                    router_ipc_send(router_info[router_order_primary].router_fd, message, msg_size, dst_sockaddr);
-                    fflush(router_info[router_id].fp);
-                    free(message);
-                    free(src_ip);
-                    free(dst_ip);
-                }
-            }
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret != 0) {
+        printf("\n Unable to pin thread to CPU %d - %s", cpu, strerror(ret));
+        return false;
+    }
+    return true;
+}
 
-        }
-        sleep(1);
+/* State of one forwarding loop. The primary runs one per TUN queue, each in
+ * it's own thread with it's own socket; a secondary runs exactly one */
+struct forwarder
+{
+    int router_id;
+    int router_fd;
+    int port;
+    int tun_fd;
+    int mirror_fd;
+    int egress_fd;
+    int worker;
+    int cpu;
+    int num_workers;
+    pthread_t thread;
+    uint64_t *router_packets;
+    struct pktlog_ring *log_ring;
+    struct shm_ipc *shm;
+    struct tun_uring *tun_uring;
+    bool use_uring;
+    struct tun_vnet *vnet;
+    struct metrics *metrics;
+    struct metrics_inflight *inflight;
+    struct trace_buffer *trace;
+    bool *shm_queued;
+    int *shm_pending;
+    int num_shm_pending;
+    struct packet_pool pool;
+    struct ipc_batch rx_batch;
+    struct ipc_batch tx_batch;
+    struct graph graph;
+    int tun_input_node;
+    int parse_node;
+    bool tun_more;
+    struct primary_liveness *liveness;
+    struct police *police;
+    struct ipc_queue *queues;
+    struct metrics_queue *queue_stats;
+    enum ipc_queue_policy queue_policy;
+    uint32_t udp_window;
+    bool *queue_listed;
+    int *queue_pending;
+    int num_queue_pending;
+    struct timer queue_timer;
+    struct timer idle_timer;
+    struct timer shutdown_timer;
+    struct event_loop loop;
+};
 
+/* Set up the event loop, the packet pool and the IPC batches of a forwarder
+ * Every packet buffer the loop will ever use is allocated here */
+void forwarder_init(struct forwarder *fwd, int router_id, int router_fd, int tun_fd,
+        struct router_config *config)
+{
+    memset(fwd, 0, sizeof(*fwd));
+    fwd->router_id = router_id;
+    fwd->router_fd = router_fd;
+    fwd->tun_fd = tun_fd;
+    fwd->mirror_fd = -1;
+    fwd->egress_fd = -1;
+    fwd->cpu = -1;
+    fwd->shm = use_shm_ipc ? &shm_ipc : NULL;
+
+    if (!event_loop_init(&fwd->loop) ||
+        !packet_pool_init(&fwd->pool, config->pool_size, packet_buf_size, config->hugepages) ||
+        !ipc_batch_init(&fwd->rx_batch, config->batch_size, &fwd->pool) ||
+        !ipc_batch_init(&fwd->tx_batch, config->batch_size, &fwd->pool)) {
+        exit(-1);
     }
 
+    /* Packets sent to each router, counted per forwarder so that workers
+     * never share a counter. Worker 0 reads them all for the heartbeats */
+    fwd->router_packets = (uint64_t *) calloc (num_routers + 1, sizeof(uint64_t));
+
+    /* Request rings with packets queued but not published yet */
+    fwd->shm_queued = (bool *) calloc (num_routers + 1, sizeof(bool));
+    fwd->shm_pending = (int *) calloc (num_routers + 1, sizeof(int));
+    if (!fwd->router_packets || !fwd->shm_queued || !fwd->shm_pending) {
+        printf("\n Unable to allocate memory - %s", strerror(errno));
+        exit(-1);
+    }
 }
 
-/* Primary router's action 
- * Listen on both the tunnel and socket (Primary->Secondary) FDs 
- * If tunnel FD is available:
- *      Read from tunnel
- *      Parse the request packet, extract source and destination address
- *      Send packet to secondary router
- * If socket FD is available:
- *      Read from socket FD (Primary <-> Secondary)
- *      Parse the response packet, extract source and destination address
- *      Write packet to tunnel */
-void handle_primary_router(int pr_router_fd, int router_tun_fd)
+void forwarder_cleanup(struct forwarder *fwd)
 {
-    fd_set pr_router_fd_set;
-    fd_set working_fd_set;
-    int ret = 0;
-    int i = 0;
-    int max_fd = 0;
-    struct timeval timeout = {0};
-    char *message = NULL;
-    struct sockaddr_in dst_sockaddr = {0};
-    char *src_ip = NULL;
-    char *dst_ip = NULL;
-    int msg_size = 0;
+    event_loop_close(&fwd->loop);
+    ipc_batch_free(&fwd->rx_batch);
+    ipc_batch_free(&fwd->tx_batch);
+    graph_destroy(&fwd->graph);
+    packet_pool_destroy(&fwd->pool);
+    free(fwd->router_packets);
+    free(fwd->shm_queued);
+    free(fwd->shm_pending);
+    free(fwd->inflight);
+}
 
-    /* Add the tunnel fd and primary router's fd to fd_set */
-    FD_ZERO(&pr_router_fd_set);
-    FD_SET(router_tun_fd, &pr_router_fd_set);
-    FD_SET(pr_router_fd, &pr_router_fd_set);
+/* When tracing, have the kernel timestamp the datagrams the forwarder
+ * receives, so they are traced at the time they came in */
+void forwarder_trace_rx_times(struct forwarder *fwd)
+{
+    if (fwd->trace && ipc_socket_rx_timestamps(fwd->router_fd) &&
+        !ipc_batch_enable_rx_times(&fwd->rx_batch)) {
+        exit(-1);
+    }
+}
 
-    if (pr_router_fd > router_tun_fd) {
-        max_fd = pr_router_fd;
-    } else {
-        max_fd = router_tun_fd; 
+/* Trace message <index> of the received batch at stage, at the time the
+ * kernel received it if that is known */
+static inline void forwarder_trace_rx(struct forwarder *fwd, enum trace_stage stage, int index)
+{
+#ifdef PACKET_TRACE
+    struct timespec *rx_time = ipc_batch_rx_time(&fwd->rx_batch, index);
+
+    TRACE_POINT_AT(fwd->trace, stage, &ipc_batch_packet(&fwd->rx_batch, index)->view,
+            rx_time ? trace_kernel_time(rx_time) : trace_now(), rx_time != NULL);
+#else
+    (void) fwd;
+    (void) stage;
+    (void) index;
+#endif
+}
+
+/* Send batch out of socket_fd, counting the messages the kernel refused */
+void forwarder_send_batch(struct forwarder *fwd, int socket_fd, struct ipc_batch *batch)
+{
+    int count = batch->count;
+    int sent = router_ipc_send_batch(socket_fd, batch);
+
+    if (sent < count) {
+        metrics_add(&fwd->metrics->send_errors, count - sent);
     }
+}
 
-    while (1) {
-        /* Set idle timeout to IDLE_TIMEOUT (15 seconds) */
-        timeout.tv_sec = IDLE_TIMEOUT;
-        timeout.tv_usec = 0;
-        memcpy(&working_fd_set, &pr_router_fd_set, sizeof(pr_router_fd_set));
+/* Open the raw socket forwarded packets leave a secondary router through,
+ * bound to device. The packets carry their own IP header. Their
+ * destinations are routed into the tunnel, so without a device of it's own
+ * (or with the tunnel's) every packet would come back in and go round
+ * until it's TTL ran out
+ * Returns the socket, -1 if packets can't be forwarded */
+int open_egress_socket(char *device)
+{
+    int socket_fd = -1;
 
-        ret = select(max_fd + 1, &working_fd_set, NULL, NULL, &timeout);
-        if (ret == -1) {
-            printf("\n Unable to perform select operation - %s", strerror(errno));
-            exit(-1);
-        } else if (ret == 0) {
-            printf("\n Socket (%d) has been idle for %d seconds", pr_router_fd, IDLE_TIMEOUT);
+    if (device[0] == '\0' || strcmp(device, TUN_NAME) == 0) {
+        printf("\n No egress device other than %s, packets won't be forwarded", TUN_NAME);
+        return -1;
+    }
+    socket_fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_RAW);
+    if (socket_fd < 0) {
+        printf("\n Unable to open egress socket, packets won't be forwarded - %s",
+                strerror(errno));
+        return -1;
+    }
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_BINDTODEVICE, device, strlen(device)) < 0) {
+        printf("\n Unable to bind egress socket to %s, packets won't be forwarded - %s",
+                device, strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
 
-            /* Send SIGHUP signal to the secondary router */
-            kill(router_info[router_order_2].pid, SIGHUP);
-            break;
-        }
+/* Send the forwarded packets queued on the egress socket */
+void secondary_egress_flush(struct forwarder *fwd)
+{
+    if (fwd->tx_batch.count > 0) {
+        forwarder_send_batch(fwd, fwd->egress_fd, &fwd->tx_batch);
+    }
+}
+
+/* Queue pkt to leave through the egress socket, towards it's destination.
+ * Takes pkt over */
+void secondary_egress(struct forwarder *fwd, struct packet *pkt)
+{
+    struct sockaddr_in dst = {0};
 
-        for (i = 0; i <= max_fd; i++) {
-            if (FD_ISSET(i,  &working_fd_set)) {
-                /* FD i has data ready to be read */
+    if (fwd->egress_fd < 0) {
+        metrics_add(&fwd->metrics->filtered_drops, 1);
+        packet_free(&fwd->pool, pkt);
+        return;
+    }
+    dst.sin_family = AF_INET;
+    dst.sin_addr.s_addr = htonl(pkt->view.dst);
+    metrics_add(&fwd->metrics->tx_packets, 1);
+    metrics_add(&fwd->metrics->tx_bytes, pkt->len);
+    if (!ipc_batch_add(&fwd->tx_batch, pkt, dst)) {
+        secondary_egress_flush(fwd);
+        ipc_batch_add(&fwd->tx_batch, pkt, dst);
+    }
+}
 
-                if (i == router_tun_fd) {
-                    /* Receive the message from tun device */
-                    message = router_tun_receive(router_tun_fd, &msg_size);
-                    if (!message) {
-                        /* Non ICMP packet / Non ECHO packet */
-                        continue;
-                    }
+/* Secondary router's socket is readable: hand every queued packet to the
+ * handler of it's protocol, one batch at a time. Replies are formed in
+ * place and sent back in the received batch, each message to the primary
+ * worker that sent it. Forwarded packets move over to the egress batch */
+void secondary_router_ready(int router_fd, void *ctx)
+{
+    struct forwarder *fwd = (struct forwarder *) ctx;
+    const struct protocol_handler *handler = NULL;
+    struct packet *pkt = NULL;
+    int i = 0;
 
-                    src_ip = get_src_addr(message);
-                    dst_ip = get_dst_addr(message);
-                    fprintf(router_info[router_order_primary].fp, "ICMP from tunnel, src:"
-                        " %s, dst: %s, type: %d\n", src_ip, dst_ip, get_icmp_type(message));
-
-                    /* Send the ICMP packet to secondary router  */
-                    set_sockaddr_details(&dst_sockaddr, router_info[router_order_2].port);
-                    router_ipc_send(router_info[router_order_primary].router_fd, 
-                        message, msg_size, dst_sockaddr);
-
-                    /* Cleanup */
-                    fflush(router_info[router_order_primary].fp);
-                    free(message);
-                } else if (i == pr_router_fd) {
-                    /* Receive ICMP packet from secondary router */
-                    message = router_ipc_receive(router_order_primary, &msg_size);
-
-                    src_ip = get_src_addr(message);
-                    dst_ip = get_dst_addr(message);
-                    fprintf(router_info[router_order_primary].fp, "ICMP from port: %d, src: "
-                            "%s, dst: %s, type: %d\n", router_info[router_order_2].port, 
-                            src_ip, dst_ip, get_icmp_type(message));
-
-                    /* Write ICMP packet to tunnel */
-                    router_tun_send(router_tun_fd, message, msg_size);
-
-                    /* Cleanup */
-                    fflush(router_info[router_order_primary].fp);
-                    free(message);
-                }
-                if (src_ip) {
-                    free(src_ip);
-                    src_ip = NULL;
-                }
-                if (dst_ip) {
-                    free(dst_ip);
-                    dst_ip = NULL;
-                }
+    while (router_ipc_receive_batch(router_fd, &fwd->rx_batch) > 0) {
+        for (i = 0; i < fwd->rx_batch.count; i++) {
+            pkt = ipc_batch_packet(&fwd->rx_batch, i);
+            if (heartbeat_is_message(pkt->data, pkt->len)) {
+                /* Goes back as it is, the primary only needs to see us answer */
+                continue;
+            }
+            metrics_add(&fwd->metrics->rx_packets, 1);
+            metrics_add(&fwd->metrics->rx_bytes, pkt->len);
+            handler = packet_view_parse(&pkt->view, pkt->data, pkt->len) ?
+                protocol_lookup(&pkt->view) : NULL;
+            if (!handler) {
+                metrics_add(&fwd->metrics->filtered_drops, 1);
+                packet_free(&fwd->pool, ipc_batch_take(&fwd->rx_batch, i));
+                continue;
+            }
+            forwarder_trace_rx(fwd, trace_router_receive, i);
+
+            pktlog_add(fwd->log_ring, pktlog_from_port, &pkt->view,
+                    ntohs(ipc_batch_addr(&fwd->rx_batch, i)->sin_port));
+
+            switch (handler->handle(&pkt->view, pkt->data)) {
+                case protocol_reply:
+                    TRACE_POINT(fwd->trace, trace_echo_reply, &pkt->view);
+                    metrics_add(&fwd->metrics->tx_packets, 1);
+                    metrics_add(&fwd->metrics->tx_bytes, pkt->len);
+                    break;
+                case protocol_egress:
+                    secondary_egress(fwd, ipc_batch_take(&fwd->rx_batch, i));
+                    break;
+                case protocol_drop:
+                    metrics_add(&fwd->metrics->filtered_drops, 1);
+                    packet_free(&fwd->pool, ipc_batch_take(&fwd->rx_batch, i));
+                    break;
             }
         }
+        ipc_batch_compact(&fwd->rx_batch);
+        forwarder_send_batch(fwd, router_fd, &fwd->rx_batch);
+        secondary_egress_flush(fwd);
     }
 }
 
-/* Close router's log file and socket */
-void cleanup(int router_id)
+/* Handle the packet in slot (of a request ring), parsed into view. A reply
+ * is queued on replies; a forwarded packet is copied out of the ring to the
+ * egress batch */
+void secondary_shm_handle(struct forwarder *fwd, const struct protocol_handler *handler,
+        struct shm_slot *slot, struct packet_view *view, struct shm_ring *replies)
 {
-    printf("\n Cleaning up router %d", router_id);
-    fprintf(router_info[router_id].fp, "router %d closed", router_id);
-    fflush(router_info[router_id].fp);
-    fclose(router_info[router_id].fp);
-    close(router_info[router_id].router_fd);
+    struct packet *pkt = NULL;
+
+    switch (handler->handle(view, slot->data)) {
+        case protocol_reply:
+            TRACE_POINT(fwd->trace, trace_echo_reply, view);
+            if (shm_ring_enqueue(replies, slot->data, slot->len, fwd->port)) {
+                metrics_add(&fwd->metrics->tx_packets, 1);
+                metrics_add(&fwd->metrics->tx_bytes, slot->len);
+            } else {
+                metrics_add(&fwd->metrics->send_errors, 1);
+            }
+            break;
+        case protocol_egress:
+            pkt = packet_alloc(&fwd->pool);
+            if (!pkt) {
+                /* Every buffer is queued, send them to get some back */
+                secondary_egress_flush(fwd);
+                pkt = packet_alloc(&fwd->pool);
+            }
+            if (!pkt) {
+                metrics_add(&fwd->metrics->alloc_failures, 1);
+                break;
+            }
+            memcpy(pkt->data, slot->data, slot->len);
+            pkt->len = slot->len;
+            pkt->view = *view;
+            secondary_egress(fwd, pkt);
+            break;
+        case protocol_drop:
+            metrics_add(&fwd->metrics->filtered_drops, 1);
+            break;
+    }
 }
 
-/* Send a signal to secondary router and cleanup the */
-void sighup()
+/* Secondary router's eventfd fired: hand the packets queued on the request
+ * rings of every primary worker to the handler of their protocol, a batch
+ * per ring at a time. Replies are formed in place and queued on the
+ * worker's reply ring; forwarded packets are copied to the egress batch */
+void secondary_shm_ready(int efd, void *ctx)
 {
-    signal(SIGHUP,   sighup);
-    cleanup(router_order_2);
+    struct forwarder *fwd = (struct forwarder *) ctx;
+    struct shm_ring *requests = NULL;
+    struct shm_ring *replies = NULL;
+    struct shm_slot *slot = NULL;
+    struct packet_view view;
+    const struct protocol_handler *handler = NULL;
+    bool busy = false;
+    int count = 0;
+    int worker = 0;
+
+    shm_ipc_clear(efd);
+
+    /* Go round the rings until none has anything left. A ring is only seen
+     * empty after it's consumed slots were released, so a worker queueing
+     * more in the meantime either gets seen here or wakes us up again */
+    do {
+        busy = false;
+        for (worker = 0; worker < fwd->shm->num_workers; worker++) {
+            requests = shm_ipc_request_ring(fwd->shm, worker, fwd->router_id);
+            replies = shm_ipc_reply_ring(fwd->shm, worker, fwd->router_id);
+            for (count = 0; count < fwd->rx_batch.size; count++) {
+                slot = shm_ring_peek(requests);
+                if (!slot) {
+                    break;
+                }
+                metrics_add(&fwd->metrics->rx_packets, 1);
+                metrics_add(&fwd->metrics->rx_bytes, slot->len);
+                handler = packet_view_parse(&view, slot->data, slot->len) ?
+                    protocol_lookup(&view) : NULL;
+                if (handler) {
+                    TRACE_POINT(fwd->trace, trace_router_receive, &view);
+                    pktlog_add(fwd->log_ring, pktlog_from_port, &view, slot->port);
+                    secondary_shm_handle(fwd, handler, slot, &view, replies);
+                } else {
+                    metrics_add(&fwd->metrics->filtered_drops, 1);
+                }
+                shm_ring_consume(requests);
+            }
+            shm_ring_release(requests);
+            if (shm_ring_publish(replies)) {
+                shm_ipc_wake(fwd->shm->worker_efds[worker]);
+            }
+            busy |= (count > 0);
+        }
+        secondary_egress_flush(fwd);
+    } while (busy);
 }
 
-/* Check if the received message is "I am up" from secondary router
- * Exit if so.  */
-void handle_primary_router_stage_1()
+/* Shutdown timer expired: end the loop between two batches */
+void secondary_shutdown_expired(struct timer *timer, void *ctx)
 {
-    char *message = NULL;
-    int msg_size = 0;
+    struct forwarder *fwd = (struct forwarder *) ctx;
 
-    while (1) {
-        message = router_ipc_receive(router_order_primary, &msg_size);
-        if (atoi(message) == router_info[router_order_2].pid) {
-            printf("\n Received a logout message ");
-            free(message);
-            return;
-        }
-        sleep(1);
-    }
+    (void) timer;
+    event_loop_stop(&fwd->loop);
 }
 
-/* Send an "I am up" message to primary router 
- * "I am up" message of router i will be PID(router i) 
- * Eg: If router 1 sends it's pid to primary router, 
- *     it is considered an "I am up" message from router 1 */
-void handle_other_routers_stage_1(int router_id)
+/* The primary is shutting down, through SIGHUP (read from a signalfd) or
+ * shutdown_efd for router threads. Neither is read, the eventfd is left
+ * set for the other router threads to see. The loop ends on the shutdown
+ * timer, once the batch in hand is done */
+void secondary_shutdown(int fd, void *ctx)
 {
-    char message[20] = {0};
-    struct sockaddr_in dst_sockaddr = {0};
+    struct forwarder *fwd = (struct forwarder *) ctx;
 
-    set_sockaddr_details(&dst_sockaddr, router_info[router_order_primary].port);
-    snprintf(message, sizeof(message), "%d", getpid());
-    router_ipc_send(router_info[router_id].router_fd, message, strlen(message), dst_sockaddr);
+    (void) fd;
+    event_loop_arm_timer(&fwd->loop, &fwd->shutdown_timer, 0);
 }
 
-void create_routers(int stage, int num_routers, int router_tun_fd)
+/* Open a signalfd for SIGHUP, blocking the signal so it is only ever seen
+ * there
+ * Returns the signalfd, -1 on failure */
+int open_hangup_fd(void)
 {
-    int i = 0;
-    pid_t pid = 0;
-        
-    if (num_routers != 1) {
-        printf("\n Number of routers must be 1 for now. Overriding the value to 1");
-        num_routers = 1;
+    sigset_t hangup_mask;
+    int signal_fd = -1;
+
+    sigemptyset(&hangup_mask);
+    sigaddset(&hangup_mask, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &hangup_mask, NULL) < 0 ||
+        (signal_fd = signalfd(-1, &hangup_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        printf("\n Unable to catch SIGHUP - %s", strerror(errno));
+        return -1;
     }
+    return signal_fd;
+}
 
-    /* Initialize secondary router */
-    for (i = 1; i <= num_routers; i++) { 
-        logger_init(stage, num_routers);
-        router_init(i);
+void handle_other_routers(int router_id, struct router_config *config)
+{
+    struct forwarder fwd;
+    int hangup_fd = -1;
+
+    forwarder_init(&fwd, router_id, router_info[router_id].router_fd, -1, config);
+    fwd.port = router_info[router_id].port;
+    fwd.metrics = metrics_router(&metrics_region, router_id);
+    packet_log_init(config->stage, router_id, 1);
+    fwd.log_ring = &router_info[router_id].log.rings[0];
+    packet_trace_init(config, router_id, 1);
+    fwd.trace = packet_trace_buffer(router_id, 0);
+    forwarder_trace_rx_times(&fwd);
+    fwd.egress_fd = open_egress_socket(config->egress_device);
+    timer_init(&fwd.shutdown_timer, secondary_shutdown_expired, &fwd);
+
+    /* SIGHUP from the primary arms the shutdown timer. Router threads share
+     * the process's signals, they watch shutdown_efd */
+    hangup_fd = (router_runtime == router_runtime_thread) ? -1 : open_hangup_fd();
+    if (!(router_runtime == router_runtime_thread ?
+            event_loop_add(&fwd.loop, shutdown_efd, secondary_shutdown, &fwd) :
+            (hangup_fd >= 0 && event_loop_add(&fwd.loop, hangup_fd, secondary_shutdown, &fwd))) ||
+        !set_fd_nonblocking(router_info[router_id].router_fd) ||
+        !event_loop_add(&fwd.loop, router_info[router_id].router_fd,
+            secondary_router_ready, &fwd)) {
+        exit(-1);
     }
 
-    pid = fork();
-    if (pid > 0) {
-        /* Store the pid of the secondary router (child process) */
-        router_info[router_order_2].pid = pid;
-        switch(stage) {
-            case 1:
-                handle_primary_router_stage_1();
-                break;
-            case 2:
-                handle_primary_router(router_info[router_order_primary].router_fd, router_tun_fd);
-                break;
-            default:
-                printf("\n Invalid stage number ");
-        }       
-        cleanup(router_order_primary);
-    } else {
-        /* Register for SIGHUP signal */
-        signal(SIGHUP, sighup);
-        switch(stage) {
-            case 1:
-                handle_other_routers_stage_1(router_order_2);
-                break;
-            case 2:
-                handle_other_routers(router_order_2);
-                break;
-            default:
-                printf("\n Invalid stage number ");
-        }
+    /* Requests come in on the rings. The socket stays open for mirrored
+     * packets and a primary using UDP */
+    if (fwd.shm && !event_loop_add(&fwd.loop, fwd.shm->router_efds[router_id],
+                secondary_shm_ready, &fwd)) {
+        exit(-1);
+    }
+
+    event_loop_run(&fwd.loop);
+    forwarder_cleanup(&fwd);
+    if (fwd.egress_fd >= 0) {
+        close(fwd.egress_fd);
+    }
+    if (hangup_fd >= 0) {
+        close(hangup_fd);
     }
-    
+    packet_log_close(router_id);
+    packet_trace_close(config->stage, router_id);
+    cleanup(router_id);
+
+    /* Router threads share these with the primary, which unmaps them */
+    if (router_runtime == router_runtime_thread) {
+        return;
+    }
+    if (use_shm_ipc) {
+        shm_ipc_destroy(&shm_ipc);
+    }
+    metrics_region_destroy(&metrics_region);
 }
 
-/* Usage - ./router <config-file> */
-int main(int argc, char *argv[])
+static inline bool primary_router_alive(int router_id)
 {
-    char * config_file = NULL;
-    int stage = 0;
-    int num_routers = 0;
-    int router_tun_fd = 0;
+    return __atomic_load_n(&router_alive[router_id], __ATOMIC_RELAXED);
+}
 
-    if (argc <= 1) {
-        printf("\n Usage \n ./router <config-file > ");
-        return 0;
+/* Pick the secondary router for a packet without a forwarding rule. Route
+ * by destination if a prefix matches and it's router is alive. Otherwise
+ * take the router owning the flow (src, dst, ICMP id), so the packets of a
+ * flow stay in order. Dead routers own no flows
+ * Returns ROUTE_LOCAL for an echo request the primary answers itself, 0 if
+ * no secondary router is left */
+int primary_select_router(struct lpm_table *routes, struct packet_view *view)
+{
+    int router_id = 0;
+
+    router_id = routes ? lpm_lookup(routes, view->dst) : 0;
+    if (router_id == ROUTE_LOCAL && packet_view_is_echo(view)) {
+        return ROUTE_LOCAL;
     }
-    config_file = argv[1];
+    if (router_id == 0 || router_id == ROUTE_LOCAL || !primary_router_alive(router_id)) {
+        router_id = flow_hash_lookup(&flow_hash, flow_hash_key(view->src,
+                    view->dst, packet_view_flow_id(view)));
+    }
+    return router_id;
+}
 
-    /* Parse config file and set stage and num_routers */
-    if (!parse_config_file(config_file, &stage, &num_routers)) {
-        return 0;
+/* Send a copy of the packet to router_id. Copies go out of the worker's
+ * mirror socket, so the replies they trigger come back there and never
+ * reach the tunnel */
+void primary_mirror_packet(struct forwarder *fwd, struct packet *pkt, int router_id)
+{
+    struct sockaddr_in dst_sockaddr = {0};
+
+    if ((router_id < router_order_2) || (router_id > num_routers)) {
+        return;
     }
+    set_sockaddr_details(&dst_sockaddr, router_info[router_id].port);
+    router_ipc_send(fwd->mirror_fd, pkt->data, pkt->len, dst_sockaddr);
+    metrics_add(&fwd->queue_stats[router_id].mirrored, 1);
+}
 
-    printf("\n Stage = %d \n Number of router = %d", stage, num_routers);
-    if ((stage <= 0) || (stage > MAX_STAGE)) {
-        printf("\n Exiting as this stage (%d) is not we are supposed to run", stage);
-        return 0;
-    } 
-   
-    /* Initialize log files */ 
-    logger_init(stage, router_order_primary);
+/* Mirror socket is readable: discard the replies to mirrored packets */
+void primary_mirror_ready(int mirror_fd, void *ctx)
+{
+    char buffer[MAX_BUFFER_SIZE];
 
-    /* Initialize the primary router */
-    router_init(router_order_primary);
-    router_info[router_order_primary].pid = getpid();
+    (void) ctx;
+    while (recv(mirror_fd, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0) {
+        ;
+    }
+}
 
-    /* Initialize tun device */
-    router_tun_fd = tunnel_init(TUN_NAME, IFF_TUN | IFF_NO_PI);
-    if (router_tun_fd < 0) {
-        printf("\n Unable to create a tunnel for %s", TUN_NAME);
-        return 0;
+/* Queue pkt on the request ring to router_id. The ring is published once a
+ * batch is queued and whenever the tunnel is drained */
+void primary_shm_send(struct forwarder *fwd, struct packet *pkt, int router_id)
+{
+    struct shm_ring *ring = shm_ipc_request_ring(fwd->shm, fwd->worker, router_id);
+
+    if (!shm_ring_enqueue(ring, pkt->data, pkt->len, fwd->port)) {
+        /* Ring full, the drop is counted on the ring */
+        return;
+    }
+    if (!fwd->shm_queued[router_id]) {
+        fwd->shm_queued[router_id] = true;
+        fwd->shm_pending[fwd->num_shm_pending++] = router_id;
+    }
+    if (shm_ring_unpublished(ring) >= (uint32_t) fwd->tx_batch.size &&
+        shm_ring_publish(ring)) {
+        shm_ipc_wake(fwd->shm->router_efds[router_id]);
+    }
+}
+
+/* Publish every request ring with packets queued, waking up the routers
+ * whose ring was empty */
+void primary_shm_flush(struct forwarder *fwd)
+{
+    int router_id = 0;
+    int i = 0;
+
+    for (i = 0; i < fwd->num_shm_pending; i++) {
+        router_id = fwd->shm_pending[i];
+        fwd->shm_queued[router_id] = false;
+        if (shm_ring_publish(shm_ipc_request_ring(fwd->shm, fwd->worker, router_id))) {
+            shm_ipc_wake(fwd->shm->router_efds[router_id]);
+        }
+    }
+    fwd->num_shm_pending = 0;
+}
+
+/* Count the reply in view as written to the tunnel (or not) and record
+ * how long it took since it's request came in */
+void primary_reply_sent(struct forwarder *fwd, struct packet_view *view, bool sent)
+{
+    if (!sent) {
+        metrics_add(&fwd->metrics->send_errors, 1);
+        return;
+    }
+    metrics_add(&fwd->metrics->tx_packets, 1);
+    metrics_add(&fwd->metrics->tx_bytes, view->len);
+    metrics_track_reply(fwd->metrics, fwd->inflight, view, metrics_now_ns());
+    TRACE_POINT(fwd->trace, trace_tun_write, view);
+}
+
+/* Write <len> bytes at data to the worker's tunnel queue
+ * Returns false if they could not be written */
+bool primary_tun_write(struct forwarder *fwd, char *data, int len)
+{
+    if (fwd->vnet) {
+        return router_tun_send_vnet(fwd->tun_fd, data, len);
+    }
+    return router_tun_send(fwd->tun_fd, data, len);
+}
+
+/* Write pkt to the worker's tunnel queue, through io_uring if it has one.
+ * Takes pkt over */
+void primary_tun_send(struct forwarder *fwd, struct packet *pkt)
+{
+    struct packet_view view = pkt->view;
+
+    if (fwd->tun_uring) {
+        primary_reply_sent(fwd, &view, tun_uring_send(fwd->tun_uring, pkt));
+        return;
+    }
+    primary_reply_sent(fwd, &view, primary_tun_write(fwd, pkt->data, pkt->len));
+    packet_free(&fwd->pool, pkt);
+}
+
+/* Send the requests queued for the secondaries over UDP */
+void primary_send_batch(struct forwarder *fwd)
+{
+#ifdef PACKET_TRACE
+    int i = 0;
+
+    for (i = 0; i < fwd->tx_batch.count; i++) {
+        TRACE_POINT(fwd->trace, trace_ipc_send, &ipc_batch_packet(&fwd->tx_batch, i)->view);
+    }
+#endif
+    forwarder_send_batch(fwd, fwd->router_fd, &fwd->tx_batch);
+}
+
+/* Packets sent to router_id by all the primary workers so far */
+uint64_t primary_router_sent(int router_id)
+{
+    uint64_t packets = 0;
+    int i = 0;
+
+    for (i = 0; i < metrics_region.num_workers; i++) {
+        packets += __atomic_load_n(&metrics_queue(&metrics_region, i, router_id)->sent,
+                __ATOMIC_RELAXED);
+    }
+    return packets;
+}
+
+/* Packets router_id received of those sent by primary_router_sent(): it
+ * counts the mirrored copies it gets too, which are not in flight */
+uint64_t primary_router_received(int router_id)
+{
+    uint64_t received = __atomic_load_n(&metrics_router(&metrics_region, router_id)->rx_packets,
+            __ATOMIC_RELAXED);
+    uint64_t mirrored = 0;
+    int i = 0;
+
+    for (i = 0; i < metrics_region.num_workers; i++) {
+        mirrored += __atomic_load_n(&metrics_queue(&metrics_region, i, router_id)->mirrored,
+                __ATOMIC_RELAXED);
+    }
+    return (received > mirrored) ? received - mirrored : 0;
+}
+
+/* Packets router_id can take right now: the free slots of the worker's
+ * request ring, or over UDP what is left of the window of datagrams in
+ * flight towards it from all workers. Datagrams it's socket dropped are no
+ * longer in flight */
+uint32_t primary_queue_room(struct forwarder *fwd, int router_id)
+{
+    uint64_t received = 0;
+    uint64_t dropped = 0;
+    uint64_t sent = 0;
+    uint64_t in_flight = 0;
+
+    if (fwd->shm) {
+        return shm_ring_room(shm_ipc_request_ring(fwd->shm, fwd->worker, router_id));
+    }
+    sent = primary_router_sent(router_id);
+    received = primary_router_received(router_id);
+    dropped = __atomic_load_n(&metrics_queue(&metrics_region, 0, router_id)->socket_drops,
+            __ATOMIC_RELAXED);
+    in_flight = (sent > received + dropped) ? sent - received - dropped : 0;
+    return (in_flight < fwd->udp_window) ? fwd->udp_window - in_flight : 0;
+}
+
+/* Hand pkt to it's secondary: copied to the request ring, or added to the
+ * UDP batch */
+void primary_ipc_send(struct forwarder *fwd, struct packet *pkt)
+{
+    struct sockaddr_in dst_sockaddr = {0};
+
+    if (fwd->shm) {
+        /* Copied into the ring, the buffer can take the next packet */
+        TRACE_POINT(fwd->trace, trace_ipc_send, &pkt->view);
+        primary_shm_send(fwd, pkt, pkt->router_id);
+        packet_free(&fwd->pool, pkt);
+        return;
+    }
+    set_sockaddr_details(&dst_sockaddr, router_info[pkt->router_id].port);
+    if (!ipc_batch_add(&fwd->tx_batch, pkt, dst_sockaddr)) {
+        primary_send_batch(fwd);
+        ipc_batch_add(&fwd->tx_batch, pkt, dst_sockaddr);
+    }
+}
+
+/* Secondaries tried in turn for a packet spilled off a congested queue */
+#define QUEUE_SPILL_TRIES 8
+
+/* Secondary to take the packets of router_id while it's queue is
+ * congested: the next alive one whose queue is not
+ * Returns 0 if there is none */
+int primary_spill_router(struct forwarder *fwd, int router_id)
+{
+    int other = 0;
+    int i = 0;
+
+    for (i = 1; i < num_routers && i <= QUEUE_SPILL_TRIES; i++) {
+        other = (router_id - router_order_2 + i) % num_routers + router_order_2;
+        if (primary_router_alive(other) && !ipc_queue_congested(&fwd->queues[other])) {
+            return other;
+        }
+    }
+    return 0;
+}
+
+static inline void primary_queue_depth(struct forwarder *fwd, int router_id)
+{
+    struct metrics_queue *stats = &fwd->queue_stats[router_id];
+    uint64_t depth = ipc_queue_depth(&fwd->queues[router_id]);
+
+    __atomic_store_n(&stats->depth, depth, __ATOMIC_RELAXED);
+    if (depth > stats->max_depth) {
+        __atomic_store_n(&stats->max_depth, depth, __ATOMIC_RELAXED);
+    }
+}
+
+/* Queue pkt, classified at now (ns), for it's secondary. While the queue is
+ * congested the worker's policy decides: drop pkt, drop the oldest packet
+ * for it, or queue pkt for another secondary. Spilled packets leave their
+ * flow's router, so they may get out of order */
+void primary_queue_packet(struct forwarder *fwd, struct packet *pkt, uint64_t now)
+{
+    int router_id = pkt->router_id;
+    struct ipc_queue *queue = &fwd->queues[router_id];
+    struct packet *oldest = NULL;
+    uint64_t queued = 0;
+    bool admit = !ipc_queue_congested(queue);
+    int other = 0;
+
+    if (!admit) {
+        switch (fwd->queue_policy) {
+            case ipc_queue_tail_drop:
+                break;
+            case ipc_queue_head_drop:
+                oldest = ipc_queue_pop(queue, &queued);
+                if (oldest) {
+                    metrics_add(&fwd->queue_stats[router_id].head_drops, 1);
+                    packet_free(&fwd->pool, oldest);
+                }
+                admit = true;
+                break;
+            case ipc_queue_spill:
+                other = primary_spill_router(fwd, router_id);
+                if (other) {
+                    metrics_add(&fwd->queue_stats[router_id].spilled, 1);
+                    pkt->router_id = router_id = other;
+                    queue = &fwd->queues[router_id];
+                    admit = true;
+                }
+                break;
+        }
+    }
+
+    if (!admit || !ipc_queue_push(queue, pkt, now)) {
+        metrics_add(&fwd->queue_stats[router_id].tail_drops, 1);
+        packet_free(&fwd->pool, pkt);
+        return;
+    }
+    if (!fwd->queue_listed[router_id]) {
+        fwd->queue_listed[router_id] = true;
+        fwd->queue_pending[fwd->num_queue_pending++] = router_id;
+    }
+    primary_queue_depth(fwd, router_id);
+}
+
+/* Send every secondary with packets queued as many of them as it can take.
+ * Queues left with packets are tried again on the next flush, at the
+ * latest after a tick */
+void primary_queue_drain(struct forwarder *fwd)
+{
+    struct ipc_queue *queue = NULL;
+    struct packet *pkt = NULL;
+    uint64_t now = 0;
+    uint64_t queued = 0;
+    uint32_t room = 0;
+    int router_id = 0;
+    int i = 0;
+
+    if (fwd->num_queue_pending == 0) {
+        return;
+    }
+    now = metrics_now_ns();
+    while (i < fwd->num_queue_pending) {
+        router_id = fwd->queue_pending[i];
+        queue = &fwd->queues[router_id];
+        if (!primary_router_alive(router_id)) {
+            /* It's flows have moved on, the packets left would only wait */
+            while ((pkt = ipc_queue_pop(queue, &queued))) {
+                metrics_add(&fwd->queue_stats[router_id].tail_drops, 1);
+                packet_free(&fwd->pool, pkt);
+            }
+        }
+        room = primary_queue_room(fwd, router_id);
+        for (; room > 0 && (pkt = ipc_queue_pop(queue, &queued)); room--) {
+            metrics_record_queue_wait(fwd->metrics, now - queued);
+            metrics_add(&fwd->queue_stats[router_id].wait_ns, now - queued);
+            metrics_add(&fwd->queue_stats[router_id].sent, 1);
+            primary_ipc_send(fwd, pkt);
+        }
+        primary_queue_depth(fwd, router_id);
+        if (ipc_queue_depth(queue) > 0) {
+            i++;
+            continue;
+        }
+        fwd->queue_listed[router_id] = false;
+        fwd->queue_pending[i] = fwd->queue_pending[--fwd->num_queue_pending];
+    }
+    if (fwd->num_queue_pending > 0 && !timer_armed(&fwd->queue_timer)) {
+        event_loop_arm_timer(&fwd->loop, &fwd->queue_timer, 1);
+    }
+}
+
+/* Send out whatever the worker has queued: the secondaries' queues, the UDP
+ * batch, the request rings and the tunnel writes. Buffers freed on the way
+ * (or since the last flush) go back to the kernel for tunnel reads: a read
+ * stopped on an empty pool produces no completion to re-arm it */
+void primary_flush(struct forwarder *fwd)
+{
+    primary_queue_drain(fwd);
+    primary_send_batch(fwd);
+    if (fwd->shm) {
+        primary_shm_flush(fwd);
+    }
+    if (fwd->tun_uring) {
+        tun_uring_refill(fwd->tun_uring);
+        tun_uring_submit(fwd->tun_uring);
+    }
+}
+
+/* Queues left with packets by the last drain: try them again */
+void primary_queue_expired(struct timer *timer, void *ctx)
+{
+    (void) timer;
+    primary_flush((struct forwarder *) ctx);
+}
+
+/* Set up the worker's queue for each secondary, and it's share of the
+ * queue metrics */
+void primary_queues_init(struct forwarder *fwd, struct router_config *config)
+{
+    int router_id = 0;
+
+    fwd->queues = (struct ipc_queue *) calloc (num_routers + 1, sizeof(*fwd->queues));
+    fwd->queue_listed = (bool *) calloc (num_routers + 1, sizeof(bool));
+    fwd->queue_pending = (int *) calloc (num_routers + 1, sizeof(int));
+    if (!fwd->queues || !fwd->queue_listed || !fwd->queue_pending) {
+        printf("\n Unable to allocate memory - %s", strerror(errno));
+        exit(-1);
+    }
+    for (router_id = router_order_2; router_id <= num_routers; router_id++) {
+        if (!ipc_queue_init(&fwd->queues[router_id], config->queue_high, config->queue_low)) {
+            exit(-1);
+        }
+    }
+    fwd->queue_stats = metrics_queue(&metrics_region, fwd->worker, 0);
+    fwd->queue_policy = config->queue_policy;
+    fwd->udp_window = config->udp_window;
+    timer_init(&fwd->queue_timer, primary_queue_expired, fwd);
+}
+
+void primary_queues_destroy(struct forwarder *fwd)
+{
+    int router_id = 0;
+
+    for (router_id = router_order_2; router_id <= num_routers; router_id++) {
+        ipc_queue_destroy(&fwd->queues[router_id], &fwd->pool);
+    }
+    free(fwd->queues);
+    free(fwd->queue_listed);
+    free(fwd->queue_pending);
+}
+
+/* Make the queues of a primary worker fit in it's pool, next to the
+ * buffers the rest of the worker may hold at once: both IPC batches, a
+ * vector's worth in the graph, the tunnel reads lent to the kernel and the
+ * segments of a GSO super-packet. Watermarks the pool can't cover are
+ * lowered, so that overload is handled by the queue policy instead of
+ * showing up as allocation failures. A pool too small to hold a packet per
+ * queue is grown to just that. Runs before the routers are created, which
+ * all share the config */
+void primary_fit_queues(struct router_config *config)
+{
+    int reserved = 2 * config->batch_size + GRAPH_VECTOR_SIZE;
+    int high = 0;
+    int low = 0;
+
+    if (config->vnet_hdr) {
+        reserved += TUN_GSO_MAX_SEGS;
+    } else if (config->io_uring) {
+        reserved += TUN_URING_RX_BUFFERS;
+    }
+    if (config->pool_size < reserved + num_routers) {
+        printf("\n Pool size %d too small for %d IPC queues, using %d", config->pool_size,
+                num_routers, reserved + num_routers);
+        config->pool_size = reserved + num_routers;
+    }
+
+    high = (config->pool_size - reserved) / num_routers;
+    if (high >= config->queue_high) {
+        return;
+    }
+    low = (int) ((int64_t) config->queue_low * high / config->queue_high);
+    printf("\n IPC queue watermarks %d / %d don't fit a pool of %d, using %d / %d",
+            config->queue_high, config->queue_low, config->pool_size, high, low);
+    config->queue_high = high;
+    config->queue_low = low;
+}
+
+/* Primary's data path, a graph of nodes each working on a vector of
+ * packets (see graph.h):
+ *
+ *  tun-input -> parse -> log -> classify -> ipc-output
+ *                 ^       |        |
+ *   replies from -+       |        +-> rewrite -> tun-output
+ *   secondaries           +------------------------^
+ *
+ * Packets read from the tunnel are parsed, logged, classified by the flow
+ * rules and routes and queued for their secondary (or answered in place).
+ * Replies coming back from the secondaries are fed to parse and go out to
+ * the tunnel after being logged. A new stage is a new node, the event loop
+ * handlers only feed the graph and run it */
+
+/* Edges of the nodes, in the order primary_graph_init() connects them */
+enum primary_edge {
+    tun_input_next_parse = 0,
+    parse_next_log = 0,
+    log_next_classify = 0,
+    log_next_tun_output = 1,
+    classify_next_ipc_output = 0,
+    classify_next_rewrite = 1,
+    rewrite_next_tun_output = 0
+};
+
+/* Charge the packet just read into pkt to it's source's bucket, before
+ * anything else is spent on it. now is the time of the read (ns)
+ * Returns false if the source is over it's rate: drop the packet */
+static inline bool primary_police(struct forwarder *fwd, struct packet *pkt, uint64_t now)
+{
+    uint32_t src = 0;
+    int class = 0;
+
+    if (!fwd->police) {
+        return true;
+    }
+    class = police_classify(fwd->police, pkt->data, pkt->len, &src);
+    if (class == POLICE_NONE || police_admit(fwd->police, src, class, now)) {
+        return true;
+    }
+    metrics_add(&fwd->metrics->police_drops[class], 1);
+    return false;
+}
+
+/* Move the buckets taken over by new sources to the metrics */
+static inline void primary_police_flush(struct forwarder *fwd)
+{
+    if (fwd->police && fwd->police->evictions) {
+        metrics_add(&fwd->metrics->police_evictions, fwd->police->evictions);
+        fwd->police->evictions = 0;
+    }
+}
+
+/* Segment the GSO super-packet just read into pkt and pass the segments
+ * on like packets read one by one. pkt stays with the caller
+ * Returns the number of segments */
+int primary_tun_input_super(struct graph *graph, struct graph_node *node, struct packet *pkt)
+{
+    struct forwarder *fwd = (struct forwarder *) node->ctx;
+    struct packet *segs[TUN_GSO_MAX_SEGS];
+    int count = 0;
+    int i = 0;
+
+    count = tun_vnet_segment(fwd->vnet, pkt, &fwd->pool, segs, TUN_GSO_MAX_SEGS);
+    if (count < 0) {
+        /* Out of buffers, send what the secondaries can take to get some
+         * back */
+        primary_flush(fwd);
+        count = tun_vnet_segment(fwd->vnet, pkt, &fwd->pool, segs, TUN_GSO_MAX_SEGS);
+    }
+    if (count < 0) {
+        metrics_add(&fwd->metrics->filtered_drops, 1);
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+#ifdef PACKET_TRACE
+        segs[i]->trace_time = pkt->trace_time;
+#endif
+        graph_next(graph, node, tun_input_next_parse, segs[i]);
+    }
+    return count;
+}
+
+/* tun-input: read a vector's worth of packets from the tunnel queue (or
+ * it's io_uring) into pool buffers, policing them by source as they come
+ * in. fwd->tun_more is set if the tunnel may have more */
+void primary_tun_input(struct graph *graph, struct graph_node *node, struct graph_vector *vec)
+{
+    struct forwarder *fwd = (struct forwarder *) node->ctx;
+    struct packet *pkt = NULL;
+    uint64_t now = fwd->police ? metrics_now_ns() : 0;
+    int recv_bytes = 0;
+    int dropped = 0;
+    int count = 0;
+
+    (void) vec;
+    fwd->tun_more = false;
+    if (fwd->tun_uring) {
+        while (count + dropped < GRAPH_VECTOR_SIZE &&
+                (pkt = tun_uring_receive(fwd->tun_uring))) {
+            if (!primary_police(fwd, pkt, now)) {
+                packet_free(&fwd->pool, pkt);
+                dropped++;
+                continue;
+            }
+            graph_next(graph, node, tun_input_next_parse, pkt);
+            count++;
+        }
+        primary_police_flush(fwd);
+        fwd->tun_more = (count + dropped == GRAPH_VECTOR_SIZE);
+        return;
+    }
+
+    /* Packets filtered out or policed count towards the vector too, so that
+     * a flood of them can't keep the loop here */
+    while (count + dropped < GRAPH_VECTOR_SIZE) {
+        if (!pkt) {
+            pkt = packet_alloc(&fwd->pool);
+            if (!pkt) {
+                /* Every buffer is queued, send what the secondaries can
+                 * take to get some back */
+                primary_flush(fwd);
+                pkt = packet_alloc(&fwd->pool);
+                if (!pkt) {
+                    /* The rest of the graph holds them, run it first */
+                    metrics_add(&fwd->metrics->alloc_failures, 1);
+                    fwd->tun_more = (count > 0);
+                    return;
+                }
+            }
+        }
+
+        recv_bytes = fwd->vnet ? router_tun_read_vnet(fwd->vnet, fwd->tun_fd, pkt) :
+            router_tun_read(fwd->tun_fd, pkt, fwd->pool.buf_size);
+        if (recv_bytes < 0) {
+            /* Tunnel drained */
+            break;
+        } else if (recv_bytes == 0) {
+            metrics_add(&fwd->metrics->filtered_drops, 1);
+            dropped++;
+            continue;
+        } else if (!primary_police(fwd, pkt, now)) {
+            /* Over it's source's rate, the buffer takes the next read */
+            dropped++;
+            continue;
+        } else if (fwd->vnet && tun_vnet_is_super(fwd->vnet)) {
+            /* Passed on in segments, reuse the buffer */
+            count += primary_tun_input_super(graph, node, pkt);
+            continue;
+        }
+        graph_next(graph, node, tun_input_next_parse, pkt);
+        pkt = NULL;
+        count++;
+    }
+
+    if (pkt) {
+        packet_free(&fwd->pool, pkt);
+    }
+    primary_police_flush(fwd);
+    fwd->tun_more = (count + dropped >= GRAPH_VECTOR_SIZE);
+}
+
+/* parse: parse every packet into it's view. Packets from the tunnel must
+ * pass the checks of their protocol's handler and are counted; replies
+ * from the secondaries must be ICMP */
+void primary_parse(struct graph *graph, struct graph_node *node, struct graph_vector *vec)
+{
+    struct forwarder *fwd = (struct forwarder *) node->ctx;
+    struct packet *pkt = NULL;
+    int i = 0;
+
+    for (i = 0; i < vec->count; i++) {
+        graph_prefetch(vec, i);
+        pkt = vec->pkts[i];
+        if (pkt->port != 0) {
+            if (!packet_view_parse(&pkt->view, pkt->data, pkt->len) ||
+                !packet_view_is_icmp(&pkt->view)) {
+                graph_drop(graph, node, pkt);
+                continue;
+            }
+            TRACE_POINT_AT(fwd->trace, trace_ipc_return, &pkt->view, pkt->trace_time,
+                    pkt->trace_kernel);
+            graph_next(graph, node, parse_next_log, pkt);
+            continue;
+        }
+
+        if (router_tun_filter(pkt, pkt->len) == 0) {
+            metrics_add(&fwd->metrics->filtered_drops, 1);
+            graph_drop(graph, node, pkt);
+            continue;
+        }
+        metrics_add(&fwd->metrics->rx_packets, 1);
+        metrics_add(&fwd->metrics->rx_bytes, pkt->len);
+        if (packet_view_is_echo(&pkt->view)) {
+            /* Note when the request came in */
+            metrics_track_request(fwd->inflight, &pkt->view, metrics_now_ns());
+        }
+        TRACE_POINT_AT(fwd->trace, trace_tun_read, &pkt->view, pkt->trace_time, false);
+        TRACE_POINT(fwd->trace, trace_parse, &pkt->view);
+        graph_next(graph, node, parse_next_log, pkt);
+    }
+}
+
+/* log: add every packet to the packet log. Packets from the tunnel go on
+ * to be classified, replies to the tunnel */
+void primary_log(struct graph *graph, struct graph_node *node, struct graph_vector *vec)
+{
+    struct forwarder *fwd = (struct forwarder *) node->ctx;
+    struct packet *pkt = NULL;
+    int i = 0;
+
+    for (i = 0; i < vec->count; i++) {
+        pkt = vec->pkts[i];
+        if (pkt->port == 0) {
+            pktlog_add(fwd->log_ring, pktlog_from_tunnel, &pkt->view, 0);
+            graph_next(graph, node, log_next_classify, pkt);
+        } else {
+            pktlog_add(fwd->log_ring, pktlog_from_port, &pkt->view, pkt->port);
+            graph_next(graph, node, log_next_tun_output, pkt);
+        }
+    }
+}
+
+/* classify: apply the highest priority matching flow rule, if any, then
+ * pick the packet's secondary router by route or flow hash. Echo requests
+ * routed to the primary itself (route ... local) go to rewrite instead,
+ * which saves them both trips over IPC. The route and flow tables are
+ * taken once per vector */
+void primary_classify(struct graph *graph, struct graph_node *node, struct graph_vector *vec)
+{
+    struct forwarder *fwd = (struct forwarder *) node->ctx;
+    struct lpm_table *routes = __atomic_load_n(&route_table, __ATOMIC_ACQUIRE);
+    struct flow_table *flows = __atomic_load_n(&flow_table, __ATOMIC_ACQUIRE);
+    struct flow_rule *rule = NULL;
+    struct packet *pkt = NULL;
+    int router_id = 0;
+    int i = 0;
+
+    for (i = 0; i < vec->count; i++) {
+        graph_prefetch(vec, i);
+        pkt = vec->pkts[i];
+        router_id = 0;
+
+        rule = flows ? flow_table_lookup(flows, pkt->view.src, pkt->view.dst,
+                pkt->view.protocol, pkt->view.icmp_type) : NULL;
+        if (rule) {
+            switch (rule->action) {
+                case flow_action_drop:
+                    graph_drop(graph, node, pkt);
+                    continue;
+                case flow_action_reply:
+                    /* Answer the echo request ourselves, nothing else has a reply */
+                    if (packet_view_is_echo(&pkt->view)) {
+                        graph_next(graph, node, classify_next_rewrite, pkt);
+                    } else {
+                        graph_drop(graph, node, pkt);
+                    }
+                    continue;
+                case flow_action_mirror:
+                    primary_mirror_packet(fwd, pkt, rule->router_id);
+                    break;
+                case flow_action_forward:
+                    if (rule->router_id >= router_order_2 && rule->router_id <= num_routers &&
+                        primary_router_alive(rule->router_id)) {
+                        router_id = rule->router_id;
+                    }
+                    break;
+            }
+        }
+
+        if (router_id == 0) {
+            router_id = primary_select_router(routes, &pkt->view);
+        }
+        if (router_id == ROUTE_LOCAL) {
+            /* Answered right here, checked like a secondary would */
+            if (!packet_checksums_valid(&pkt->view, pkt->data)) {
+                metrics_add(&fwd->metrics->filtered_drops, 1);
+                graph_drop(graph, node, pkt);
+                continue;
+            }
+            metrics_add(&fwd->metrics->local_replies, 1);
+            graph_next(graph, node, classify_next_rewrite, pkt);
+            continue;
+        }
+        if (router_id == 0) {
+            /* No secondary router left */
+            graph_drop(graph, node, pkt);
+            continue;
+        }
+        pkt->router_id = router_id;
+        metrics_add(&fwd->router_packets[router_id], 1);
+        graph_next(graph, node, classify_next_ipc_output, pkt);
+    }
+}
+
+/* rewrite: turn every echo request into it's reply, in place in the buffer
+ * it was read into, patching the checksum. tun-output gets them as one
+ * vector, a single submission with io_uring */
+void primary_rewrite(struct graph *graph, struct graph_node *node, struct graph_vector *vec)
+{
+    struct packet *pkt = NULL;
+    int i = 0;
+
+    for (i = 0; i < vec->count; i++) {
+        pkt = vec->pkts[i];
+        form_echo_reply(&pkt->view, pkt->data);
+        graph_next(graph, node, rewrite_next_tun_output, pkt);
+    }
+}
+
+/* ipc-output: queue every packet for it's secondary router, then send
+ * each secondary as much of it's queue as it can take */
+void primary_ipc_output(struct graph *graph, struct graph_node *node, struct graph_vector *vec)
+{
+    struct forwarder *fwd = (struct forwarder *) node->ctx;
+    uint64_t now = metrics_now_ns();
+    int i = 0;
+
+    (void) graph;
+    for (i = 0; i < vec->count; i++) {
+        primary_queue_packet(fwd, vec->pkts[i], now);
+    }
+    primary_queue_drain(fwd);
+}
+
+/* tun-output: write every packet to the worker's tunnel queue */
+void primary_tun_output(struct graph *graph, struct graph_node *node, struct graph_vector *vec)
+{
+    struct forwarder *fwd = (struct forwarder *) node->ctx;
+    int i = 0;
+
+    (void) graph;
+    for (i = 0; i < vec->count; i++) {
+        primary_tun_send(fwd, vec->pkts[i]);
+    }
+}
+
+/* Build the worker's data path graph */
+bool primary_graph_init(struct forwarder *fwd)
+{
+    struct graph *graph = &fwd->graph;
+    int parse = 0;
+    int log = 0;
+    int classify = 0;
+    int rewrite = 0;
+    int ipc_output = 0;
+    int tun_output = 0;
+
+    if (!graph_init(graph, &fwd->pool)) {
+        return false;
+    }
+    fwd->tun_input_node = graph_add_node(graph, "tun-input", primary_tun_input, fwd);
+    parse = graph_add_node(graph, "parse", primary_parse, fwd);
+    log = graph_add_node(graph, "log", primary_log, fwd);
+    classify = graph_add_node(graph, "classify", primary_classify, fwd);
+    rewrite = graph_add_node(graph, "rewrite", primary_rewrite, fwd);
+    ipc_output = graph_add_node(graph, "ipc-output", primary_ipc_output, fwd);
+    tun_output = graph_add_node(graph, "tun-output", primary_tun_output, fwd);
+    fwd->parse_node = parse;
+
+    /* In the order of enum primary_edge */
+    return graph_connect(graph, fwd->tun_input_node, parse) == tun_input_next_parse &&
+        graph_connect(graph, parse, log) == parse_next_log &&
+        graph_connect(graph, log, classify) == log_next_classify &&
+        graph_connect(graph, log, tun_output) == log_next_tun_output &&
+        graph_connect(graph, classify, ipc_output) == classify_next_ipc_output &&
+        graph_connect(graph, classify, rewrite) == classify_next_rewrite &&
+        graph_connect(graph, rewrite, tun_output) == rewrite_next_tun_output;
+}
+
+/* Tunnel fd is readable: run the graph a vector at a time until the
+ * tunnel is drained, then send out whatever got queued */
+void primary_tun_ready(int router_tun_fd, void *ctx)
+{
+    struct forwarder *fwd = (struct forwarder *) ctx;
+
+    (void) router_tun_fd;
+    atomic_store(&primary_last_activity, monotonic_seconds());
+    do {
+        graph_run(&fwd->graph, fwd->tun_input_node);
+    } while (fwd->tun_more);
+    primary_flush(fwd);
+}
+
+/* The worker's io_uring has completions: run the packets the multishot
+ * read got from the tunnel through the graph, then lend the kernel new
+ * buffers and submit the sends in one go */
+void primary_uring_ready(int event_fd, void *ctx)
+{
+    struct forwarder *fwd = (struct forwarder *) ctx;
+
+    (void) event_fd;
+    uring_get_events(&fwd->tun_uring->ring);
+    atomic_store(&primary_last_activity, monotonic_seconds());
+    do {
+        graph_run(&fwd->graph, fwd->tun_input_node);
+    } while (fwd->tun_more);
+    metrics_add(&fwd->metrics->send_errors, fwd->tun_uring->write_errors);
+    fwd->tun_uring->write_errors = 0;
+    primary_flush(fwd);
+}
+
+/* Worker 0's view of the secondaries, kept from their heartbeats */
+struct primary_liveness
+{
+    struct heartbeat_monitor monitor;
+    struct forwarder *workers;
+    struct timer timer;
+};
+
+/* router_id stopped answering it's heartbeats: move it's flows over to the
+ * remaining routers, the other flows stay where they are. Report how long
+ * it's flows went unserved, from the last heartbeat it answered until they
+ * are moved, and the packets sent to it that it never received (those it's
+ * socket dropped are counted already) */
+void primary_router_failed(struct primary_liveness *liveness, int router_id, uint64_t now)
+{
+    struct heartbeat_peer *peer = &liveness->monitor.peers[router_id];
+    uint64_t sent = primary_router_sent(router_id);
+    uint64_t received = primary_router_received(router_id);
+    uint64_t dropped = __atomic_load_n(&metrics_queue(&metrics_region, 0, router_id)->socket_drops,
+            __ATOMIC_RELAXED);
+    uint64_t lost = (sent > received + dropped) ? sent - received - dropped : 0;
+    uint64_t start = metrics_now_ns();
+    uint64_t failover = 0;
+
+    peer->alive = false;
+    __atomic_store_n(&router_alive[router_id], false, __ATOMIC_RELAXED);
+    flow_hash_remove_router(&flow_hash, router_id);
+    failover = (now - peer->last_reply) * 1000 + (metrics_now_ns() - start) / 1000;
+
+    printf("\n Router %d failed: failed over in %lu us, %lu packets lost",
+            router_id, (unsigned long) failover, (unsigned long) lost);
+    fprintf(router_info[router_order_primary].fp,
+            "router: %d, failed, failover: %lu us, lost: %lu\n",
+            router_id, (unsigned long) failover, (unsigned long) lost);
+    fflush(router_info[router_order_primary].fp);
+}
+
+/* router_id answers again: give it back it's share of the flows */
+void primary_router_recovered(struct primary_liveness *liveness, int router_id)
+{
+    (void) liveness;
+    flow_hash_add_router(&flow_hash, router_id);
+    __atomic_store_n(&router_alive[router_id], true, __ATOMIC_RELAXED);
+
+    printf("\n Router %d is back", router_id);
+    fprintf(router_info[router_order_primary].fp, "router: %d, back\n", router_id);
+    fflush(router_info[router_order_primary].fp);
+}
+
+/* Heartbeat timer of worker 0: fail the secondaries silent for too long,
+ * then send every secondary, dead ones included, it's next heartbeat */
+void primary_heartbeat(struct timer *timer, void *ctx)
+{
+    struct primary_liveness *liveness = (struct primary_liveness *) ctx;
+    struct forwarder *fwd = &liveness->workers[0];
+    char message[sizeof(struct heartbeat_msg)];
+    struct sockaddr_in dst = {0};
+    uint64_t now = event_loop_now();
+    int router_id = 0;
+    int len = 0;
+
+    for (router_id = router_order_2; router_id <= num_routers; router_id++) {
+        if (heartbeat_expired(&liveness->monitor, router_id, now)) {
+            primary_router_failed(liveness, router_id, now);
+        }
+        len = heartbeat_format(&liveness->monitor, router_id,
+                primary_router_sent(router_id), message);
+        set_sockaddr_details(&dst, router_info[router_id].port);
+        router_ipc_send(fwd->router_fd, message, len, dst);
+    }
+    event_loop_arm_timer(&fwd->loop, timer, HEARTBEAT_INTERVAL_MS);
+}
+
+/* Over UDP, the packets sent to router_id before the heartbeat it just
+ * answered that it never received were dropped by it's socket */
+void primary_socket_drops(struct primary_liveness *liveness, int router_id)
+{
+    uint64_t acked = liveness->monitor.peers[router_id].acked_packets;
+    uint64_t received = primary_router_received(router_id);
+
+    __atomic_store_n(&metrics_queue(&metrics_region, 0, router_id)->socket_drops,
+            (acked > received) ? acked - received : 0, __ATOMIC_RELAXED);
+}
+
+/* A secondary answered a heartbeat (in pkt, from port pkt->port) */
+void primary_heartbeat_reply(struct forwarder *fwd, struct packet *pkt)
+{
+    int router_id = heartbeat_router(pkt->data);
+
+    if (!fwd->liveness || router_id < router_order_2 || router_id > num_routers ||
+        pkt->port != router_info[router_id].port) {
+        return;
+    }
+    if (heartbeat_reply(&fwd->liveness->monitor, router_id, pkt->data, pkt->len,
+                event_loop_now())) {
+        primary_router_recovered(fwd->liveness, router_id);
+    }
+    if (!use_shm_ipc) {
+        primary_socket_drops(fwd->liveness, router_id);
+    }
+}
+
+/* Primary router's socket is readable: feed every reply to the graph. The
+ * batch gets new buffers from the pool for the next receive. Heartbeat
+ * answers are taken out first, they don't count as activity */
+void primary_router_ready(int pr_router_fd, void *ctx)
+{
+    struct forwarder *fwd = (struct forwarder *) ctx;
+    struct packet *pkt = NULL;
+    bool active = false;
+    int i = 0;
+
+    while (router_ipc_receive_batch(pr_router_fd, &fwd->rx_batch) > 0) {
+        for (i = 0; i < fwd->rx_batch.count; i++) {
+#ifdef PACKET_TRACE
+            struct timespec *rx_time = ipc_batch_rx_time(&fwd->rx_batch, i);
+
+            ipc_batch_packet(&fwd->rx_batch, i)->trace_kernel = (rx_time != NULL);
+            ipc_batch_packet(&fwd->rx_batch, i)->trace_time = rx_time ?
+                trace_kernel_time(rx_time) : trace_now();
+#endif
+            pkt = ipc_batch_take(&fwd->rx_batch, i);
+            pkt->port = ntohs(ipc_batch_addr(&fwd->rx_batch, i)->sin_port);
+            if (heartbeat_is_message(pkt->data, pkt->len)) {
+                primary_heartbeat_reply(fwd, pkt);
+                packet_free(&fwd->pool, pkt);
+                continue;
+            }
+            active = true;
+            graph_enqueue(&fwd->graph, fwd->parse_node, pkt);
+        }
+        graph_run(&fwd->graph, fwd->parse_node);
+    }
+    if (active) {
+        atomic_store(&primary_last_activity, monotonic_seconds());
+    }
+    if (fwd->tun_uring) {
+        tun_uring_submit(fwd->tun_uring);
+    }
+}
+
+/* Worker's eventfd fired: copy the replies queued on the reply rings of
+ * every secondary into pool buffers and feed them to the graph */
+void primary_shm_ready(int efd, void *ctx)
+{
+    struct forwarder *fwd = (struct forwarder *) ctx;
+    struct shm_ring *replies = NULL;
+    struct shm_slot *slot = NULL;
+    struct packet *pkt = NULL;
+    bool busy = false;
+    int router_id = 0;
+    int count = 0;
+
+    atomic_store(&primary_last_activity, monotonic_seconds());
+    shm_ipc_clear(efd);
+
+    /* Same round as secondary_shm_ready() */
+    do {
+        busy = false;
+        for (router_id = router_order_2; router_id <= num_routers; router_id++) {
+            replies = shm_ipc_reply_ring(fwd->shm, fwd->worker, router_id);
+            for (count = 0; count < fwd->rx_batch.size; count++) {
+                slot = shm_ring_peek(replies);
+                if (!slot) {
+                    break;
+                }
+                pkt = packet_alloc(&fwd->pool);
+                if (!pkt) {
+                    /* The graph holds every buffer, run it to get some back */
+                    graph_run(&fwd->graph, fwd->parse_node);
+                    pkt = packet_alloc(&fwd->pool);
+                }
+                if (pkt) {
+                    memcpy(pkt->data, slot->data, slot->len);
+                    pkt->len = slot->len;
+                    pkt->port = slot->port;
+#ifdef PACKET_TRACE
+                    pkt->trace_kernel = false;
+                    pkt->trace_time = trace_now();
+#endif
+                    graph_enqueue(&fwd->graph, fwd->parse_node, pkt);
+                } else {
+                    metrics_add(&fwd->metrics->alloc_failures, 1);
+                }
+                shm_ring_consume(replies);
+            }
+            shm_ring_release(replies);
+            busy |= (count > 0);
+        }
+    } while (busy);
+
+    graph_run(&fwd->graph, fwd->parse_node);
+    if (fwd->tun_uring) {
+        tun_uring_submit(fwd->tun_uring);
+    }
+}
+
+/* This worker's idle timer fired. The primary is idle once no worker has
+ * seen a packet for IDLE_TIMEOUT seconds; until then keep checking. It's a
+ * plain timer rather than the loop's idle timeout: heartbeats keep worker 0's
+ * socket busy but are no activity */
+void primary_router_idle(struct timer *timer, void *ctx)
+{
+    struct forwarder *fwd = (struct forwarder *) ctx;
+    time_t idle = 0;
+
+    idle = monotonic_seconds() - atomic_load(&primary_last_activity);
+    if (idle < IDLE_TIMEOUT) {
+        /* Packets seen since, by this worker or another one */
+        event_loop_arm_timer(&fwd->loop, timer, (IDLE_TIMEOUT - idle) * 1000);
+        return;
+    }
+
+    printf("\n Router has been idle for %d seconds", IDLE_TIMEOUT);
+    event_loop_stop(&fwd->loop);
+}
+
+/* Build the route table from the routes given in config. Routes to
+ * unknown routers are skipped */
+struct lpm_table *build_route_table(struct router_config *config)
+{
+    struct lpm_table *table = NULL;
+    struct lpm_route *routes = NULL;
+    int count = 0;
+    int i = 0;
+
+    routes = (struct lpm_route *) calloc (config->num_routes + 1, sizeof(*routes));
+    if (!routes) {
+        printf("\n Unable to allocate memory - %s", strerror(errno));
+        return NULL;
+    }
+
+    for (i = 0; i < config->num_routes; i++) {
+        if (config->routes[i].router_id == CONFIG_ROUTE_LOCAL) {
+            routes[count].prefix = config->routes[i].prefix;
+            routes[count].len = config->routes[i].len;
+            routes[count].next_hop = ROUTE_LOCAL;
+            count++;
+            continue;
+        }
+        if ((config->routes[i].router_id < router_order_2) ||
+            (config->routes[i].router_id > num_routers)) {
+            printf("\n Skipping route to unknown router %d", config->routes[i].router_id);
+            continue;
+        }
+        routes[count].prefix = config->routes[i].prefix;
+        routes[count].len = config->routes[i].len;
+        routes[count].next_hop = config->routes[i].router_id;
+        count++;
+    }
+
+    table = lpm_build(routes, count);
+    free(routes);
+    return table;
+}
+
+/* Wait until no primary worker but the calling one (worker 0) can still be
+ * using a table that has just been replaced */
+void primary_synchronize_workers(void *ctx)
+{
+    struct forwarder *workers = (struct forwarder *) ctx;
+    int i = 0;
+
+    for (i = 1; i < workers[0].num_workers; i++) {
+        event_loop_synchronize(&workers[i].loop);
+    }
+}
+
+/* SIGUSR1 arrived: re-read the routes from the config file and swap the
+ * new table in. The old table is freed once no worker can still be in
+ * the middle of a lookup on it */
+void primary_reload_routes(int signal_fd, void *ctx)
+{
+    struct forwarder *workers = (struct forwarder *) ctx;
+    struct signalfd_siginfo info;
+    struct router_config config = {0};
+    struct lpm_table *table = NULL;
+    bool reload = false;
+
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        reload = true;
+    }
+    if (!reload || !parse_config_file(config_file_name, &config)) {
+        return;
+    }
+
+    table = build_route_table(&config);
+    free_config(&config);
+    if (!table) {
+        printf("\n Keeping the current routes");
+        return;
+    }
+
+    table = lpm_swap(&route_table, table);
+    primary_synchronize_workers(workers);
+    lpm_free(table);
+    printf("\n Reloaded routes from %s", config_file_name);
+}
+
+/* Log how many packets every secondary router got from the primary, so the
+ * balance of the flow hash can be checked */
+void log_router_packets(struct forwarder *workers, int num_workers)
+{
+    uint64_t packets = 0;
+    int router_id = 0;
+    int i = 0;
+
+    for (router_id = router_order_2; router_id <= num_routers; router_id++) {
+        packets = 0;
+        for (i = 0; i < num_workers; i++) {
+            packets += workers[i].router_packets[router_id];
+        }
+        fprintf(router_info[router_order_primary].fp, "router: %d, packets: %lu\n",
+                router_id, (unsigned long) packets);
+
+        /* Packets lost to full rings, both ways */
+        packets = 0;
+        for (i = 0; use_shm_ipc && i < num_workers; i++) {
+            packets += shm_ipc_request_ring(&shm_ipc, i, router_id)->dropped;
+            packets += shm_ipc_reply_ring(&shm_ipc, i, router_id)->dropped;
+        }
+        if (packets) {
+            fprintf(router_info[router_order_primary].fp, "router: %d, ring drops: %lu\n",
+                    router_id, (unsigned long) packets);
+        }
+    }
+    fflush(router_info[router_order_primary].fp);
+}
+
+/* Run one primary worker's forwarding loop, pinned to it's CPU if set */
+void *primary_worker(void *arg)
+{
+    struct forwarder *fwd = (struct forwarder *) arg;
+
+    if (fwd->cpu >= 0) {
+        pin_thread(fwd->cpu);
+    }
+
+    /* A ring may only be used by the thread that set it up. With it the
+     * tunnel is read by a multishot read, and the loop waits on the ring's
+     * eventfd instead of the tunnel fd */
+    if (fwd->use_uring) {
+        fwd->tun_uring = (struct tun_uring *) calloc (1, sizeof(*fwd->tun_uring));
+        if (fwd->tun_uring && !tun_uring_init(fwd->tun_uring, fwd->tun_fd, &fwd->pool)) {
+            printf("\n Worker %d falling back to read() / write() on the tunnel", fwd->worker);
+            free(fwd->tun_uring);
+            fwd->tun_uring = NULL;
+        }
+    }
+    if (!(fwd->tun_uring ?
+            event_loop_add(&fwd->loop, fwd->tun_uring->ring.event_fd, primary_uring_ready, fwd) :
+            event_loop_add(&fwd->loop, fwd->tun_fd, primary_tun_ready, fwd))) {
+        exit(-1);
+    }
+
+    event_loop_run(&fwd->loop);
+    return NULL;
+}
+
+/* End the secondary routers: SIGHUP to their processes, or shutdown_efd
+ * for router threads, which are waited for since they share the rings and
+ * the counters the primary is about to unmap */
+void stop_secondary_routers(void)
+{
+    uint64_t one = 1;
+    int i = 0;
+
+    if (router_runtime == router_runtime_process) {
+        for (i = router_order_2; i <= num_routers; i++) {
+            kill(router_info[i].pid, SIGHUP);
+        }
+        return;
+    }
+
+    if (write(shutdown_efd, &one, sizeof(one)) < 0) {
+        printf("\n Unable to stop the router threads - %s", strerror(errno));
+        exit(-1);
+    }
+    for (i = router_order_2; i <= num_routers; i++) {
+        pthread_join(router_threads[i].thread, NULL);
+    }
+    free(router_threads);
+    router_threads = NULL;
+    close(shutdown_efd);
+    shutdown_efd = -1;
+}
+
+/* Primary router's action
+ * Listen on both the tunnel and socket (Primary->Secondary) FDs
+ * If tunnel FD is available:
+ *      Read from tunnel
+ *      Parse the request packet, extract source and destination address
+ *      Send packet to secondary router
+ * If socket FD is available:
+ *      Read from socket FD (Primary <-> Secondary)
+ *      Parse the response packet, extract source and destination address
+ *      Write packet to tunnel
+ * Both FDs are edge-triggered and drained until EAGAIN on every wake-up.
+ * Packets to and from the secondary move in batches of config->batch_size.
+ * With several TUN queues, every queue gets a worker thread pinned to it's
+ * own CPU, with a socket of it's own towards the secondary. Worker 0 runs in
+ * the calling thread and uses the primary router's socket. With router
+ * threads even a single worker is pinned */
+void handle_primary_router(int pr_router_fd, int *router_tun_fds, struct router_config *config)
+{
+    struct forwarder *workers = NULL;
+    struct forwarder *fwd = NULL;
+    int num_workers = config->tun_queues;
+    sigset_t reload_mask;
+    int signal_fd = -1;
+    struct control control;
+    struct metrics_server metrics;
+    struct primary_liveness liveness;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    int router_fd = 0;
+    int port = 0;
+    int i = 0;
+
+    workers = (struct forwarder *) calloc (num_workers, sizeof(*workers));
+    router_alive = (bool *) calloc (num_routers + 1, sizeof(bool));
+    if (!workers || !router_alive || !flow_hash_init(&flow_hash, num_routers)) {
+        printf("\n Unable to allocate memory - %s", strerror(errno));
+        exit(-1);
+    }
+
+    route_table = build_route_table(config);
+    if (!route_table) {
+        exit(-1);
+    }
+
+    /* SIGUSR1 reloads the routes. Block it before any worker starts so that
+     * it is only ever seen through the signalfd */
+    sigemptyset(&reload_mask);
+    sigaddset(&reload_mask, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &reload_mask, NULL) != 0 ||
+        (signal_fd = signalfd(-1, &reload_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        printf("\n Unable to set up route reload - %s", strerror(errno));
+        exit(-1);
+    }
+
+    packet_log_init(config->stage, router_order_primary, num_workers);
+    packet_trace_init(config, router_order_primary, num_workers);
+
+    /* Every worker's memory is set up while running on it's CPU, so the
+     * pages are first touched on (and placed on) it's NUMA node */
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        CPU_ZERO(&cpus);
+    }
+
+    atomic_store(&primary_last_activity, monotonic_seconds());
+    for (i = 0; i < num_workers; i++) {
+        fwd = &workers[i];
+        router_fd = (i == 0) ? pr_router_fd : open_router_socket(&port);
+        if ((num_workers > 1 || router_runtime == router_runtime_thread) && num_cpus > 0) {
+            pin_thread(i % num_cpus);
+        }
+        forwarder_init(fwd, router_order_primary, router_fd, router_tun_fds[i], config);
+        fwd->port = (i == 0) ? router_info[router_order_primary].port : port;
+        fwd->worker = i;
+        fwd->num_workers = num_workers;
+        fwd->mirror_fd = open_router_socket(&port);
+        fwd->log_ring = &router_info[router_order_primary].log.rings[i];
+        fwd->metrics = metrics_worker(&metrics_region, i);
+        fwd->inflight = metrics_inflight_alloc();
+        if (!fwd->inflight) {
+            exit(-1);
+        }
+        if (police_enabled(config->police)) {
+            fwd->police = (struct police *) calloc (1, sizeof(*fwd->police));
+            if (!fwd->police ||
+                !police_init(fwd->police, config->police, config->police_sources,
+                    num_workers)) {
+                printf("\n Unable to set up policing for worker %d", i);
+                exit(-1);
+            }
+        }
+        primary_queues_init(fwd, config);
+        fwd->trace = packet_trace_buffer(router_order_primary, i);
+        forwarder_trace_rx_times(fwd);
+        if ((num_workers > 1 || router_runtime == router_runtime_thread) && num_cpus > 0) {
+            fwd->cpu = i % num_cpus;
+        }
+
+        /* io_uring reads don't leave room for the virtio header */
+        fwd->use_uring = config->io_uring && !config->vnet_hdr;
+        if (config->vnet_hdr) {
+            fwd->vnet = (struct tun_vnet *) calloc (1, sizeof(*fwd->vnet));
+            if (!fwd->vnet) {
+                printf("\n Unable to allocate memory - %s", strerror(errno));
+                exit(-1);
+            }
+            if (!tun_vnet_init(fwd->vnet, fwd->pool.buf_size)) {
+                exit(-1);
+            }
+        }
+        if (!primary_graph_init(fwd)) {
+            exit(-1);
+        }
+        metrics_attach_graph(&metrics_region, i, &fwd->graph);
+
+        /* Add the worker's socket to it's event loop. The tunnel fd (or
+         * it's io_uring) is added by the worker itself */
+        if (!set_fd_nonblocking(fwd->tun_fd) || !set_fd_nonblocking(fwd->router_fd) ||
+            !event_loop_add(&fwd->loop, fwd->router_fd, primary_router_ready, fwd) ||
+            !set_fd_nonblocking(fwd->mirror_fd) ||
+            !event_loop_add(&fwd->loop, fwd->mirror_fd, primary_mirror_ready, fwd)) {
+            exit(-1);
+        }
+        timer_init(&fwd->idle_timer, primary_router_idle, fwd);
+        event_loop_arm_timer(&fwd->loop, &fwd->idle_timer, IDLE_TIMEOUT * 1000);
+        if (fwd->shm && !event_loop_add(&fwd->loop, fwd->shm->worker_efds[i],
+                    primary_shm_ready, fwd)) {
+            exit(-1);
+        }
+    }
+    if (CPU_COUNT(&cpus) > 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    if (!event_loop_add(&workers[0].loop, signal_fd, primary_reload_routes, workers)) {
+        exit(-1);
+    }
+
+    /* Flow rules are installed at runtime through the control socket,
+     * served by worker 0 */
+    if (config->control_socket[0] != '\0') {
+        if (!control_init(&control, config->control_socket, &flow_table, num_routers,
+                    primary_synchronize_workers, workers) ||
+            !event_loop_add(&workers[0].loop, control.fd, control_ready, &control)) {
+            exit(-1);
+        }
+    }
+
+    /* So is the metrics socket. Snapshots only read the counters */
+    if (config->metrics_socket[0] != '\0') {
+        if (!metrics_server_init(&metrics, config->metrics_socket, &metrics_region) ||
+            !event_loop_add(&workers[0].loop, metrics.fd, metrics_server_ready, &metrics)) {
+            exit(-1);
+        }
+    }
+
+    /* Worker 0 also watches over the secondaries, all up by now */
+    for (i = router_order_2; i <= num_routers; i++) {
+        router_alive[i] = true;
+    }
+    if (!heartbeat_init(&liveness.monitor, num_routers, event_loop_now())) {
+        exit(-1);
+    }
+    liveness.workers = workers;
+    workers[0].liveness = &liveness;
+    timer_init(&liveness.timer, primary_heartbeat, &liveness);
+    event_loop_arm_timer(&workers[0].loop, &liveness.timer, HEARTBEAT_INTERVAL_MS);
+
+    for (i = 1; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, primary_worker, &workers[i]) != 0) {
+            printf("\n Unable to start worker %d - %s", i, strerror(errno));
+            exit(-1);
+        }
+    }
+    primary_worker(&workers[0]);
+    for (i = 1; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    stop_secondary_routers();
+    log_router_packets(workers, num_workers);
+
+    for (i = 0; i < num_workers; i++) {
+        if (workers[i].tun_uring) {
+            tun_uring_destroy(workers[i].tun_uring);
+            free(workers[i].tun_uring);
+        }
+        if (workers[i].vnet) {
+            tun_vnet_destroy(workers[i].vnet);
+            free(workers[i].vnet);
+        }
+        if (workers[i].police) {
+            police_destroy(workers[i].police);
+            free(workers[i].police);
+        }
+        primary_queues_destroy(&workers[i]);
+        forwarder_cleanup(&workers[i]);
+        close(workers[i].mirror_fd);
+        if (i > 0) {
+            close(workers[i].router_fd);
+        }
+    }
+    if (config->control_socket[0] != '\0') {
+        control_close(&control);
+    }
+    if (config->metrics_socket[0] != '\0') {
+        metrics_server_close(&metrics);
+    }
+    flow_table_free(flow_table);
+    flow_table = NULL;
+    heartbeat_destroy(&liveness.monitor);
+    free(router_alive);
+    router_alive = NULL;
+    free(workers);
+    close(signal_fd);
+    flow_hash_destroy(&flow_hash);
+    lpm_free(route_table);
+    route_table = NULL;
+    packet_log_close(router_order_primary);
+    packet_trace_close(config->stage, router_order_primary);
+    if (use_shm_ipc) {
+        shm_ipc_destroy(&shm_ipc);
+    }
+    metrics_region_destroy(&metrics_region);
+}
+
+/* Send a signal to secondary router and cleanup the */
+void sighup()
+{
+    signal(SIGHUP,   sighup);
+    cleanup(current_router_id);
+}
+
+/* Check if the received message is "I am up" from secondary router
+ * Exit once every secondary router has sent one. They are all up (see
+ * wait_for_routers()), so the messages are already queued; anything else
+ * is skipped */
+void handle_primary_router_stage_1()
+{
+    char message[MAX_BUFFER_SIZE];
+    int routers_up = 0;
+    pid_t pid = 0;
+    int i = 0;
+
+    while (routers_up < num_routers) {
+        if (router_ipc_receive(router_order_primary, message, sizeof(message)) < 0) {
+            continue;
+        }
+        pid = atoi(message);
+
+        for (i = router_order_2; i <= num_routers; i++) {
+            if (pid == router_info[i].pid) {
+                printf("\n Received a logout message from router %d", i);
+                routers_up++;
+                break;
+            }
+        }
+    }
+}
+
+/* Send an "I am up" message to primary router
+ * "I am up" message of router i will be PID(router i)
+ * Eg: If router 1 sends it's pid to primary router,
+ *     it is considered an "I am up" message from router 1 */
+void handle_other_routers_stage_1(int router_id)
+{
+    char message[20] = {0};
+    struct sockaddr_in dst_sockaddr = {0};
+
+    set_sockaddr_details(&dst_sockaddr, router_info[router_order_primary].port);
+    snprintf(message, sizeof(message), "%d", getpid());
+    router_ipc_send(router_info[router_id].router_fd, message, strlen(message), dst_sockaddr);
+}
+
+/* Run a secondary router as a thread. It pins itself to it's CPU before
+ * setting anything up, so it's pool, batches and log ring are first touched
+ * on (and placed on) the CPU's NUMA node */
+void *secondary_thread(void *arg)
+{
+    struct router_thread *rt = (struct router_thread *) arg;
+
+    if (rt->cpu >= 0) {
+        pin_thread(rt->cpu);
+    }
+    router_bring_up(rt->config->stage, rt->router_id);
+    handle_other_routers(rt->router_id, rt->config);
+    return NULL;
+}
+
+/* Start a thread per secondary router, each on the next CPU after the
+ * primary's workers. Signals are blocked in them, so the primary alone
+ * sees SIGUSR1 and the others */
+void start_router_threads(struct router_config *config)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    sigset_t all_mask;
+    sigset_t old_mask;
+    int ret = 0;
+    int i = 0;
+
+    router_threads = (struct router_thread *) calloc (num_routers + 1, sizeof(*router_threads));
+    shutdown_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!router_threads || shutdown_efd < 0) {
+        printf("\n Unable to set up router threads - %s", strerror(errno));
+        exit(-1);
+    }
+
+    sigfillset(&all_mask);
+    pthread_sigmask(SIG_BLOCK, &all_mask, &old_mask);
+    for (i = router_order_2; i <= num_routers; i++) {
+        router_threads[i].router_id = i;
+        router_threads[i].cpu = (num_cpus > 0) ?
+            (config->tun_queues + i - router_order_2) % num_cpus : -1;
+        router_threads[i].config = config;
+        router_info[i].pid = getpid();
+        ret = pthread_create(&router_threads[i].thread, NULL, secondary_thread, &router_threads[i]);
+        if (ret != 0) {
+            printf("\n Unable to create router %d - %s", i, strerror(ret));
+            exit(-1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/* Fork one process per secondary router (or start a thread per router with
+ * runtime thread), then run the primary router in this process. The
+ * secondaries bring themselves up in parallel; the primary waits for all
+ * of them at once */
+void create_routers(struct router_config *config, int *router_tun_fds)
+{
+    int stage = config->stage;
+    uint64_t start = event_loop_now();
+    int i = 0;
+    pid_t pid = 0;
+
+    if (pipe2(ready_pipe, O_CLOEXEC) < 0) {
+        printf("\n Unable to create readiness pipe - %s", strerror(errno));
+        exit(-1);
+    }
+
+    /* The counters and the rings have to be mapped before the secondaries
+     * are forked */
+    if (stage == 2 && !metrics_region_init(&metrics_region, config->tun_queues, num_routers)) {
+        exit(-1);
+    }
+    /* Router threads always talk over the rings, in-process queues */
+    if (stage == 2 && config->ipc == ipc_transport_udp &&
+        router_runtime == router_runtime_thread) {
+        printf("\n Router threads use the rings between them, not UDP");
+    }
+    if (stage == 2 && (config->ipc == ipc_transport_shm ||
+                router_runtime == router_runtime_thread)) {
+        use_shm_ipc = shm_ipc_init(&shm_ipc, config->tun_queues, num_routers,
+                config->ring_size, packet_buf_size);
+        if (!use_shm_ipc) {
+            printf("\n Falling back to UDP between the routers");
+        }
+    }
+
+    if (router_runtime == router_runtime_thread) {
+        start_router_threads(config);
+    }
+
+    for (i = router_order_2; router_runtime == router_runtime_process && i <= num_routers; i++) {
+        pid = fork();
+        if (pid < 0) {
+            printf("\n Unable to create router %d - %s", i, strerror(errno));
+            exit(-1);
+        } else if (pid == 0) {
+            /* Secondary router i */
+            current_router_id = i;
+            router_info[i].pid = getpid();
+            close(ready_pipe[0]);
+            router_bring_up(stage, i);
+            close(ready_pipe[1]);
+
+            /* Register for SIGHUP signal */
+            signal(SIGHUP, sighup);
+            switch(stage) {
+                case 1:
+                    handle_other_routers_stage_1(i);
+                    break;
+                case 2:
+                    handle_other_routers(i, config);
+                    break;
+                default:
+                    printf("\n Invalid stage number ");
+            }
+            return;
+        }
+
+        /* Store the pid of the secondary router (child process) */
+        router_info[i].pid = pid;
+    }
+
+    /* Only the secondaries write from here on, the pipe ends once they have
+     * all left */
+    if (router_runtime == router_runtime_process) {
+        close(ready_pipe[1]);
+        ready_pipe[1] = -1;
+    }
+    if (!wait_for_routers()) {
+        for (i = router_order_2; router_runtime == router_runtime_process && i <= num_routers; i++) {
+            kill(router_info[i].pid, SIGKILL);
+        }
+        exit(-1);
+    }
+    close(ready_pipe[0]);
+    if (ready_pipe[1] >= 0) {
+        close(ready_pipe[1]);
+    }
+    for (i = router_order_2; i <= num_routers; i++) {
+        router_log_pid(router_info[router_order_primary].fp, i);
+    }
+    printf("\n %d routers up in %lu ms", num_routers, (unsigned long) (event_loop_now() - start));
+
+    switch(stage) {
+        case 1:
+            handle_primary_router_stage_1();
+            break;
+        case 2:
+            handle_primary_router(router_info[router_order_primary].router_fd, router_tun_fds, config);
+            break;
+        default:
+            printf("\n Invalid stage number ");
+    }
+    cleanup(router_order_primary);
+}
+
+/* Usage - ./router <config-file> */
+int main(int argc, char *argv[])
+{
+    char * config_file = NULL;
+    struct router_config config = {0};
+    int router_tun_fds[MAX_TUN_QUEUES] = {0};
+    int tun_flags = IFF_TUN | IFF_NO_PI;
+    int mtu = 0;
+    int i = 0;
+
+    if (argc <= 1) {
+        printf("\n Usage \n ./router <config-file > ");
+        return 0;
+    }
+    config_file = argv[1];
+    config_file_name = config_file;
+
+    protocol_init();
+
+    /* Parse config file and set stage, num_routers and batch_size */
+    if (!parse_config_file(config_file, &config)) {
+        return 0;
+    }
+
+    printf("\n Stage = %d \n Number of router = %d \n Batch size = %d",
+            config.stage, config.num_routers, config.batch_size);
+    if ((config.stage <= 0) || (config.stage > MAX_STAGE)) {
+        printf("\n Exiting as this stage (%d) is not we are supposed to run", config.stage);
+        return 0;
+    }
+
+    if ((config.num_routers <= 0) || (config.num_routers > MAX_ROUTERS)) {
+        printf("\n Number of routers must be between 1 and %d", MAX_ROUTERS);
+        return 0;
+    }
+    router_info_init(config.num_routers);
+
+    /* Initialize log files */
+    logger_init(config.stage, router_order_primary);
+
+    /* Initialize the primary router */
+    interface_addr = get_interface_addr(INTERFACE_NAME);
+    router_init(router_order_primary);
+    router_info[router_order_primary].pid = getpid();
+
+    /* Initialize tun device, with one queue per primary worker if asked for */
+    if (config.vnet_hdr) {
+        tun_flags |= IFF_VNET_HDR;
+        if (config.io_uring) {
+            printf("\n io_uring is not used with vnet_hdr, using read() / write() on the tunnel");
+        }
+    }
+    if (config.tun_queues > 1) {
+        if (!tunnel_init_multi_queue(TUN_NAME, tun_flags,
+                    router_tun_fds, config.tun_queues)) {
+            printf("\n Unable to create a multi-queue tunnel for %s", TUN_NAME);
+            return 0;
+        }
+    } else {
+        router_tun_fds[0] = tunnel_init(TUN_NAME, tun_flags);
+        if (router_tun_fds[0] < 0) {
+            printf("\n Unable to create a tunnel for %s", TUN_NAME);
+            return 0;
+        }
+    }
+    for (i = 0; config.vnet_hdr && i < config.tun_queues; i++) {
+        if (!tunnel_enable_vnet_hdr(router_tun_fds[i])) {
+            return 0;
+        }
+    }
+
+    /* Packet buffers hold a whole packet of the tunnel's MTU */
+    if (config.mtu > 0 && !tunnel_set_mtu(TUN_NAME, config.mtu)) {
+        printf("\n Keeping the MTU of %s", TUN_NAME);
+    }
+    mtu = tunnel_get_mtu(TUN_NAME);
+    packet_buf_size = tunnel_buffer_size(mtu);
+    printf("\n MTU of %s is %d, packet buffers of %d bytes", TUN_NAME, mtu, packet_buf_size);
+    primary_fit_queues(&config);
+
+    /* Router threads run stage 2 only, stage 1 counts the routers by pid */
+    if (config.runtime == router_runtime_thread) {
+        if (config.stage == 2) {
+            router_runtime = router_runtime_thread;
+        } else {
+            printf("\n Stage %d runs the routers as processes", config.stage);
+        }
+    }
+
+    /* Trace times of every router are taken against the same clock */
+    if (config.trace_sample) {
+        trace_clock_init();
     }
 
     /* Create the primary and secondary routers */
-    create_routers(stage, num_routers, router_tun_fd);
+    create_routers(&config, router_tun_fds);
 
+    free_config(&config);
     return 0;
 }
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "shm_ipc.h"
+
+/* Create an eventfd for each of the <count> consumers */
+static int *shm_ipc_eventfds(int count)
+{
+    int *efds = NULL;
+    int i = 0;
+
+    efds = (int *) calloc (count, sizeof(*efds));
+    if (!efds) {
+        printf("\n Unable to allocate memory - %s", strerror(errno));
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        efds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (efds[i] < 0) {
+            printf("\n Unable to create eventfd - %s", strerror(errno));
+            while (i-- > 0) {
+                close(efds[i]);
+            }
+            free(efds);
+            return NULL;
+        }
+    }
+    return efds;
+}
+
+static void shm_ipc_close_eventfds(int *efds, int count)
+{
+    int i = 0;
+
+    for (i = 0; efds && i < count; i++) {
+        close(efds[i]);
+    }
+    free(efds);
+}
+
+/* Map the rings between <num_workers> primary workers and <num_routers>
+ * secondary routers, each ring holding <ring_size> (a power of 2) packets
+ * of up to buf_size bytes. Must be called before forking the secondaries,
+ * which inherit the mapping and the eventfds */
+bool shm_ipc_init(struct shm_ipc *ipc, int num_workers, int num_routers,
+        int ring_size, int buf_size)
+{
+    struct shm_ring *ring = NULL;
+    size_t slot_size = 0;
+    size_t num_rings = (size_t) num_workers * num_routers * 2;
+    size_t i = 0;
+    int fd = -1;
+
+    memset(ipc, 0, sizeof(*ipc));
+    ipc->num_workers = num_workers;
+    ipc->num_routers = num_routers;
+
+    slot_size = sizeof(struct shm_slot) + buf_size;
+    slot_size = (slot_size + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1);
+    ipc->ring_len = sizeof(struct shm_ring) + slot_size * ring_size;
+    ipc->len = ipc->ring_len * num_rings;
+
+    fd = memfd_create("router-ipc", MFD_CLOEXEC);
+    if (fd < 0) {
+        printf("\n Unable to create shared memory - %s", strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, ipc->len) < 0) {
+        printf("\n Unable to size shared memory to %zu bytes - %s", ipc->len, strerror(errno));
+        close(fd);
+        return false;
+    }
+    ipc->base = mmap(NULL, ipc->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ipc->base == MAP_FAILED) {
+        printf("\n Unable to map shared memory - %s", strerror(errno));
+        ipc->base = NULL;
+        return false;
+    }
+
+    for (i = 0; i < num_rings; i++) {
+        ring = (struct shm_ring *) ((char *) ipc->base + i * ipc->ring_len);
+        ring->size = ring_size;
+        ring->slot_size = slot_size;
+    }
+
+    /* Router r's eventfd is router_efds[r], as router ids start at 1 */
+    ipc->router_efds = shm_ipc_eventfds(num_routers + 1);
+    ipc->worker_efds = shm_ipc_eventfds(num_workers);
+    if (!ipc->router_efds || !ipc->worker_efds) {
+        shm_ipc_destroy(ipc);
+        return false;
+    }
+    return true;
+}
+
+void shm_ipc_destroy(struct shm_ipc *ipc)
+{
+    if (ipc->base) {
+        munmap(ipc->base, ipc->len);
+    }
+    shm_ipc_close_eventfds(ipc->router_efds, ipc->num_routers + 1);
+    shm_ipc_close_eventfds(ipc->worker_efds, ipc->num_workers);
+    memset(ipc, 0, sizeof(*ipc));
+}
+
+/* Ring carrying requests from primary worker <worker> to router_id */
+struct shm_ring *shm_ipc_request_ring(struct shm_ipc *ipc, int worker, int router_id)
+{
+    size_t index = ((size_t) worker * ipc->num_routers + (router_id - 1)) * 2;
+
+    return (struct shm_ring *) ((char *) ipc->base + index * ipc->ring_len);
+}
+
+/* Ring carrying replies from router_id back to primary worker <worker> */
+struct shm_ring *shm_ipc_reply_ring(struct shm_ipc *ipc, int worker, int router_id)
+{
+    size_t index = ((size_t) worker * ipc->num_routers + (router_id - 1)) * 2 + 1;
+
+    return (struct shm_ring *) ((char *) ipc->base + index * ipc->ring_len);
+}
+
+/* Wake up the consumer waiting on efd */
+void shm_ipc_wake(int efd)
+{
+    uint64_t one = 1;
+
+    if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        printf("\n Unable to wake up eventfd (%d) - %s", efd, strerror(errno));
+    }
+}
+
+/* Reset efd's counter before draining the rings it wakes us up for */
+void shm_ipc_clear(int efd)
+{
+    uint64_t count = 0;
+
+    if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        printf("\n Unable to read eventfd (%d) - %s", efd, strerror(errno));
+    }
+}
@@ -0,0 +1,157 @@
+#ifndef SHM_IPC
+#define SHM_IPC
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "packet_pool.h"
+
+/* A packet queued on a ring. port is the UDP port of the router that
+ * queued it, so the receiver can log it like a datagram's source port */
+struct shm_slot
+{
+    uint32_t len;
+    uint16_t port;
+    uint16_t reserved;
+    char data[];
+};
+
+/* Single producer, single consumer ring of fixed size slots in shared
+ * memory. Each side has a cache line of it's own holding the shared index
+ * it writes and private copies of the other side's index */
+struct shm_ring
+{
+    /* Producer */
+    _Atomic uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t next_head;
+    uint32_t cached_tail;
+    uint64_t dropped;
+
+    /* Consumer */
+    _Atomic uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t next_tail;
+    uint32_t cached_head;
+
+    /* Set up once, read by both */
+    uint32_t size __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t slot_size;
+};
+
+/* The rings between the primary's workers and the secondary routers,
+ * mapped from a memfd before the secondaries are forked. Worker w and
+ * router r share a request ring (w -> r) and a reply ring (r -> w). Every
+ * consumer has an eventfd, written only when one of it's rings goes from
+ * empty to non-empty */
+struct shm_ipc
+{
+    void *base;
+    size_t len;
+    size_t ring_len;
+    int num_workers;
+    int num_routers;
+    int *router_efds;
+    int *worker_efds;
+};
+
+bool shm_ipc_init(struct shm_ipc *ipc, int num_workers, int num_routers,
+        int ring_size, int buf_size);
+void shm_ipc_destroy(struct shm_ipc *ipc);
+struct shm_ring *shm_ipc_request_ring(struct shm_ipc *ipc, int worker, int router_id);
+struct shm_ring *shm_ipc_reply_ring(struct shm_ipc *ipc, int worker, int router_id);
+void shm_ipc_wake(int efd);
+void shm_ipc_clear(int efd);
+
+/* Slot <index> of ring */
+static inline struct shm_slot *shm_ring_slot(struct shm_ring *ring, uint32_t index)
+{
+    return (struct shm_slot *) ((char *) (ring + 1) +
+            (size_t) (index & (ring->size - 1)) * ring->slot_size);
+}
+
+/* Producer: copy a packet into the next free slot. It stays invisible to
+ * the consumer until shm_ring_publish()
+ * Returns false (and counts a drop) if the ring is full */
+static inline bool shm_ring_enqueue(struct shm_ring *ring, const char *data,
+        uint32_t len, uint16_t port)
+{
+    struct shm_slot *slot = NULL;
+
+    if (ring->next_head - ring->cached_tail >= ring->size) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (ring->next_head - ring->cached_tail >= ring->size) {
+            ring->dropped++;
+            return false;
+        }
+    }
+    if (len > ring->slot_size - sizeof(*slot)) {
+        ring->dropped++;
+        return false;
+    }
+
+    slot = shm_ring_slot(ring, ring->next_head);
+    slot->len = len;
+    slot->port = port;
+    memcpy(slot->data, data, len);
+    ring->next_head++;
+    return true;
+}
+
+/* Producer: number of slots that can still be enqueued without a drop */
+static inline uint32_t shm_ring_room(struct shm_ring *ring)
+{
+    ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return ring->size - (ring->next_head - ring->cached_tail);
+}
+
+/* Producer: number of slots enqueued but not published yet */
+static inline uint32_t shm_ring_unpublished(struct shm_ring *ring)
+{
+    return ring->next_head - atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+/* Producer: make the enqueued slots visible to the consumer
+ * Returns true if the ring was empty, i.e. the consumer may be asleep and
+ * has to be woken up. The head store and the tail load are sequentially
+ * consistent, pairing with the consumer's tail store and head load in
+ * shm_ring_release() / shm_ring_peek(), so either the consumer sees the new
+ * slots or we see it has emptied the ring */
+static inline bool shm_ring_publish(struct shm_ring *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head == ring->next_head) {
+        return false;
+    }
+    atomic_store(&ring->head, ring->next_head);
+    ring->cached_tail = atomic_load(&ring->tail);
+    return ring->cached_tail == head;
+}
+
+/* Consumer: the oldest slot not consumed yet, NULL if the ring is empty */
+static inline struct shm_slot *shm_ring_peek(struct shm_ring *ring)
+{
+    if (ring->next_tail == ring->cached_head) {
+        ring->cached_head = atomic_load(&ring->head);
+        if (ring->next_tail == ring->cached_head) {
+            return NULL;
+        }
+    }
+    return shm_ring_slot(ring, ring->next_tail);
+}
+
+/* Consumer: done with the slot returned by shm_ring_peek() */
+static inline void shm_ring_consume(struct shm_ring *ring)
+{
+    ring->next_tail++;
+}
+
+/* Consumer: hand the consumed slots back to the producer */
+static inline void shm_ring_release(struct shm_ring *ring)
+{
+    atomic_store(&ring->tail, ring->next_tail);
+}
+
+#endif
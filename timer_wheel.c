@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+/* Ticks covered by the whole wheel */
+#define TIMER_WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+/* Rotate bits right by n (0..63) */
+static inline uint64_t rotate_right(uint64_t bits, int n)
+{
+    return n ? (bits >> n) | (bits << (64 - n)) : bits;
+}
+
+/* Start the wheel at tick <now>, with no timer armed */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+void timer_init(struct timer *timer, timer_handler handler, void *ctx)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->handler = handler;
+    timer->ctx = ctx;
+}
+
+/* Link timer into the slot of the level whose span covers it's expiry */
+static void timer_wheel_insert(struct timer_wheel *wheel, struct timer *timer)
+{
+    uint64_t at = timer->expires;
+    uint64_t delta = 0;
+    struct timer **head = NULL;
+    int level = 0;
+    int slot = 0;
+
+    if (at < wheel->now) {
+        at = wheel->now;
+    }
+    delta = at - wheel->now;
+    if (delta >= TIMER_WHEEL_SPAN) {
+        /* Parked until the top level comes round to it's last slot */
+        at = wheel->now + TIMER_WHEEL_SPAN - 1;
+        delta = TIMER_WHEEL_SPAN - 1;
+    }
+    if (delta >= TIMER_WHEEL_SLOTS) {
+        level = (63 - __builtin_clzll(delta)) / TIMER_WHEEL_BITS;
+    }
+    slot = (at >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+
+    head = &wheel->slots[level][slot];
+    timer->level = level;
+    timer->slot = slot;
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/* Arm timer to expire at tick <expires>, at the earliest on the next tick.
+ * An armed timer is moved */
+void timer_wheel_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t expires)
+{
+    timer_wheel_cancel(wheel, timer);
+    timer->expires = (expires > wheel->now) ? expires : wheel->now + 1;
+    timer_wheel_insert(wheel, timer);
+}
+
+/* Disarm timer, if armed */
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+    if (!timer->pprev) {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (!wheel->slots[timer->level][timer->slot]) {
+        wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* Tick at which the wheel next has something to do: fire the timers of a
+ * slot or cascade one down a level
+ * Returns UINT64_MAX if no timer is armed */
+uint64_t timer_wheel_next(struct timer_wheel *wheel)
+{
+    uint64_t next = UINT64_MAX;
+    uint64_t index = 0;
+    uint64_t tick = 0;
+    uint64_t bits = 0;
+    int shift = 0;
+    int level = 0;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (!wheel->occupied[level]) {
+            continue;
+        }
+        /* First slot boundary of this level after now, and how many slots
+         * past it the first occupied one is */
+        shift = level * TIMER_WHEEL_BITS;
+        index = (wheel->now >> shift) + 1;
+        bits = rotate_right(wheel->occupied[level], index & (TIMER_WHEEL_SLOTS - 1));
+        tick = (index + __builtin_ctzll(bits)) << shift;
+        if (tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+/* Move the timers of slot <slot> of level down to the levels below */
+static void timer_wheel_cascade(struct timer_wheel *wheel, int level, int slot)
+{
+    struct timer *timer = wheel->slots[level][slot];
+    struct timer *next = NULL;
+
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+    while (timer) {
+        next = timer->next;
+        timer_wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+/* Call the handlers of the timers in slot <slot> of level 0, all due now.
+ * They are taken off the wheel first, so handlers can arm and cancel
+ * freely
+ * Returns the number of timers fired */
+static int timer_wheel_fire(struct timer_wheel *wheel, int slot)
+{
+    struct timer *expired = wheel->slots[0][slot];
+    struct timer *timer = NULL;
+    int fired = 0;
+
+    wheel->slots[0][slot] = NULL;
+    wheel->occupied[0] &= ~(1ULL << slot);
+    if (expired) {
+        expired->pprev = &expired;
+    }
+    while (expired) {
+        timer = expired;
+        expired = timer->next;
+        if (expired) {
+            expired->pprev = &expired;
+        }
+        timer->next = NULL;
+        timer->pprev = NULL;
+        timer->handler(timer, timer->ctx);
+        fired++;
+    }
+    return fired;
+}
+
+/* Bring the wheel up to tick <now>, firing every timer due by then
+ * Returns the number of timers fired */
+int timer_wheel_advance(struct timer_wheel *wheel, uint64_t now)
+{
+    uint64_t tick = 0;
+    int fired = 0;
+    int level = 0;
+
+    while (wheel->now < now) {
+        tick = timer_wheel_next(wheel);
+        if (tick > now) {
+            wheel->now = now;
+            break;
+        }
+        wheel->now = tick;
+
+        /* Higher levels first, their timers may land in a slot below that
+         * is also due on this tick */
+        for (level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((tick & ((1ULL << (level * TIMER_WHEEL_BITS)) - 1)) == 0) {
+                timer_wheel_cascade(wheel, level,
+                        (tick >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1));
+            }
+        }
+        fired += timer_wheel_fire(wheel, tick & (TIMER_WHEEL_SLOTS - 1));
+    }
+    return fired;
+}
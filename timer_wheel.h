@@ -0,0 +1,56 @@
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hierarchical timer wheel. Level l has TIMER_WHEEL_SLOTS slots, each
+ * TIMER_WHEEL_SLOTS^l ticks wide; a timer sits in the lowest level whose
+ * span covers it's expiry and moves down a level (cascades) when the wheel
+ * reaches it's slot. Arming and cancelling are O(1), advancing skips the
+ * ticks where nothing is due. Timers further out than the wheel spans are
+ * parked in the last slot of the top level and re-armed when it comes up.
+ * A wheel belongs to a single thread, like the event loop driving it */
+
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer;
+
+/* Called once the timer expired. The timer is no longer armed, the
+ * handler may arm it (or any other) again */
+typedef void (*timer_handler)(struct timer *timer, void *ctx);
+
+/* A timer, embedded in it's owner's state. Linked into a slot while armed */
+struct timer
+{
+    struct timer *next;
+    struct timer **pprev;
+    uint64_t expires;
+    uint8_t level;
+    uint8_t slot;
+    timer_handler handler;
+    void *ctx;
+};
+
+struct timer_wheel
+{
+    uint64_t now;
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    struct timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+void timer_init(struct timer *timer, timer_handler handler, void *ctx);
+void timer_wheel_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t expires);
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer *timer);
+uint64_t timer_wheel_next(struct timer_wheel *wheel);
+int timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+
+static inline bool timer_armed(struct timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+#endif
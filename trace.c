@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static const char *trace_stage_names[trace_stages] = {
+    "tun_read",
+    "parse",
+    "ipc_send",
+    "router_receive",
+    "echo_reply",
+    "ipc_return",
+    "tun_write"
+};
+
+/* Trace clock at a known CLOCK_MONOTONIC / CLOCK_REALTIME time and it's
+ * rate. Set up once before the routers are forked, so every router's
+ * records share the same time base. The rate is measured again over the
+ * whole run when the trace is written out */
+static uint64_t clock_ticks0 = 0;
+static int64_t clock_mono0 = 0;
+static int64_t clock_real0 = 0;
+static double clock_ticks_per_ns = 1.0;
+
+static int64_t timespec_ns(const struct timespec *ts)
+{
+    return (int64_t) ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Measure the trace clock's rate against CLOCK_MONOTONIC since it's
+ * reference point */
+static void trace_clock_rate(void)
+{
+    struct timespec mono;
+    uint64_t ticks = trace_now();
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    if (timespec_ns(&mono) > clock_mono0 && ticks > clock_ticks0) {
+        clock_ticks_per_ns = (double) (ticks - clock_ticks0) / (timespec_ns(&mono) - clock_mono0);
+    }
+}
+
+/* Take the trace clock's reference point and a first measure of it's rate */
+void trace_clock_init(void)
+{
+    struct timespec mono;
+    struct timespec real;
+    struct timespec nap = {0, 20 * 1000 * 1000};
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_ticks0 = trace_now();
+    clock_mono0 = timespec_ns(&mono);
+    clock_real0 = timespec_ns(&real);
+
+    nanosleep(&nap, NULL);
+    trace_clock_rate();
+}
+
+/* Record time of a kernel timestamp (CLOCK_REALTIME): kept as ns and
+ * converted on export */
+uint64_t trace_kernel_time(const struct timespec *realtime)
+{
+    return (uint64_t) timespec_ns(realtime);
+}
+
+/* CLOCK_MONOTONIC ns of a record's time */
+static double trace_record_ns(struct trace_record *record)
+{
+    if (record->kernel) {
+        return clock_mono0 + (double) ((int64_t) record->time - clock_real0);
+    }
+    return clock_mono0 + (double) (int64_t) (record->time - clock_ticks0) / clock_ticks_per_ns;
+}
+
+/* Set up a buffer for each of the <num_buffers> threads of router_id,
+ * tracing one packet id in <sample>. Nothing is traced with a sample rate
+ * of 0 */
+bool trace_open(struct trace *trace, int router_id, int num_buffers, uint32_t sample)
+{
+    int i = 0;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->router_id = router_id;
+    if (sample == 0) {
+        return true;
+    }
+
+    trace->buffers = (struct trace_buffer *) calloc (num_buffers, sizeof(*trace->buffers));
+    if (!trace->buffers) {
+        printf("\n Unable to allocate memory for trace - %s", strerror(errno));
+        return false;
+    }
+    trace->num_buffers = num_buffers;
+    for (i = 0; i < num_buffers; i++) {
+        trace->buffers[i].sample = sample;
+        trace->buffers[i].records = (struct trace_record *) calloc (TRACE_BUFFER_RECORDS,
+                sizeof(struct trace_record));
+        if (!trace->buffers[i].records) {
+            printf("\n Unable to allocate memory for trace - %s", strerror(errno));
+            trace_close(trace, NULL);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Write the records out to path as a Chrome trace (one instant event per
+ * record, the router as process and it's threads as threads) and free the
+ * buffers. Trace files of several routers can be merged into one trace,
+ * their times are comparable */
+bool trace_close(struct trace *trace, const char *path)
+{
+    struct trace_buffer *buf = NULL;
+    struct trace_record *record = NULL;
+    FILE *fp = NULL;
+    uint64_t dropped = 0;
+    bool first = true;
+    bool ok = true;
+    uint32_t j = 0;
+    int i = 0;
+
+    if (!trace->buffers) {
+        return true;
+    }
+    trace_clock_rate();
+
+    fp = path ? fopen(path, "w") : NULL;
+    if (path && !fp) {
+        printf("\n Unable to open trace file %s - %s", path, strerror(errno));
+        ok = false;
+    }
+    if (fp) {
+        fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"router %d\"}}",
+                trace->router_id, trace->router_id);
+        first = false;
+    }
+
+    for (i = 0; i < trace->num_buffers; i++) {
+        buf = &trace->buffers[i];
+        dropped += buf->dropped;
+        for (j = 0; fp && j < buf->count; j++) {
+            record = &buf->records[j];
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"packet\",\"ph\":\"i\",\"s\":\"t\","
+                    "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                    "\"args\":{\"packet\":\"%016llx\",\"clock\":\"%s\"}}",
+                    first ? "" : ",", trace_stage_names[record->stage],
+                    trace->router_id, i, trace_record_ns(record) / 1000.0,
+                    (unsigned long long) record->id, record->kernel ? "kernel" : "trace");
+            first = false;
+        }
+        free(buf->records);
+    }
+
+    if (fp) {
+        fprintf(fp, "\n]}\n");
+        if (fclose(fp) != 0) {
+            printf("\n Unable to write trace file %s - %s", path, strerror(errno));
+            ok = false;
+        }
+    }
+    if (dropped) {
+        printf("\n Trace of router %d dropped %llu records", trace->router_id,
+                (unsigned long long) dropped);
+    }
+    free(trace->buffers);
+    trace->buffers = NULL;
+    trace->num_buffers = 0;
+    return ok;
+}
@@ -0,0 +1,132 @@
+#ifndef TRACE
+#define TRACE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "packet_parser.h"
+
+/* Per-packet trace points, compiled in with -DPACKET_TRACE (make TRACE=1).
+ * Without it every TRACE_POINT() is compiled out. With it, packets are
+ * sampled by id at the configured rate and the sampled ones get a record
+ * per stage in the buffer of the thread handling them */
+
+/* Records kept per thread. Once full, further records are counted as
+ * dropped */
+#define TRACE_BUFFER_RECORDS 65536
+
+enum trace_stage {
+    trace_tun_read,                /* Read from the tunnel */
+    trace_parse,                   /* Parsed and checked */
+    trace_ipc_send,                /* Sent to (queued for) a secondary */
+    trace_router_receive,          /* Received by the secondary */
+    trace_echo_reply,              /* Reply formed by the secondary */
+    trace_ipc_return,              /* Reply received back by the primary */
+    trace_tun_write,               /* Reply written to the tunnel */
+    trace_stages
+};
+
+/* time is in trace clock ticks (see trace_now()), or CLOCK_REALTIME ns
+ * for kernel timestamps */
+struct trace_record
+{
+    uint64_t time;
+    uint64_t id;
+    uint8_t stage;
+    uint8_t kernel;                /* Time taken from a kernel timestamp */
+};
+
+/* Records of one thread; only that thread writes them */
+struct trace_buffer
+{
+    struct trace_record *records;
+    uint32_t count;
+    uint32_t sample;
+    uint64_t dropped;
+};
+
+/* Trace of one router: a buffer per forwarding thread, written out as a
+ * Chrome trace (JSON) when the router exits */
+struct trace
+{
+    int router_id;
+    int num_buffers;
+    struct trace_buffer *buffers;
+};
+
+void trace_clock_init(void);
+bool trace_open(struct trace *trace, int router_id, int num_buffers, uint32_t sample);
+bool trace_close(struct trace *trace, const char *path);
+uint64_t trace_kernel_time(const struct timespec *realtime);
+
+/* Trace clock: the TSC where there is one (converted to ns on export),
+ * CLOCK_MONOTONIC ns otherwise */
+static inline uint64_t trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+/* Id of the packet in view, the same for an echo request and it's reply
+ * and in every router. TCP and UDP packets share the id of their flow.
+ * Packets whose id is a multiple of the sample rate are traced */
+static inline uint64_t trace_packet_id(struct packet_view *view)
+{
+    uint32_t low = (view->src < view->dst) ? view->src : view->dst;
+    uint32_t high = (view->src < view->dst) ? view->dst : view->src;
+    uint64_t id = (((uint64_t) low << 32) | high) * 0x9e3779b97f4a7c15ULL;
+
+    id ^= ((uint64_t) view->echo_id << 16) | view->echo_seq;
+    id ^= (uint64_t) (view->src_port ^ view->dst_port) << 32;
+    id ^= id >> 29;
+    return id;
+}
+
+/* Record that the packet in view reached stage at time */
+static inline void trace_point_at(struct trace_buffer *buf, enum trace_stage stage,
+        struct packet_view *view, uint64_t time, bool kernel)
+{
+    struct trace_record *record = NULL;
+    uint64_t id = 0;
+
+    if (!buf) {
+        return;
+    }
+    id = trace_packet_id(view);
+    if (id % buf->sample != 0) {
+        return;
+    }
+    if (buf->count == TRACE_BUFFER_RECORDS) {
+        buf->dropped++;
+        return;
+    }
+    record = &buf->records[buf->count++];
+    record->time = time;
+    record->id = id;
+    record->stage = stage;
+    record->kernel = kernel;
+}
+
+#ifdef PACKET_TRACE
+#define TRACE_POINT(buf, stage, view) \
+    trace_point_at((buf), (stage), (view), trace_now(), false)
+#define TRACE_POINT_AT(buf, stage, view, time, kernel) \
+    trace_point_at((buf), (stage), (view), (time), (kernel))
+#else
+#define TRACE_POINT(buf, stage, view) ((void) 0)
+#define TRACE_POINT_AT(buf, stage, view, time, kernel) ((void) 0)
+#endif
+
+#endif
@@ -6,6 +6,7 @@
 
 #include <linux/if_tun.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <net/if.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -15,15 +16,17 @@
 
 #include "packet_parser.h"
 #include "tunif.h"
+#include "gso.h"
+#include "protocol.h"
+#include "trace.h"
 
 #define TUN_DEVICE "/dev/net/tun"
 
-#define IPV4_STR_LEN 16
-
-enum icmp_packet_format {
-    icmp_src_start = 12,
-    icmp_dst_start = 16
-};
+/* UDP segmentation offload (Linux 6.2); missing from older headers */
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#define TUN_F_USO6 0x40
+#endif
 
 /* Allocate tunnel interface */
 int tunnel_init(char *dev_name, int flags) 
@@ -55,57 +58,412 @@ int tunnel_init(char *dev_name, int flags)
     return fd;
 }
 
-/* Read data from tunnel (tun_fd) */
-char *router_tun_receive(int tun_fd, int *msg_size) 
+/* Allocate a multi-queue tunnel interface and attach <num_queues> queues to
+ * it. fds[i] is set to the fd of queue i, so each queue can be served by
+ * it's own thread */
+bool tunnel_init_multi_queue(char *dev_name, int flags, int *fds, int num_queues)
+{
+    int i = 0;
+
+    for (i = 0; i < num_queues; i++) {
+        fds[i] = tunnel_init(dev_name, flags | IFF_MULTI_QUEUE);
+        if (fds[i] < 0) {
+            printf("\n Unable to attach queue %d of %s", i, dev_name);
+            while (i-- > 0) {
+                close(fds[i]);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Parse the <recv_bytes> long packet read into pkt into pkt->view and
+ * have the handler of it's protocol check that it is worth forwarding.
+ * Malformed and unsupported packets are left for the caller to count, a
+ * flood of them must not turn into a flood of output
+ * Returns the packet length, 0 when the packet was filtered out */
+int router_tun_filter(struct packet *pkt, int recv_bytes)
+{
+    const struct protocol_handler *handler = NULL;
+
+    if (!packet_view_parse(&pkt->view, pkt->data, recv_bytes)) {
+        return 0;
+    }
+
+    handler = protocol_lookup(&pkt->view);
+    if (!handler || !handler->accept(&pkt->view, pkt->data)) {
+        return 0;
+    }
+
+    pkt->len = recv_bytes;
+    return recv_bytes;
+}
+
+/* Read one packet from tunnel (tun_fd) straight into pkt's buffer,
+ * leaving it unparsed
+ * Returns the packet length and -1 when nothing more can be read
+ * (EAGAIN / error) */
+int router_tun_read(int tun_fd, struct packet *pkt, int buf_size)
 {
-    char buffer[MAX_BUFFER_SIZE];
     int recv_bytes = 0;
-    char *message = NULL;
 
-    recv_bytes = read(tun_fd, buffer, MAX_BUFFER_SIZE);
+    recv_bytes = read(tun_fd, pkt->data, buf_size);
     if (recv_bytes < 0) {
-        printf("\n Error reading from tun fd (%d)", tun_fd);
-        return NULL;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            printf("\n Error reading from tun fd (%d)", tun_fd);
+        }
+        return -1;
     }
-    buffer[recv_bytes] = '\0';
+#ifdef PACKET_TRACE
+    pkt->trace_time = trace_now();
+#endif
+    pkt->len = recv_bytes;
+    return recv_bytes;
+}
 
-    if (!is_protocol_icmp(buffer)) {
-        printf("\n Received a non ICMP message"); 
-        return NULL;
-    }
+/* Read one packet from tunnel (tun_fd) straight into pkt's buffer and
+ * parse it into pkt->view
+ * Returns the packet length, 0 when the packet was filtered out and -1
+ * when nothing more can be read (EAGAIN / error) */
+int router_tun_receive(int tun_fd, struct packet *pkt, int buf_size) 
+{
+    int recv_bytes = router_tun_read(tun_fd, pkt, buf_size);
 
-    if (!is_icmp_echo(buffer)) {
-        printf("\n Received ICMP message doesn't correspond to ECHO");
-        return NULL;
+    if (recv_bytes < 0) {
+        return -1;
     }
+    return router_tun_filter(pkt, recv_bytes);
+}
 
-    message = (char *) malloc (recv_bytes+1);
+/* Write the given message into tunnel (tun_fd)
+ * Returns false if it could not be written, for the caller to count */
+bool router_tun_send(int tun_fd, char *message, int msg_size)
+{
     if (!message) {
+        printf("\n No message to send via tun device");
+        return false;
+    }
+    return write(tun_fd, message, msg_size) >= 0;
+}
+
+/* Read (request SIOCGIFMTU) or set (SIOCSIFMTU) the MTU of dev_name in ifr */
+static bool tunnel_mtu_ioctl(char *dev_name, unsigned long request, struct ifreq *ifr)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    bool ok = true;
+
+    if (fd < 0) {
+        printf("\n Unable to open socket - %s", strerror(errno));
+        return false;
+    }
+    strncpy(ifr->ifr_name, dev_name, IFNAMSIZ - 1);
+    if (ioctl(fd, request, ifr) < 0) {
+        printf("\n Unable to %s MTU of %s - %s", (request == SIOCGIFMTU) ? "read" : "set",
+                dev_name, strerror(errno));
+        ok = false;
+    }
+    close(fd);
+    return ok;
+}
+
+/* MTU of the tunnel dev_name, TUN_DEFAULT_MTU if it can't be read */
+int tunnel_get_mtu(char *dev_name)
+{
+    struct ifreq ifr = {0};
+
+    if (!tunnel_mtu_ioctl(dev_name, SIOCGIFMTU, &ifr) || ifr.ifr_mtu <= 0) {
+        return TUN_DEFAULT_MTU;
+    }
+    return ifr.ifr_mtu;
+}
+
+bool tunnel_set_mtu(char *dev_name, int mtu)
+{
+    struct ifreq ifr = {0};
+
+    ifr.ifr_mtu = mtu;
+    return tunnel_mtu_ioctl(dev_name, SIOCSIFMTU, &ifr);
+}
+
+/* Size of a packet buffer for a tunnel of the given MTU: a whole IP packet,
+ * rounded up to cache lines so buffers don't share one. Buffers are sized
+ * once at startup, the MTU must not be raised while the routers run */
+int tunnel_buffer_size(int mtu)
+{
+    return (mtu + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+}
+
+/* Have every packet of tun_fd (opened with IFF_VNET_HDR) carry a
+ * virtio_net_hdr and let the kernel hand over TCP / UDP packets with
+ * partial checksums and as GSO super-packets. UDP segmentation offload
+ * (only taken for IPv4 and IPv6 together) is left out on kernels without it */
+bool tunnel_enable_vnet_hdr(int tun_fd)
+{
+    int hdr_size = sizeof(struct virtio_net_hdr);
+    unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO_ECN;
+
+    if (ioctl(tun_fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+        printf("\n Unable to set virtio header size of tun fd (%d) - %s", tun_fd, strerror(errno));
+        return false;
+    }
+    if (ioctl(tun_fd, TUNSETOFFLOAD, offloads | TUN_F_USO4 | TUN_F_USO6) == 0) {
+        return true;
+    }
+    if (ioctl(tun_fd, TUNSETOFFLOAD, offloads) < 0) {
+        printf("\n Unable to set offloads of tun fd (%d) - %s", tun_fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool tun_vnet_init(struct tun_vnet *vnet, int buf_size)
+{
+    memset(vnet, 0, sizeof(*vnet));
+    vnet->buf_size = buf_size;
+    vnet->super = (char *) malloc (TUN_GSO_MAX_SIZE);
+    if (!vnet->super) {
         printf("\n Unable to allocate memory - %s", strerror(errno));
-        exit(-1);
+        return false;
+    }
+    return true;
+}
+
+void tun_vnet_destroy(struct tun_vnet *vnet)
+{
+    free(vnet->super);
+    vnet->super = NULL;
+}
+
+/* router_tun_read() for a tunnel opened with IFF_VNET_HDR: the header
+ * goes to vnet->hdr, the packet into pkt's buffer and, past it's end, into
+ * vnet->super. Partial checksums are completed; a GSO super-packet is left
+ * for the caller to segment (see tun_vnet_is_super())
+ * Returns the packet length, 0 when the packet is unusable and -1 when
+ * nothing more can be read (EAGAIN / error) */
+int router_tun_read_vnet(struct tun_vnet *vnet, int tun_fd, struct packet *pkt)
+{
+    struct iovec iov[3];
+    int hdr_size = sizeof(vnet->hdr);
+    int recv_bytes = 0;
+
+    iov[0].iov_base = &vnet->hdr;
+    iov[0].iov_len = hdr_size;
+    iov[1].iov_base = pkt->data;
+    iov[1].iov_len = vnet->buf_size;
+    iov[2].iov_base = vnet->super + vnet->buf_size;
+    iov[2].iov_len = TUN_GSO_MAX_SIZE - vnet->buf_size;
+
+    recv_bytes = readv(tun_fd, iov, 3);
+    if (recv_bytes < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            printf("\n Error reading from tun fd (%d)", tun_fd);
+        }
+        return -1;
+    }
+#ifdef PACKET_TRACE
+    pkt->trace_time = trace_now();
+#endif
+    if (recv_bytes < hdr_size) {
+        return 0;
     }
+    recv_bytes -= hdr_size;
 
-    memset(message, 0, recv_bytes+1);
-    memcpy(message, buffer, recv_bytes + 1);
-    *msg_size = recv_bytes + 1;
-    return message;
-                        
+    vnet->super_len = (recv_bytes > vnet->buf_size) ? recv_bytes : 0;
+    pkt->len = vnet->super_len ? vnet->buf_size : recv_bytes;
+    if (tun_vnet_is_super(vnet)) {
+        return recv_bytes;
+    }
+    if (!gso_complete_csum(&vnet->hdr, pkt->data, recv_bytes)) {
+        return 0;
+    }
+    return recv_bytes;
 }
 
-/* Write the given message into tunnel (tun_fd) */
-void router_tun_send(int tun_fd, char *message, int msg_size)
+/* router_tun_send() for a tunnel opened with IFF_VNET_HDR. The packet is
+ * whole and it's checksums are complete, so the header is all zeroes */
+bool router_tun_send_vnet(int tun_fd, char *message, int msg_size)
 {
-    int send_bytes = 0;
+    static const struct virtio_net_hdr hdr = {0};
+    struct iovec iov[2];
 
     if (!message) {
         printf("\n No message to send via tun device");
-        return;
+        return false;
+    }
+
+    iov[0].iov_base = (void *) &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = message;
+    iov[1].iov_len = msg_size;
+    return writev(tun_fd, iov, 2) >= 0;
+}
+
+/* The packet last read by router_tun_read_vnet() has to be segmented
+ * before it can be forwarded */
+bool tun_vnet_is_super(struct tun_vnet *vnet)
+{
+    return vnet->super_len || gso_is_super_packet(&vnet->hdr);
+}
+
+/* Cut the super-packet last read by router_tun_read_vnet() into pkt
+ * into segments from pool, see gso_segment(). If it didn't fit pkt's
+ * buffer it is put back together in vnet->super first
+ * Returns the number of segments, -1 if the packet can't be segmented */
+int tun_vnet_segment(struct tun_vnet *vnet, struct packet *pkt, struct packet_pool *pool,
+        struct packet **segs, int max_segs)
+{
+    if (!gso_is_super_packet(&vnet->hdr)) {
+        /* Larger than the MTU without being a super-packet */
+        return -1;
+    }
+    if (vnet->super_len) {
+        memcpy(vnet->super, pkt->data, vnet->buf_size);
+        return gso_segment(&vnet->hdr, vnet->super, vnet->super_len, pool, segs, max_segs);
+    }
+    return gso_segment(&vnet->hdr, pkt->data, pkt->len, pool, segs, max_segs);
+}
+
+/* Set up io_uring for the tunnel queue tun_fd, reading into and writing
+ * from buffers of pool. The pool's buffer area is registered once, so
+ * writes skip mapping it per request
+ * Returns false if io_uring can't be used; the caller falls back to
+ * read() / write() */
+bool tun_uring_init(struct tun_uring *tu, int tun_fd, struct packet_pool *pool)
+{
+    struct iovec iov;
+
+    memset(tu, 0, sizeof(*tu));
+    tu->tun_fd = tun_fd;
+    tu->pool = pool;
+
+    /* Buffer ids are packet indexes */
+    if (pool->size > UINT16_MAX + 1) {
+        printf("\n Pool of %d packets too large for io_uring", pool->size);
+        return false;
+    }
+    if (!uring_init(&tu->ring, TUN_URING_ENTRIES)) {
+        return false;
     }
 
-    send_bytes = write(tun_fd, message, msg_size);
-    if (send_bytes < 0) {
-        printf("\n Error writing to tun fd (%d)", tun_fd);
-        return;
+    iov.iov_base = pool->buffers;
+    iov.iov_len = pool->buffers_len;
+    if (!uring_register_buffers(&tu->ring, &iov, 1) ||
+        !uring_setup_buf_ring(&tu->ring, TUN_URING_RX_BUFFERS, 0)) {
+        uring_destroy(&tu->ring);
+        return false;
     }
-    printf("\n Sent message of length %d via tun device", send_bytes);
+
+    tun_uring_refill(tu);
+    tun_uring_submit(tu);
+    return true;
+}
+
+/* Tear the ring down. Buffers still lent to the kernel belong to the pool
+ * and go away with it */
+void tun_uring_destroy(struct tun_uring *tu)
+{
+    uring_destroy(&tu->ring);
+}
+
+/* Lend pool buffers to the kernel until TUN_URING_RX_BUFFERS are posted
+ * and (re)post the multishot read if it has stopped */
+void tun_uring_refill(struct tun_uring *tu)
+{
+    struct io_uring_sqe *sqe = NULL;
+    struct packet *pkt = NULL;
+    int added = 0;
+
+    while (tu->rx_posted < TUN_URING_RX_BUFFERS) {
+        pkt = packet_alloc(tu->pool);
+        if (!pkt) {
+            break;
+        }
+        uring_buf_ring_add(&tu->ring, pkt->data, tu->pool->buf_size, pkt - tu->pool->packets);
+        tu->rx_posted++;
+        added++;
+    }
+    if (added) {
+        uring_buf_ring_publish(&tu->ring);
+    }
+
+    if (!tu->read_armed && tu->rx_posted > 0) {
+        sqe = uring_get_sqe(&tu->ring);
+        if (sqe) {
+            uring_prep_read_multishot(sqe, tu->tun_fd, 0, 0);
+            tu->read_armed = true;
+        }
+    }
+}
+
+/* Next packet read from the tunnel, unparsed, NULL once every completion
+ * has been handled. Completed writes hand their packet back to the pool on
+ * the way. The caller owns the returned packet */
+struct packet *tun_uring_receive(struct tun_uring *tu)
+{
+    struct io_uring_cqe *cqe = NULL;
+    struct packet *pkt = NULL;
+    uint64_t user_data = 0;
+    uint32_t flags = 0;
+    int res = 0;
+
+    while ((cqe = uring_peek_cqe(&tu->ring))) {
+        user_data = cqe->user_data;
+        flags = cqe->flags;
+        res = cqe->res;
+        uring_cqe_seen(&tu->ring);
+
+        if (user_data != 0) {
+            /* A write, user_data is it's packet */
+            if (res < 0) {
+                tu->write_errors++;
+            }
+            packet_free(tu->pool, (struct packet *) (uintptr_t) user_data);
+            continue;
+        }
+
+        if (!(flags & IORING_CQE_F_MORE)) {
+            /* The read stopped (out of buffers or error), post it again */
+            tu->read_armed = false;
+        }
+        if (!(flags & IORING_CQE_F_BUFFER)) {
+            if (res < 0 && res != -ENOBUFS) {
+                printf("\n Error reading from tun fd (%d) - %s", tu->tun_fd, strerror(-res));
+            }
+            continue;
+        }
+
+        tu->rx_posted--;
+        pkt = &tu->pool->packets[flags >> IORING_CQE_BUFFER_SHIFT];
+#ifdef PACKET_TRACE
+        pkt->trace_time = trace_now();
+#endif
+        if (res > 0) {
+            pkt->len = res;
+            return pkt;
+        }
+        packet_free(tu->pool, pkt);
+    }
+    return NULL;
+}
+
+/* Queue pkt to be written to the tunnel. The packet goes back to the pool
+ * once the write completes
+ * Returns false (and frees pkt) if no submission entry is available */
+bool tun_uring_send(struct tun_uring *tu, struct packet *pkt)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&tu->ring);
+
+    if (!sqe) {
+        packet_free(tu->pool, pkt);
+        return false;
+    }
+    uring_prep_write_fixed(sqe, tu->tun_fd, pkt->data, pkt->len, 0, (uint64_t) (uintptr_t) pkt);
+    return true;
+}
+
+/* Submit every queued read and write with a single syscall */
+void tun_uring_submit(struct tun_uring *tu)
+{
+    uring_submit(&tu->ring);
 }
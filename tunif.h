@@ -1,10 +1,80 @@
 #ifndef TUNIF
 #define TUNIF
 
+#include <stdbool.h>
+#include <linux/virtio_net.h>
+
+#include "packet_pool.h"
+#include "uring.h"
+
+/* Size of the stage 1 messages and of the scratch buffers of packets that
+ * are only drained. Packet buffers are sized by the tunnel's MTU instead,
+ * see tunnel_buffer_size() */
 #define MAX_BUFFER_SIZE 1024
 
+/* MTU of a tunnel whose MTU can't be read */
+#define TUN_DEFAULT_MTU 1500
+
+/* Largest GSO super-packet the kernel hands over with IFF_VNET_HDR, and
+ * most segments it is cut into. Ones with a smaller MSS are dropped */
+#define TUN_GSO_MAX_SIZE 65536
+#define TUN_GSO_MAX_SEGS 128
+
+/* Tunnel buffers kept posted for the multishot read (a power of 2) and
+ * size of the submission queue */
+#define TUN_URING_RX_BUFFERS 256
+#define TUN_URING_ENTRIES    512
+
+/* io_uring backend of a tunnel queue. A multishot read stays posted and
+ * reads into pool buffers lent to the kernel; writes go out of the pool's
+ * registered buffer area and are submitted in batches. Failed writes are
+ * counted for the caller */
+struct tun_uring
+{
+    struct uring ring;
+    int tun_fd;
+    struct packet_pool *pool;
+    int rx_posted;
+    bool read_armed;
+    uint64_t write_errors;
+};
+
+/* State of a tunnel queue opened with IFF_VNET_HDR. Every packet comes
+ * with a virtio_net_hdr in front of it, kept here until the next read.
+ * Packets up to the MTU are read straight into a pool buffer; the rest of
+ * a GSO super-packet spills over into super, where it is put together
+ * again only if it has to be segmented (see tun_vnet_segment()) */
+struct tun_vnet
+{
+    struct virtio_net_hdr hdr;
+    char *super;
+    int super_len;                 /* Length of the last packet read if it
+                                    * didn't fit a pool buffer, 0 otherwise */
+    int buf_size;
+};
+
 int tunnel_init(char *dev_name, int flags);
-char *router_tun_receive(int tun_fd, int *msg_size);
-void router_tun_send(int tun_fd, char *message, int msg_size);
+bool tunnel_init_multi_queue(char *dev_name, int flags, int *fds, int num_queues);
+int router_tun_filter(struct packet *pkt, int recv_bytes);
+int router_tun_read(int tun_fd, struct packet *pkt, int buf_size);
+int router_tun_receive(int tun_fd, struct packet *pkt, int buf_size);
+bool router_tun_send(int tun_fd, char *message, int msg_size);
+int tunnel_get_mtu(char *dev_name);
+bool tunnel_set_mtu(char *dev_name, int mtu);
+int tunnel_buffer_size(int mtu);
+bool tunnel_enable_vnet_hdr(int tun_fd);
+bool tun_vnet_init(struct tun_vnet *vnet, int buf_size);
+void tun_vnet_destroy(struct tun_vnet *vnet);
+int router_tun_read_vnet(struct tun_vnet *vnet, int tun_fd, struct packet *pkt);
+bool router_tun_send_vnet(int tun_fd, char *message, int msg_size);
+bool tun_vnet_is_super(struct tun_vnet *vnet);
+int tun_vnet_segment(struct tun_vnet *vnet, struct packet *pkt, struct packet_pool *pool,
+        struct packet **segs, int max_segs);
+bool tun_uring_init(struct tun_uring *tu, int tun_fd, struct packet_pool *pool);
+void tun_uring_destroy(struct tun_uring *tu);
+void tun_uring_refill(struct tun_uring *tu);
+struct packet *tun_uring_receive(struct tun_uring *tu);
+bool tun_uring_send(struct tun_uring *tu, struct packet *pkt);
+void tun_uring_submit(struct tun_uring *tu);
 
 #endif 
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Create a ring with <entries> submission slots and map it's queues
+ * Returns false if the kernel has no (usable) io_uring */
+bool uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    char *sq = NULL;
+    char *cq = NULL;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->event_fd = -1;
+
+    /* By default completions of requests the kernel had to wait for are
+     * posted by task work that interrupts the task like a signal would, so
+     * epoll_wait() fails with EINTR. Deferred, the work is only run when
+     * asked for in uring_get_events() and the ring fd polls readable while
+     * some is pending */
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        printf("\n Unable to set up io_uring - %s", strerror(errno));
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        printf("\n io_uring of this kernel is too old");
+        close(ring->fd);
+        return false;
+    }
+
+    /* Both queues share one mapping */
+    ring->queues_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->queues_len) {
+        ring->queues_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+
+    sq = (char *) mmap(NULL, ring->queues_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        printf("\n Unable to map io_uring queues - %s", strerror(errno));
+        close(ring->fd);
+        return false;
+    }
+    ring->queues = sq;
+    cq = sq;
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        printf("\n Unable to map io_uring entries - %s", strerror(errno));
+        munmap(ring->queues, ring->queues_len);
+        close(ring->fd);
+        return false;
+    }
+
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->event_fd < 0) {
+        printf("\n Unable to create eventfd - %s", strerror(errno));
+        uring_destroy(ring);
+        return false;
+    }
+    if (uring_register(ring->fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) < 0) {
+        printf("\n Unable to register io_uring eventfd - %s", strerror(errno));
+        uring_destroy(ring);
+        return false;
+    }
+    return true;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    if (ring->buf_ring) {
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    }
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->queues, ring->queues_len);
+    if (ring->event_fd >= 0) {
+        close(ring->event_fd);
+    }
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    ring->event_fd = -1;
+}
+
+/* Register buffers with the kernel so fixed reads / writes skip mapping
+ * them on every request. Buffer i is used through buf_index i */
+bool uring_register_buffers(struct uring *ring, struct iovec *iovs, unsigned count)
+{
+    if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovs, count) < 0) {
+        printf("\n Unable to register io_uring buffers - %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Set up a ring of <entries> (a power of 2) provided buffers as buffer
+ * group <group>. Buffers are added with uring_buf_ring_add() */
+bool uring_setup_buf_ring(struct uring *ring, unsigned entries, uint16_t group)
+{
+    struct io_uring_buf_reg reg;
+
+    ring->buf_ring_len = entries * sizeof(struct io_uring_buf);
+    ring->buf_ring = (struct io_uring_buf_ring *) mmap(NULL, ring->buf_ring_len,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        printf("\n Unable to allocate io_uring buffer ring - %s", strerror(errno));
+        ring->buf_ring = NULL;
+        return false;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        printf("\n Unable to register io_uring buffer ring - %s", strerror(errno));
+        munmap(ring->buf_ring, ring->buf_ring_len);
+        ring->buf_ring = NULL;
+        return false;
+    }
+    ring->buf_entries = entries;
+    ring->buf_group = group;
+    ring->buf_tail = 0;
+    return true;
+}
+
+/* Give the kernel buffer <bid> at addr to read into. It becomes visible
+ * with the next uring_buf_ring_publish() */
+void uring_buf_ring_add(struct uring *ring, void *addr, unsigned len, uint16_t bid)
+{
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_entries - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) addr;
+    buf->len = len;
+    buf->bid = bid;
+    ring->buf_tail++;
+}
+
+void uring_buf_ring_publish(struct uring *ring)
+{
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Next free submission entry, cleared. When the queue is full what is
+ * queued is submitted first; NULL if that does not free up an entry */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe = NULL;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sqe_tail - head > *ring->sq_mask) {
+        uring_submit(ring);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head > *ring->sq_mask) {
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+    ring->sqe_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+/* Hand every queued entry to the kernel with a single syscall
+ * Returns the number of entries submitted */
+int uring_submit(struct uring *ring)
+{
+    int ret = 0;
+
+    if (ring->to_submit == 0) {
+        return 0;
+    }
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    do {
+        ret = uring_enter(ring->fd, ring->to_submit, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        printf("\n Unable to submit to io_uring - %s", strerror(errno));
+        return ret;
+    }
+    ring->to_submit -= ret;
+    return ret;
+}
+
+/* Post the completions of requests that finished since the last call.
+ * Called when event_fd is readable, whose counter it resets */
+void uring_get_events(struct uring *ring)
+{
+    uint64_t count = 0;
+    int ret = 0;
+
+    if (read(ring->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        printf("\n Unable to read eventfd (%d) - %s", ring->event_fd, strerror(errno));
+    }
+
+    do {
+        ret = uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        printf("\n Unable to get io_uring events - %s", strerror(errno));
+    }
+}
+
+/* Oldest completion not seen yet, NULL if there is none */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/* Done with the completion returned by uring_peek_cqe() */
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Keep reading from fd into buffers picked from buffer group <group>,
+ * posting a completion per read until the request is cancelled or runs out
+ * of buffers (completion without IORING_CQE_F_MORE) */
+void uring_prep_read_multishot(struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data)
+{
+    sqe->opcode = URING_OP_READ_MULTISHOT;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+/* Write len bytes at buf, which lies in registered buffer <buf_index>, to fd */
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len,
+        uint16_t buf_index, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = (uint64_t) -1;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,63 @@
+#ifndef URING
+#define URING
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Multishot read (Linux 6.7). Older headers don't have it in their opcode
+ * enum, and the enum can't be tested for, so it gets a name of it's own */
+#define URING_OP_READ_MULTISHOT 49
+
+/* Minimal io_uring, set up with raw syscalls (no liburing). Meant for a
+ * single thread: one submitter, one reaper, and it has to be the thread
+ * that created the ring */
+struct uring
+{
+    int fd;
+    int event_fd;
+    void *queues;
+    size_t queues_len;
+
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned sqe_tail;
+    unsigned to_submit;
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Provided buffer ring, for multishot reads */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    unsigned buf_entries;
+    uint16_t buf_group;
+    uint16_t buf_tail;
+};
+
+bool uring_init(struct uring *ring, unsigned entries);
+void uring_destroy(struct uring *ring);
+bool uring_register_buffers(struct uring *ring, struct iovec *iovs, unsigned count);
+bool uring_setup_buf_ring(struct uring *ring, unsigned entries, uint16_t group);
+void uring_buf_ring_add(struct uring *ring, void *addr, unsigned len, uint16_t bid);
+void uring_buf_ring_publish(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring);
+void uring_get_events(struct uring *ring);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+void uring_prep_read_multishot(struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data);
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len,
+        uint16_t buf_index, uint64_t user_data);
+
+#endif